@@ -86,6 +86,11 @@ typedef struct radclient {
 							//!< clients.
 
 	bool			rate_limit;		//!< Where addition of clients should be rate limited.
+
+	uint32_t		negative_lifetime;	//!< How long to remember IPs which the virtual
+							//!< server didn't create a client for.
+	uint32_t		negative_max;		//!< Maximum number of IPs to remember.
+	struct client_negative	*negative;		//!< IPs which aren't clients.
 #endif
 
 #ifdef WITH_COA
@@ -144,6 +149,10 @@ bool		client_add(RADCLIENT_LIST *clients, RADCLIENT *client);
 void		client_delete(RADCLIENT_LIST *clients, RADCLIENT *client);
 
 RADCLIENT	*client_afrom_request(RADCLIENT_LIST *clients, REQUEST *request);
+
+bool		client_negative_find(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now);
+
+void		client_negative_add(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now);
 #endif
 
 int		client_map_section(CONF_SECTION *out, CONF_SECTION const *map, client_value_cb_t func, void *data);
@@ -95,6 +95,20 @@ fr_connection_pool_t	*fr_connection_pool_copy(TALLOC_CTX *ctx, fr_connection_poo
  */
 int	fr_connection_pool_get_num(fr_connection_pool_t *pool);
 
+typedef struct fr_connection_pool_stats_t {
+	char const	*name;			//!< The pool's log prefix.
+	uint32_t	num;			//!< Connections open.
+	uint32_t	active;			//!< Connections reserved.
+	uint32_t	pending;		//!< Connections being opened.
+	uint32_t	max;
+	uint64_t	opened;			//!< Connections opened over the lifetime of the pool.
+	time_t		last_at_max;		//!< Last time all connections were in use.
+} fr_connection_pool_stats_t;
+
+typedef void (*fr_connection_pool_stats_cb_t)(void *ctx, fr_connection_pool_stats_t const *stats);
+
+void	fr_connection_pool_stats_walk(fr_connection_pool_stats_cb_t callback, void *ctx);
+
 /*
  *	Pool management
  */
@@ -111,6 +125,8 @@ void	*fr_connection_reconnect(fr_connection_pool_t *pool, void *conn);
 
 int	fr_connection_close(fr_connection_pool_t *pool, void *conn);
 
+uint64_t fr_connection_wait_usec(void);
+
 #ifdef __cplusplus
 }
 #endif
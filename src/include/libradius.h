@@ -788,6 +788,8 @@ void		fr_rand_seed(void const *, size_t ); /* seed the random pool */
 
 /* crypt wrapper from crypt.c */
 int		fr_crypt_check(char const *key, char const *salt);
+int		fr_crypt_pool_init(uint32_t num_threads, uint32_t max_queue);
+void		fr_crypt_pool_free(void);
 
 /* cbuff.c */
 
@@ -913,6 +915,7 @@ fr_fifo_t	*fr_fifo_create(TALLOC_CTX *ctx, int max_entries, fr_fifo_free_t freeN
 void		fr_fifo_free(fr_fifo_t *fi);
 int		fr_fifo_push(fr_fifo_t *fi, void *data);
 void		*fr_fifo_pop(fr_fifo_t *fi);
+void		*fr_fifo_pop_tail(fr_fifo_t *fi);
 void		*fr_fifo_peek(fr_fifo_t *fi);
 unsigned int	fr_fifo_num_elements(fr_fifo_t *fi);
 
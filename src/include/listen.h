@@ -39,6 +39,7 @@ typedef enum RAD_LISTEN_TYPE {
 	RAD_LISTEN_DHCP,
 	RAD_LISTEN_COMMAND,
 	RAD_LISTEN_COA,
+	RAD_LISTEN_METRICS,
 	RAD_LISTEN_MAX
 } RAD_LISTEN_TYPE;
 
@@ -48,6 +48,36 @@ void modcall_debug(modcallable *mc, int depth);
 
 int modcall_pass2_condition(fr_cond_t *c);
 
+/*
+ *	How long modules and sections take.  Bucket N of the
+ *	histogram counts calls which took 2^N to 2^(N+1) - 1
+ *	microseconds, except for bucket 0, which also counts calls
+ *	that took no time at all.
+ */
+#define MODCALL_STATS_BUCKETS	(32)
+
+typedef enum modcall_stats_type_t {
+	MODCALL_STATS_MODULE = 0,
+	MODCALL_STATS_SECTION
+} modcall_stats_type_t;
+
+typedef struct modcall_stats_t {
+	modcall_stats_type_t	type;
+	char const		*name;		//!< Module instance, or section.
+	uint64_t		calls;
+	uint64_t		errors;		//!< Calls which returned fail or invalid.
+	uint64_t		total_usec;
+	uint64_t		max_usec;
+	uint64_t		pool_wait_usec;	//!< Of total_usec, spent getting pool connections.
+	uint64_t		histogram[MODCALL_STATS_BUCKETS];
+} modcall_stats_t;
+
+typedef void (*modcall_stats_cb_t)(void *ctx, modcall_stats_t const *stats);
+
+void modcall_stats_walk(modcall_stats_cb_t callback, void *ctx);
+void modcall_stats_reset(void);
+uint64_t modcall_stats_percentile(modcall_stats_t const *stats, unsigned int percent);
+
 #ifdef __cplusplus
 }
 #endif
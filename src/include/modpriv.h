@@ -51,6 +51,10 @@ typedef struct module_instance_t {
 	CONF_SECTION		*cs;
 	time_t			last_hup;
 	bool			instantiated;
+#ifdef HAVE_PTHREAD_H
+	bool			instantiating;		//!< Being instantiated by instantiating_thread.
+	pthread_t		instantiating_thread;
+#endif
 	bool			force;
 	rlm_rcode_t		code;
 	fr_module_hup_t	       	*mh;
@@ -61,6 +65,10 @@ module_instance_t	*module_instantiate_method(CONF_SECTION *modules, char const *
 module_instance_t	*module_find(CONF_SECTION *modules, char const *askedname);
 int			find_module_sibling_section(CONF_SECTION **out, CONF_SECTION *module, char const *name);
 int			module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when);
+#ifdef HAVE_PTHREAD_H
+void			module_instantiate_unlock(void);
+void			module_instantiate_relock(void);
+#endif
 
 #ifdef __cplusplus
 }
@@ -166,7 +166,9 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request);
  *	For now, these are strongly tied together.
  */
 int virtual_servers_load(CONF_SECTION *config);
-void virtual_servers_free(time_t when);
+void virtual_servers_free(bool all);
+server_generation_t *virtual_servers_pin(REQUEST *parent);
+bool virtual_servers_unpin(server_generation_t *gen);
 
 #ifdef __cplusplus
 }
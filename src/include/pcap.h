@@ -30,8 +30,22 @@
 #include <sys/types.h>
 #include <pcap.h>
 
+#ifdef __linux__
+#  include <linux/if_packet.h>
+#endif
+
+/*
+ *	On Linux we can bypass libpcap, and read packets directly
+ *	from a TPACKET_V3 ring.
+ */
+#ifdef TPACKET3_HDRLEN
+#  define WITH_PCAP_RING
+#endif
+
 #define SNAPLEN ETHER_HDR_LEN + IP_HDR_LEN + sizeof(struct udp_header) + MAX_RADIUS_LEN
 #define PCAP_BUFFER_DEFAULT (10000)
+#define PCAP_RING_BLOCKS_DEFAULT (64)
+#define PCAP_RING_TIMEOUT_DEFAULT (10)
 /*
  *	It's unclear why this differs between platforms
  */
@@ -77,6 +91,17 @@ struct fr_pcap {
 	int			buffer_pkts;			//!< How big to make the PCAP ring buffer.
 								//!< Actual buffer size is SNAPLEN * buffer.
 								//!< Only valid for live capture handles.
+	uint16_t		fanout_group;			//!< PACKET_FANOUT group to join, 0 for none.
+								//!< Handles in the same group on the same
+								//!< interface share its packets between them.
+								//!< Only valid for live capture handles.
+	uint32_t		ring_block_size;		//!< Size of each block in our own TPACKET_V3
+								//!< ring, 0 to let libpcap capture packets.
+								//!< Must be a power of 2 multiple of the page size.
+								//!< Only valid for live capture handles.
+	uint32_t		ring_block_nr;			//!< Number of blocks in the ring.
+	uint32_t		ring_block_timeout;		//!< How long (ms) the kernel waits before handing
+								//!< us a block which isn't full.
 
 	pcap_t			*handle;			//!< libpcap handle.
 	pcap_dumper_t		*dumper;			//!< libpcap dumper handle.
@@ -86,13 +111,28 @@ struct fr_pcap {
 	int			fd;				//!< Selectable file descriptor we feed to select.
 	struct pcap_stat	pstats;				//!< The last set of pcap stats for this handle.
 
+#ifdef WITH_PCAP_RING
+	uint8_t			*ring;				//!< Memory mapped ring, handle is then a dead
+								//!< handle only used for compiling filters.
+	uint32_t		ring_block;			//!< Next block the kernel will hand us.
+	struct pcap_stat	ring_stats;			//!< Kernel counters, which reset each time
+								//!< they're read.
+#endif
+
 	fr_pcap_t		*next;				//!< Next handle in collection.
 };
 
+/** Called for each packet read by fr_pcap_dispatch()
+ *
+ */
+typedef void (*fr_pcap_handler_t)(void *ctx, struct pcap_pkthdr const *header, uint8_t const *data);
+
 int		fr_pcap_if_link_layer(char *errbuff, pcap_if_t *dev);
 fr_pcap_t	*fr_pcap_init(TALLOC_CTX *ctx, char const *name, fr_pcap_type_t type);
 int		fr_pcap_open(fr_pcap_t *handle);
 int		fr_pcap_apply_filter(fr_pcap_t *handle, char const *expression);
+int		fr_pcap_dispatch(fr_pcap_t *handle, int max, fr_pcap_handler_t callback, void *ctx);
+int		fr_pcap_stats(fr_pcap_t *handle, struct pcap_stat *stats);
 char		*fr_pcap_device_names(TALLOC_CTX *ctx, fr_pcap_t *handle, char c);
 #endif
 #endif
@@ -34,6 +34,7 @@ RCSIDH(radiusd_h, "$Id$")
 #include <freeradius-devel/connection.h>
 
 typedef struct rad_request REQUEST;
+typedef struct fr_trace_t fr_trace_t;
 
 #include <freeradius-devel/log.h>
 
@@ -80,6 +81,11 @@ extern "C" {
  */
 typedef struct request_data_t request_data_t;
 
+/*
+ *	See modules.c
+ */
+typedef struct server_generation_t server_generation_t;
+
 /** Return codes indicating the result of the module call
  *
  * All module functions must return one of the codes listed below (apart from
@@ -137,6 +143,14 @@ typedef struct main_config {
 							//!< timing out.
 	uint32_t	cleanup_delay;			//!< How long before cleaning up cached responses.
 	uint32_t	max_requests;
+	uint32_t	instantiate_threads;		//!< How many threads to use when instantiating modules.
+	bool		lazy_virtual_servers;		//!< Compile virtual servers without listeners
+							//!< when they're first used.
+
+	uint32_t	trace_sample_rate;		//!< Trace one in this many requests.  0 is off.
+	char const	*trace_file;			//!< Where to write the traces.
+	uint32_t	trace_max_size;			//!< Rotate the trace file when it gets this big.
+	uint32_t	trace_max_files;		//!< How many rotated trace files to keep.
 
 	uint32_t	debug_level;
 	char const	*log_file;
@@ -162,6 +176,8 @@ typedef struct main_config {
 							//!< Can only be used when the server is running in single
 							//!< threaded mode.
 
+	bool		spawn_workers;			//!< Whether the server will run with child threads.
+
 	bool		allow_core_dumps;		//!< Whether the server is allowed to drop a core when
 							//!< receiving a fatal signal.
 
@@ -282,8 +298,12 @@ struct rad_request {
 #endif
 
 	char const		*server;
+	server_generation_t	*generation;	//!< Generation of virtual servers the request is pinned to.
 	REQUEST			*parent;
 
+	fr_trace_t		*trace;		//!< Spans recorded for this request.  NULL if it isn't
+						//!< being traced.
+
 	struct {
 		radlog_func_t	func;		//!< Function to call to output log messages about this
 						//!< request.
@@ -360,7 +380,8 @@ typedef enum {
 	RADIUS_SIGNAL_SELF_EXIT		= (1 << 2),
 	RADIUS_SIGNAL_SELF_DETAIL	= (1 << 3),
 	RADIUS_SIGNAL_SELF_NEW_FD	= (1 << 4),
-	RADIUS_SIGNAL_SELF_MAX		= (1 << 5)
+	RADIUS_SIGNAL_SELF_RECLAIM	= (1 << 5),
+	RADIUS_SIGNAL_SELF_MAX		= (1 << 6)
 } radius_signal_t;
 /*
  *	Function prototypes.
@@ -489,6 +510,12 @@ int radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **
 void exec_trigger(REQUEST *request, CONF_SECTION *cs, char const *name, int quench)
      CC_HINT(nonnull (3));
 
+typedef struct radius_helper radius_helper_t;
+radius_helper_t *radius_helper_start(TALLOC_CTX *ctx, char const *cmd);
+int radius_helper_write(radius_helper_t *helper, char const *data, size_t len, struct timeval *timeout);
+ssize_t radius_helper_read_line(radius_helper_t *helper, char *out, size_t outlen,
+				struct timeval const *deadline);
+
 /* valuepair.c */
 int paircompare_register_byname(char const *name, DICT_ATTR const *from,
 				bool first_only, RAD_COMPARE_FUNC func, void *instance);
@@ -532,14 +559,65 @@ void	thread_pool_stop(void);
 int	thread_pool_addrequest(REQUEST *, RAD_REQUEST_FUNP);
 pid_t	rad_fork(void);
 pid_t	rad_waitpid(pid_t pid, int *status);
+pid_t	rad_waitpid_timeout(pid_t pid, int *status, int timeout);
 int	total_active_threads(void);
 void	thread_pool_lock(void);
 void	thread_pool_unlock(void);
 void	thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2]);
 
+/*
+ *	Why the thread pool threw a request away without processing it.
+ */
+typedef enum {
+	QUEUE_SHED_FULL = 0,			//!< The queue was at max_queue_size.
+	QUEUE_SHED_ACCT_LIMIT,			//!< auto_limit_acct.
+	QUEUE_SHED_AUTH_DELAY,			//!< Access-Request waited longer than queue_target_auth.
+	QUEUE_SHED_ACCT_DELAY,			//!< Accounting-Request waited longer than queue_target_acct.
+	QUEUE_SHED_MAX
+} queue_shed_t;
+
+void	thread_pool_shed_stats(uint64_t shed[QUEUE_SHED_MAX]);
+
+/*
+ *	What the thread pool is doing, and why.  See thread_pool_auto_size().
+ */
+typedef struct thread_pool_stats_t {
+	bool		auto_size;		//!< Whether the pool sizes itself from queue wait.
+	uint32_t	total_threads;
+	uint32_t	active_threads;
+	uint32_t	min_threads;		//!< start_servers.
+	uint32_t	max_threads;		//!< max_servers.
+	uint32_t	queued;			//!< Requests waiting for a thread.
+	uint32_t	wait_usec;		//!< Queue wait seen at the last check.
+	uint32_t	cpu_percent;		//!< How much of request processing is on CPU.
+	uint32_t	useful_threads;		//!< Most threads which can be kept busy.
+	uint64_t	spawned;		//!< Threads started by the controller.
+	uint64_t	retired;		//!< Threads stopped by the controller.
+	uint64_t	cpu_bound;		//!< Times requests were queued, but more threads wouldn't help.
+	char const	*last_action;		//!< What the controller did last.
+	time_t		last_action_time;
+} thread_pool_stats_t;
+
+void	thread_pool_stats(thread_pool_stats_t *stats);
+
+/* trace.c */
+typedef enum {
+	REQUEST_TRACE_QUEUE = 0,		//!< Waiting for a thread.
+	REQUEST_TRACE_PROXY,			//!< Waiting for a home server.
+	REQUEST_TRACE_MAX
+} request_trace_t;
+
+uint64_t request_trace_now(void);
+void	request_trace_start(REQUEST *request);
+void	request_trace_span(REQUEST *request, char const *cat, char const *name, uint64_t start);
+void	request_trace_begin(REQUEST *request, request_trace_t which);
+void	request_trace_end(REQUEST *request, request_trace_t which);
+void	request_trace_finish(REQUEST *request);
+
 #ifndef HAVE_PTHREAD_H
 #  define rad_fork(n) fork()
 #  define rad_waitpid(a,b) waitpid(a,b, 0)
+#  define rad_waitpid_timeout(a,b,c) waitpid(a,b, WNOHANG)
 #endif
 
 /* main_config.c */
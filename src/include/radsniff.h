@@ -35,6 +35,15 @@ RCSIDH(radsniff_h, "$Id$")
 #  include <collectd/client.h>
 #endif
 
+/*
+ *	Worker threads each need their own copy of the analysis state
+ *	(trees, event list etc...), which we get from thread local storage.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(__THREAD)
+#  define WITH_RS_THREADS
+#  include <pthread.h>
+#endif
+
 #define RS_DEFAULT_PREFIX	"radsniff"	//!< Default instance
 #define RS_DEFAULT_SECRET	"testing123"	//!< Default secret
 #define RS_DEFAULT_TIMEOUT	5200		//!< Standard timeout of 5s + 300ms to cover network latency
@@ -42,6 +51,21 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_THREADS_MAX		64		//!< Maximum number of worker threads.
+#define RS_THREAD_BATCH		64		//!< Packets read from a file are handed to workers in
+						//!< batches of this many.
+#define RS_THREAD_QUEUE_MAX	16384		//!< Maximum number of packets queued for each worker.
+#define RS_PEERS_MAX		1024		//!< Maximum number of clients and servers we keep latency
+						//!< histograms for.
+
+/*
+ *	Latency histogram buckets.  Values below RS_HIST_SUB_COUNT get a bucket
+ *	each, above that every power of two is split into RS_HIST_SUB_COUNT
+ *	buckets, so the error is always less than 1/RS_HIST_SUB_COUNT.
+ */
+#define RS_HIST_SUB_BITS	(5)
+#define RS_HIST_SUB_COUNT	(1 << RS_HIST_SUB_BITS)
+#define RS_HIST_BUCKETS		((32 - RS_HIST_SUB_BITS + 1) * RS_HIST_SUB_COUNT)
 
 /*
  *	Logging macros
@@ -93,6 +117,27 @@ typedef struct rs_counters {
 	uint64_t type[PW_CODE_MAX];
 } rs_counters_t;
 
+/** Latency histogram
+ *
+ * Values are in microseconds.
+ */
+typedef struct rs_histogram {
+	uint64_t		count;			//!< Number of values recorded.
+	uint32_t		min;			//!< Lowest value recorded.
+	uint32_t		max;			//!< Highest value recorded.
+	uint32_t		bucket[RS_HIST_BUCKETS];
+} rs_histogram_t;
+
+/** Latency for a single client or server
+ *
+ */
+typedef struct rs_peer {
+	bool			server;			//!< The destination of requests, not the source.
+	fr_ipaddr_t		ipaddr;
+	uint16_t		port;			//!< Only set for servers, clients use random ports.
+	rs_histogram_t		histogram;		//!< Latency over the interval.
+} rs_peer_t;
+
 /** Stats for a single interval
  *
  * And interval is defined as the time between a call to the stats output function.
@@ -103,6 +148,9 @@ typedef struct rs_latency {
 	double			latency_smoothed;		//!< Smoothed moving average.
 	uint64_t		latency_smoothed_count;		//!< Number of CMA datapoints processed.
 
+	rs_histogram_t		*histogram;			//!< Latency over the interval, only allocated
+								//!< for the codes we output stats for.
+
 	struct {
 		uint64_t		received_total;		//!< Total received over interval.
 		uint64_t		linked_total;		//!< Total request/response pairs over interval.
@@ -127,6 +175,11 @@ typedef struct rs_latency {
 
 		double			latency_high;		//!< Latency high water mark.
 		double			latency_low;		//!< Latency low water mark.
+
+		double			latency_p50;		//!< Median latency.
+		double			latency_p90;		//!< 90th percentile latency.
+		double			latency_p99;		//!< 99th percentile latency.
+		double			latency_p999;		//!< 99.9th percentile latency.
 	} interval;
 } rs_latency_t;
 
@@ -155,6 +208,8 @@ typedef struct rs_stats {
 							//!< FreeRADIUS delay Access-Rejects, which would artificially
 							//!< increase latency stats for Access-Requests.
 
+	rbtree_t		*peers;			//!< Latency for each client and server.
+
 	struct timeval		quiet;			//!< We may need to 'mute' the stats if libpcap starts
 							//!< dropping packets, or we run out of memory.
 } rs_stats_t;
@@ -188,6 +243,9 @@ typedef struct rs_request {
 								//!< has been applied).
 	rs_capture_t		*capture_p;			//!< Next packet slot.
 
+	rs_capture_t		slow;			//!< Copy of the last request packet, kept so we can
+							//!< write it out if the response is slow.
+
 	uint64_t		rt_req;			//!< Number of times we saw the same request packet.
 	uint64_t		rt_rsp;			//!< Number of times we saw a retransmitted response
 							//!< packet.
@@ -215,6 +273,54 @@ typedef struct rs_event {
 	rs_stats_t		*stats;			//!< Where to write stats.
 } rs_event_t;
 
+#ifdef WITH_RS_THREADS
+/** A packet read from a file, waiting to be processed by a worker
+ *
+ */
+typedef struct rs_queued rs_queued_t;
+struct rs_queued {
+	rs_queued_t		*next;
+
+	uint64_t		count;			//!< Position of the packet in the input.
+	fr_pcap_t		*in;			//!< PCAP handle the packet was read from.
+	struct pcap_pkthdr	header;			//!< PCAP packet header.
+	uint8_t			data[];			//!< PCAP packet data.
+};
+
+/** A capture/analysis thread
+ *
+ * Each thread has its own request and link trees, event list and stats.  Packets are split
+ * between threads by flow, so a request and its response are always seen by the same thread.
+ */
+typedef struct rs_thread {
+	int			id;			//!< Index of this thread.
+	pthread_t		pthread_id;		//!< pthread handle.
+
+	TALLOC_CTX		*ctx;			//!< Everything the thread allocates goes here.
+							//!< Only the thread touches it while it's running.
+
+	fr_pcap_t		*in;			//!< Capture handles, only used for live capture.
+	fr_pcap_t		*out;			//!< Where to write output.
+
+	pthread_mutex_t		mutex;			//!< Held while processing packets, and while the
+							//!< main thread merges the stats.
+	rs_stats_t		stats;			//!< Stats for the current interval.
+
+	pthread_mutex_t		queue_mutex;		//!< Protects the queue and the stop flag.
+	pthread_cond_t		queue_cond;		//!< Signalled when the queue changes.
+	rs_queued_t		*queue;			//!< Packets waiting to be processed.
+	rs_queued_t		**queue_tail;		//!< Where to add the next batch.
+	int			queue_len;		//!< Number of packets in the queue.
+	bool			queue_done;		//!< No more packets will be queued.
+	bool			stop;			//!< Exit as soon as possible.  Also read without
+							//!< the mutex, with fr_atomic_load().
+
+	rs_queued_t		*batch;			//!< Packets being batched by the main thread.
+	rs_queued_t		**batch_tail;		//!< Where to add the next packet.
+	int			batch_len;		//!< Number of packets in the batch.
+} rs_thread_t;
+#endif
+
 /** FD data which gets passed to callbacks
  *
  */
@@ -267,8 +373,19 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	uint32_t		ring_block_size;	//!< Size of the blocks in our own TPACKET_V3 ring,
+							//!< 0 to let libpcap manage the ring.
+	uint32_t		ring_block_nr;		//!< Number of blocks in the ring.
+	uint32_t		ring_block_timeout;	//!< Max ms the kernel holds on to a block.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
+	int			threads;		//!< Number of capture/analysis threads, 0 to do
+							//!< everything in the main thread.
+
+	uint32_t		slow_threshold;		//!< Latency in ms at which request/response pairs
+							//!< are written to slow_out.
+	fr_pcap_t		*slow_out;		//!< Where to write slow request/response pairs.
+
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
 		stats_out_t		out;			//!< Where to write stats.
@@ -52,6 +52,7 @@ typedef struct fr_stats_t {
 	fr_uint_t	total_timeouts;
 	time_t		last_packet;
 	fr_uint_t	elapsed[8];
+	uint64_t	elapsed_usec;	//!< Sum of the response times counted in elapsed[].
 } fr_stats_t;
 
 typedef struct fr_stats_ema_t {
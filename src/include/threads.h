@@ -20,7 +20,7 @@
  * $Id$
  *
  * @file threads.h
- * @brief Macros to abstract Thread Local Storage
+ * @brief Macros to abstract Thread Local Storage, and atomic operations
  *
  * @copyright 2013  The FreeRADIUS server project
  */
@@ -113,4 +113,34 @@ static _t __fr_thread_local_init_##_n(pthread_destructor_t func)\
 #  define fr_thread_local_set(_n, _v)			__fr_thread_local_set_##_n(_v)
 #  define fr_thread_local_get(_n)			__fr_thread_local_get_##_n()
 #endif
+
+/*
+ *	Atomic access to counters and pointers which are shared
+ *	between threads, using the compiler builtins (GCC 4.7 and
+ *	later, and clang).
+ *
+ *	fr_atomic_store() publishes everything written before it to
+ *	any thread which sees the new value with fr_atomic_load().
+ *	fr_atomic_add() and fr_atomic_sub() return the new value.
+ */
+#define fr_atomic_load(_p)		__atomic_load_n(_p, __ATOMIC_ACQUIRE)
+#define fr_atomic_store(_p, _v)		__atomic_store_n(_p, _v, __ATOMIC_RELEASE)
+#define fr_atomic_add(_p, _v)		__atomic_add_fetch(_p, _v, __ATOMIC_SEQ_CST)
+#define fr_atomic_sub(_p, _v)		__atomic_sub_fetch(_p, _v, __ATOMIC_SEQ_CST)
+
+/*
+ *	Statistics counters, which don't order any other memory
+ *	accesses.  A reader sees each counter whole, but a set of
+ *	counters read one after another may not be consistent with
+ *	each other.
+ */
+#define fr_atomic_counter_add(_p, _v)	(void) __atomic_fetch_add(_p, _v, __ATOMIC_RELAXED)
+#define fr_atomic_counter_get(_p)	__atomic_load_n(_p, __ATOMIC_RELAXED)
+#define fr_atomic_counter_set(_p, _v)	__atomic_store_n(_p, _v, __ATOMIC_RELAXED)
+#define fr_atomic_counter_max(_p, _v) \
+do { \
+	__typeof__(*(_p)) _old = fr_atomic_counter_get(_p); \
+	while (((_v) > _old) && \
+	       !__atomic_compare_exchange_n(_p, &_old, _v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)); \
+} while (0)
 #endif
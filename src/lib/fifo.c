@@ -105,6 +105,20 @@ void *fr_fifo_pop(fr_fifo_t *fi)
 	return data;
 }
 
+/*
+ *	Take the most recently pushed entry, instead of the oldest.
+ */
+void *fr_fifo_pop_tail(fr_fifo_t *fi)
+{
+	if (!fi || (fi->num == 0)) return NULL;
+
+	if (fi->last == 0) fi->last = fi->max;
+	fi->last--;
+	fi->num--;
+
+	return fi->data[fi->last];
+}
+
 void *fr_fifo_peek(fr_fifo_t *fi)
 {
 	if (!fi || (fi->num == 0)) return NULL;
@@ -26,6 +26,14 @@
 #include <sys/ioctl.h>
 #include <freeradius-devel/pcap.h>
 
+#ifdef WITH_PCAP_RING
+#  include <sys/mman.h>
+#  include <net/if.h>
+#  include <net/if_arp.h>
+#  include <linux/if_ether.h>
+#  include <linux/filter.h>
+#endif
+
 const FR_NAME_NUMBER pcap_types[] = {
 	{ "interface",	PCAP_INTERFACE_IN },
 	{ "file",	PCAP_FILE_IN },
@@ -37,6 +45,29 @@ const FR_NAME_NUMBER pcap_types[] = {
 	{ NULL, 0}
 };
 
+#ifdef WITH_PCAP_RING
+/** Unmap and close a TPACKET_V3 ring
+ *
+ */
+static void fr_pcap_ring_close(fr_pcap_t *pcap)
+{
+	if (pcap->ring) {
+		munmap(pcap->ring, (size_t) pcap->ring_block_size * pcap->ring_block_nr);
+		pcap->ring = NULL;
+	}
+
+	if (pcap->fd > 0) {
+		close(pcap->fd);
+		pcap->fd = -1;
+	}
+
+	if (pcap->handle) {
+		pcap_close(pcap->handle);
+		pcap->handle = NULL;
+	}
+}
+#endif
+
 /** Talloc destructor to free pcap resources associated with a handle.
  *
  * @param pcap to free.
@@ -48,6 +79,12 @@ static int _free_pcap(fr_pcap_t *pcap) {
 	case PCAP_INTERFACE_OUT:
 	case PCAP_FILE_IN:
 	case PCAP_STDIO_IN:
+#ifdef WITH_PCAP_RING
+		if (pcap->ring) {
+			fr_pcap_ring_close(pcap);
+			break;
+		}
+#endif
 		if (pcap->handle) {
 			pcap_close(pcap->handle);
 
@@ -119,6 +156,215 @@ fr_pcap_t *fr_pcap_init(TALLOC_CTX *ctx, char const *name, fr_pcap_type_t type)
 	return this;
 }
 
+#ifdef WITH_PCAP_RING
+/** Open an AF_PACKET socket, with a TPACKET_V3 receive ring
+ *
+ * The kernel writes packets directly into blocks in the ring, and hands us a block when it's
+ * full, or when ring_block_timeout expires.  libpcap gets a dead handle, which is only used to
+ * compile filters.
+ *
+ * @param pcap to open.
+ * @return 0 on success, -1 on error.
+ */
+static int fr_pcap_ring_open(fr_pcap_t *pcap)
+{
+	struct tpacket_req3	req;
+	struct sockaddr_ll	sll;
+	struct ifreq		ifr;
+	int			version = TPACKET_V3;
+	uint32_t		page = getpagesize();
+	uint32_t		frame_size = TPACKET_ALIGNMENT << 7;
+	void			*ring;
+
+	if ((pcap->ring_block_size < page) || (pcap->ring_block_size % page) ||
+	    (pcap->ring_block_size & (pcap->ring_block_size - 1))) {
+		fr_strerror_printf("Ring block size must be a power of 2 multiple of the page size (%u)", page);
+		return -1;
+	}
+
+	if (!pcap->ring_block_nr) pcap->ring_block_nr = PCAP_RING_BLOCKS_DEFAULT;
+	if (!pcap->ring_block_timeout) pcap->ring_block_timeout = PCAP_RING_TIMEOUT_DEFAULT;
+
+	/*
+	 *	Protocol 0, so we don't get any packets until we bind to the interface.
+	 */
+	pcap->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (pcap->fd < 0) {
+		fr_strerror_printf("Failed creating AF_PACKET socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (setsockopt(pcap->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Failed setting TPACKET_V3: %s", fr_syserror(errno));
+	error:
+		fr_pcap_ring_close(pcap);
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = pcap->ring_block_size;
+	req.tp_block_nr = pcap->ring_block_nr;
+	req.tp_frame_size = frame_size;			/* Only used for sanity checks with V3 */
+	req.tp_frame_nr = (pcap->ring_block_size / frame_size) * pcap->ring_block_nr;
+	req.tp_retire_blk_tov = pcap->ring_block_timeout;
+
+	if (setsockopt(pcap->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		fr_strerror_printf("Failed creating ring of %u x %u byte blocks: %s",
+				   pcap->ring_block_nr, pcap->ring_block_size, fr_syserror(errno));
+		goto error;
+	}
+
+	ring = mmap(NULL, (size_t) pcap->ring_block_size * pcap->ring_block_nr,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, pcap->fd, 0);
+	if (ring == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping ring: %s", fr_syserror(errno));
+		goto error;
+	}
+	pcap->ring = ring;
+	pcap->ring_block = 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name));
+	if (ioctl(pcap->fd, SIOCGIFINDEX, &ifr) < 0) {
+		fr_strerror_printf("Failed getting index of interface %s: %s", pcap->name, fr_syserror(errno));
+		goto error;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifr.ifr_ifindex;
+	if (bind(pcap->fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		fr_strerror_printf("Failed binding to interface %s: %s", pcap->name, fr_syserror(errno));
+		goto error;
+	}
+
+	if (pcap->promiscuous) {
+		struct packet_mreq mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.mr_ifindex = sll.sll_ifindex;
+		mreq.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(pcap->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+			fr_strerror_printf("Failed enabling promiscuous mode: %s", fr_syserror(errno));
+			goto error;
+		}
+	}
+
+	/*
+	 *	SOCK_RAW gives us the link layer header, which for the
+	 *	interfaces we care about is either Ethernet, or nothing.
+	 */
+	if (ioctl(pcap->fd, SIOCGIFHWADDR, &ifr) < 0) {
+		fr_strerror_printf("Failed getting link type of interface %s: %s", pcap->name, fr_syserror(errno));
+		goto error;
+	}
+
+	switch (ifr.ifr_hwaddr.sa_family) {
+	case ARPHRD_ETHER:
+	case ARPHRD_LOOPBACK:
+		pcap->link_layer = DLT_EN10MB;
+		break;
+
+	case ARPHRD_NONE:
+		pcap->link_layer = DLT_RAW;
+		break;
+
+	default:
+		fr_strerror_printf("Link type %i of interface %s is not supported with rings",
+				   ifr.ifr_hwaddr.sa_family, pcap->name);
+		goto error;
+	}
+
+	pcap->handle = pcap_open_dead(pcap->link_layer, SNAPLEN);
+	if (!pcap->handle) {
+		fr_strerror_printf("Unknown error occurred opening dead PCAP handle");
+		goto error;
+	}
+
+	return 0;
+}
+
+/** Process all the blocks the kernel has handed us
+ *
+ * Blocks are always processed whole, so this may process more than max packets.
+ */
+static int fr_pcap_ring_dispatch(fr_pcap_t *pcap, int max, fr_pcap_handler_t callback, void *ctx)
+{
+	int count = 0;
+
+	while (count < max) {
+		struct tpacket_block_desc	*block;
+		struct tpacket3_hdr		*frame;
+		struct pcap_pkthdr		header;
+		uint32_t			i, num;
+
+		block = (struct tpacket_block_desc *)(pcap->ring + ((size_t) pcap->ring_block * pcap->ring_block_size));
+		if (!(block->hdr.bh1.block_status & TP_STATUS_USER)) break;
+
+		/*
+		 *	Don't read the frames before we've seen the status
+		 */
+		__sync_synchronize();
+
+		num = block->hdr.bh1.num_pkts;
+		frame = (struct tpacket3_hdr *)((uint8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < num; i++) {
+			header.ts.tv_sec = frame->tp_sec;
+			header.ts.tv_usec = frame->tp_nsec / 1000;
+			header.caplen = frame->tp_snaplen;
+			header.len = frame->tp_len;
+
+			callback(ctx, &header, (uint8_t *) frame + frame->tp_mac);
+
+			frame = (struct tpacket3_hdr *)((uint8_t *) frame + frame->tp_next_offset);
+		}
+		count += num;
+
+		/*
+		 *	Hand the block back to the kernel.
+		 */
+		__sync_synchronize();
+		block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+		if (++pcap->ring_block >= pcap->ring_block_nr) pcap->ring_block = 0;
+	}
+
+	return count;
+}
+#endif
+
+/** Join the PACKET_FANOUT group for a live capture handle
+ *
+ * Has the kernel split the packets arriving on this interface between all the handles in the
+ * group.  The flow hash is symmetric, so both directions of a UDP conversation are delivered to
+ * the same handle, and DEFRAG means fragments are too.
+ *
+ * @param pcap to add to the group.
+ * @return 0 on success, -1 on error.
+ */
+static int fr_pcap_fanout(fr_pcap_t *pcap)
+{
+	if (!pcap->fanout_group) return 0;
+
+#ifdef PACKET_FANOUT
+	{
+		int fanout = pcap->fanout_group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+
+		if (setsockopt(pcap->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+			fr_strerror_printf("Failed joining fanout group %u: %s", pcap->fanout_group,
+					   fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("PACKET_FANOUT is not supported on this platform");
+	return -1;
+#endif
+}
+
 /** Open a PCAP handle abstraction
  *
  * This opens interfaces for capture or injection, or files/streams for reading/writing.
@@ -131,6 +377,19 @@ int fr_pcap_open(fr_pcap_t *pcap)
 	case PCAP_INTERFACE_OUT:
 	case PCAP_INTERFACE_IN:
 	{
+		if (pcap->ring_block_size && (pcap->type == PCAP_INTERFACE_IN)) {
+#ifdef WITH_PCAP_RING
+			if ((fr_pcap_ring_open(pcap) < 0) || (fr_pcap_fanout(pcap) < 0)) {
+				fr_pcap_ring_close(pcap);
+				return -1;
+			}
+			break;
+#else
+			fr_strerror_printf("TPACKET_V3 rings are not supported on this platform");
+			return -1;
+#endif
+		}
+
 #if defined(HAVE_PCAP_CREATE) && defined(HAVE_PCAP_ACTIVATE)
 		pcap->handle = pcap_create(pcap->name, pcap->errbuf);
 		if (!pcap->handle) {
@@ -183,6 +442,12 @@ int fr_pcap_open(fr_pcap_t *pcap)
 
 		pcap->fd = pcap_get_selectable_fd(pcap->handle);
 		pcap->link_layer = pcap_datalink(pcap->handle);
+
+		if (fr_pcap_fanout(pcap) < 0) {
+			pcap_close(pcap->handle);
+			pcap->handle = NULL;
+			return -1;
+		}
 #ifndef __linux__
 		{
 			int value = 1;
@@ -307,6 +572,28 @@ int fr_pcap_apply_filter(fr_pcap_t *pcap, char const *expression)
 		return -1;
 	}
 
+#ifdef WITH_PCAP_RING
+	/*
+	 *	libpcap's BPF instructions are the same as the kernel's
+	 */
+	if (pcap->ring) {
+		struct sock_fprog prog;
+		int ret;
+
+		prog.len = fp.bf_len;
+		prog.filter = (struct sock_filter *) fp.bf_insns;
+
+		ret = setsockopt(pcap->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+		pcap_freecode(&fp);
+		if (ret < 0) {
+			fr_strerror_printf("Failed attaching filter: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		return 0;
+	}
+#endif
+
 	if (pcap_setfilter(pcap->handle, &fp) < 0) {
 		fr_strerror_printf("%s", pcap_geterr(pcap->handle));
 
@@ -316,6 +603,80 @@ int fr_pcap_apply_filter(fr_pcap_t *pcap, char const *expression)
 	return 0;
 }
 
+/** Read packets from a live capture handle
+ *
+ * With a TPACKET_V3 ring, whole blocks of packets are processed at once, so more than max
+ * packets may be passed to the callback.
+ *
+ * @param pcap handle to read from.
+ * @param max number of packets to read.
+ * @param callback to call for each packet.
+ * @param ctx to pass to the callback.
+ * @return the number of packets read, or -1 on error.
+ */
+int fr_pcap_dispatch(fr_pcap_t *pcap, int max, fr_pcap_handler_t callback, void *ctx)
+{
+	int i;
+
+#ifdef WITH_PCAP_RING
+	if (pcap->ring) return fr_pcap_ring_dispatch(pcap, max, callback, ctx);
+#endif
+
+	for (i = 0; i < max; i++) {
+		int ret;
+		struct pcap_pkthdr *header;
+		uint8_t const *data;
+
+		ret = pcap_next_ex(pcap->handle, &header, &data);
+		if (ret == 0) break;	/* No more packets available at this time */
+		if (ret < 0) {
+			fr_strerror_printf("%s", pcap_geterr(pcap->handle));
+			return -1;
+		}
+
+		callback(ctx, header, data);
+	}
+
+	return i;
+}
+
+/** Get the packet counters for a live capture handle
+ *
+ * @param pcap handle to get stats for.
+ * @param stats where to write the counters.
+ * @return 0 on success, -1 on error.
+ */
+int fr_pcap_stats(fr_pcap_t *pcap, struct pcap_stat *stats)
+{
+#ifdef WITH_PCAP_RING
+	if (pcap->ring) {
+		struct tpacket_stats_v3 tp_stats;
+		socklen_t len = sizeof(tp_stats);
+
+		if (getsockopt(pcap->fd, SOL_PACKET, PACKET_STATISTICS, &tp_stats, &len) < 0) {
+			fr_strerror_printf("Failed getting ring stats: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		/*
+		 *	The kernel resets the counters each time they're read.
+		 */
+		pcap->ring_stats.ps_recv += tp_stats.tp_packets;
+		pcap->ring_stats.ps_drop += tp_stats.tp_drops;
+		*stats = pcap->ring_stats;
+
+		return 0;
+	}
+#endif
+
+	if (pcap_stats(pcap->handle, stats) != 0) {
+		fr_strerror_printf("%s", pcap_geterr(pcap->handle));
+		return -1;
+	}
+
+	return 0;
+}
+
 char *fr_pcap_device_names(TALLOC_CTX *ctx, fr_pcap_t *pcap, char c)
 {
 	fr_pcap_t *pcap_p;
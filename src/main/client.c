@@ -522,6 +522,8 @@ static const CONF_PARSER client_config[] = {
 	{ "dynamic_clients", FR_CONF_OFFSET(PW_TYPE_STRING, RADCLIENT, client_server), NULL },
 	{ "lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, lifetime), NULL },
 	{ "rate_limit", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, RADCLIENT, rate_limit), NULL },
+	{ "negative_lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, negative_lifetime), "0" },
+	{ "negative_max", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, negative_max), "1024" },
 #endif
 
 	CONF_PARSER_TERMINATOR
@@ -763,6 +765,125 @@ error:
 	return false;
 }
 
+#ifdef WITH_DYNAMIC_CLIENTS
+typedef struct client_negative_entry client_negative_entry_t;
+
+/*
+ *	All entries for a network have the same lifetime, so the
+ *	oldest one is always the next to expire.
+ */
+struct client_negative_entry {
+	fr_ipaddr_t		ipaddr;
+	time_t			expires;
+	client_negative_entry_t	*next;
+};
+
+struct client_negative {
+	rbtree_t		*tree;
+	client_negative_entry_t	*head;		//!< Oldest entry.
+	client_negative_entry_t	*tail;		//!< Newest entry.
+};
+
+static int client_negative_cmp(void const *one, void const *two)
+{
+	client_negative_entry_t const *a = one;
+	client_negative_entry_t const *b = two;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+static void client_negative_pop(struct client_negative *negative)
+{
+	client_negative_entry_t *entry = negative->head;
+
+	negative->head = entry->next;
+	if (!negative->head) negative->tail = NULL;
+
+	rbtree_deletebydata(negative->tree, entry);
+	talloc_free(entry);
+}
+
+static void client_negative_expire(struct client_negative *negative, time_t now)
+{
+	while (negative->head && (negative->head->expires <= now)) client_negative_pop(negative);
+}
+
+/** Check whether we recently failed to create a client for an IP
+ *
+ * Stops packets from a misconfigured NAS running the dynamic_clients
+ * virtual server (and whatever database it queries) over and over.
+ *
+ * @param network the enclosing network, which defines dynamic_clients.
+ * @param ipaddr of the unknown client.
+ * @param now the current time.
+ * @return true if the IP should be ignored, false to look it up.
+ */
+bool client_negative_find(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now)
+{
+	client_negative_entry_t my_entry;
+
+	if (!network->negative) return false;
+
+	client_negative_expire(network->negative, now);
+
+	my_entry.ipaddr = *ipaddr;
+	return (rbtree_finddata(network->negative->tree, &my_entry) != NULL);
+}
+
+/** Remember that we failed to create a client for an IP
+ *
+ * If the cache is full, the oldest entry is removed.
+ *
+ * @param network the enclosing network, which defines dynamic_clients.
+ * @param ipaddr of the unknown client.
+ * @param now the current time.
+ */
+void client_negative_add(RADCLIENT *network, fr_ipaddr_t const *ipaddr, time_t now)
+{
+	struct client_negative *negative;
+	client_negative_entry_t *entry;
+
+	if (!network->negative_lifetime || !network->negative_max) return;
+
+	negative = network->negative;
+	if (!negative) {
+		negative = talloc_zero(network, struct client_negative);
+		if (!negative) return;
+
+		negative->tree = rbtree_create(negative, client_negative_cmp, NULL, 0);
+		if (!negative->tree) {
+			talloc_free(negative);
+			return;
+		}
+		network->negative = negative;
+	}
+
+	client_negative_expire(negative, now);
+
+	while (negative->head && (rbtree_num_elements(negative->tree) >= network->negative_max)) {
+		client_negative_pop(negative);
+	}
+
+	entry = talloc_zero(negative, client_negative_entry_t);
+	if (!entry) return;
+
+	entry->ipaddr = *ipaddr;
+	entry->expires = now + network->negative_lifetime;
+
+	if (!rbtree_insert(negative->tree, entry)) {
+		talloc_free(entry);
+		return;
+	}
+
+	if (negative->tail) {
+		negative->tail->next = entry;
+	} else {
+		negative->head = entry;
+	}
+	negative->tail = entry;
+}
+#endif
+
 /** Create a client CONF_SECTION using a mapping section to map values from a result set to client attributes
  *
  * If we hit a CONF_SECTION we recurse and process its CONF_PAIRS too.
@@ -1148,6 +1269,12 @@ done_coa:
 	}
 #endif
 
+#ifdef WITH_DYNAMIC_CLIENTS
+	if (c->client_server) {
+		FR_INTEGER_BOUND_CHECK("negative_max", c->negative_max, <=, 65536);
+	}
+#endif
+
 	return c;
 }
 
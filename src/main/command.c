@@ -1054,6 +1054,50 @@ static int command_show_module_status(rad_listen_t *listener, int argc, char *ar
 }
 
 
+typedef struct module_stats_ctx_t {
+	rad_listen_t	*listener;
+	char const	*name;
+	bool		found;
+} module_stats_ctx_t;
+
+static void module_stats_print(void *ctx, modcall_stats_t const *stats)
+{
+	module_stats_ctx_t *my_ctx = ctx;
+
+	if (my_ctx->name && (strcmp(my_ctx->name, stats->name) != 0)) return;
+	my_ctx->found = true;
+
+	cprintf(my_ctx->listener, "%s\t%s\tcalls=%" PRIu64 "\terrors=%" PRIu64
+		"\tp50_usec=%" PRIu64 "\tp99_usec=%" PRIu64 "\tmax_usec=%" PRIu64
+		"\tavg_usec=%" PRIu64 "\tpool_wait_usec=%" PRIu64 "\n",
+		(stats->type == MODCALL_STATS_MODULE) ? "module" : "section",
+		stats->name, stats->calls, stats->errors,
+		modcall_stats_percentile(stats, 50), modcall_stats_percentile(stats, 99),
+		stats->max_usec, stats->calls ? (stats->total_usec / stats->calls) : 0,
+		stats->pool_wait_usec);
+}
+
+/*
+ *	Show how long modules and sections take.
+ */
+static int command_show_module_stats(rad_listen_t *listener, int argc, char *argv[])
+{
+	module_stats_ctx_t ctx;
+
+	ctx.listener = listener;
+	ctx.name = (argc > 0) ? argv[0] : NULL;
+	ctx.found = false;
+
+	modcall_stats_walk(module_stats_print, &ctx);
+
+	if (ctx.name && !ctx.found) {
+		cprintf_error(listener, "No statistics for \"%s\"\n", ctx.name);
+		return CMD_FAIL;
+	}
+
+	return CMD_OK;
+}
+
 /*
  *	Show all loaded modules
  */
@@ -1941,6 +1985,9 @@ static fr_command_table_t command_table_show_module[] = {
 	{ "methods", FR_READ,
 	  "show module methods <module> - show sections where <module> may be used",
 	  command_show_module_methods, NULL },
+	{ "stats", FR_READ,
+	  "show module stats [<name>] - show call counts and latency for modules, sections, and policies",
+	  command_show_module_stats, NULL },
 	{ "status", FR_READ,
 	  "show module status <module> - show the module status",
 	  command_show_module_status, NULL },
@@ -2128,6 +2175,18 @@ static int command_set_module_status(rad_listen_t *listener, int argc, char *arg
 	return CMD_OK;
 }
 
+static int command_set_module_stats(rad_listen_t *listener, int argc, char *argv[])
+{
+	if ((argc != 1) || (strcmp(argv[0], "reset") != 0)) {
+		cprintf_error(listener, "Usage: set module stats reset\n");
+		return 0;
+	}
+
+	modcall_stats_reset();
+
+	return CMD_OK;
+}
+
 #ifdef WITH_STATS
 static char const *elapsed_names[8] = {
 	"1us", "10us", "100us", "1ms", "10ms", "100ms", "1s", "10s"
@@ -2190,8 +2249,10 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 static int command_stats_queue(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
 	int array[RAD_LISTEN_MAX], pps[2];
+	uint64_t shed[QUEUE_SHED_MAX];
 
 	thread_pool_queue_stats(array, pps);
+	thread_pool_shed_stats(shed);
 
 	cprintf(listener, "queue_len_internal\t" PU "\n", array[0]);
 	cprintf(listener, "queue_len_proxy\t\t" PU "\n", array[1]);
@@ -2202,6 +2263,40 @@ static int command_stats_queue(rad_listen_t *listener, UNUSED int argc, UNUSED c
 	cprintf(listener, "queue_pps_in\t\t" PU "\n", pps[0]);
 	cprintf(listener, "queue_pps_out\t\t" PU "\n", pps[1]);
 
+	cprintf(listener, "queue_shed_full\t\t%" PRIu64 "\n", shed[QUEUE_SHED_FULL]);
+	cprintf(listener, "queue_shed_acct_limit\t%" PRIu64 "\n", shed[QUEUE_SHED_ACCT_LIMIT]);
+	cprintf(listener, "queue_shed_auth_delay\t%" PRIu64 "\n", shed[QUEUE_SHED_AUTH_DELAY]);
+	cprintf(listener, "queue_shed_acct_delay\t%" PRIu64 "\n", shed[QUEUE_SHED_ACCT_DELAY]);
+
+	return CMD_OK;
+}
+
+static int command_stats_threads(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	thread_pool_stats_t stats;
+
+	thread_pool_stats(&stats);
+
+	cprintf(listener, "auto_size\t\t%s\n", stats.auto_size ? "yes" : "no");
+	cprintf(listener, "threads_total\t\t%u\n", stats.total_threads);
+	cprintf(listener, "threads_active\t\t%u\n", stats.active_threads);
+	cprintf(listener, "threads_min\t\t%u\n", stats.min_threads);
+	cprintf(listener, "threads_max\t\t%u\n", stats.max_threads);
+	cprintf(listener, "queued\t\t\t%u\n", stats.queued);
+
+	if (!stats.auto_size) return CMD_OK;
+
+	cprintf(listener, "queue_wait_usec\t\t%u\n", stats.wait_usec);
+	cprintf(listener, "cpu_percent\t\t%u\n", stats.cpu_percent);
+	cprintf(listener, "threads_useful\t\t%u\n", stats.useful_threads);
+	cprintf(listener, "spawned\t\t\t%" PRIu64 "\n", stats.spawned);
+	cprintf(listener, "retired\t\t\t%" PRIu64 "\n", stats.retired);
+	cprintf(listener, "cpu_bound\t\t%" PRIu64 "\n", stats.cpu_bound);
+	if (stats.last_action) {
+		cprintf(listener, "last_action\t\t%s\n", stats.last_action);
+		cprintf(listener, "last_action_time\t%" PRId64 "\n", (int64_t) stats.last_action_time);
+	}
+
 	return CMD_OK;
 }
 #endif
@@ -2566,6 +2661,10 @@ static fr_command_table_t command_table_set_module[] = {
 	  "set module config <module> variable value - set configuration for <module>",
 	  command_set_module_config, NULL },
 
+	{ "stats", FR_WRITE,
+	  "set module stats reset - zero the statistics shown by \"show module stats\"",
+	  command_set_module_stats, NULL },
+
 	{ "status", FR_WRITE,
 	  "set module status <module> [alive|...] - set the module status to be alive (operating normally), or force a particular code (ok,fail, etc.)",
 	  command_set_module_status, NULL },
@@ -2611,6 +2710,10 @@ static fr_command_table_t command_table_stats[] = {
 	{ "queue", FR_READ,
 	  "stats queue - show statistics for packet queues",
 	  command_stats_queue, NULL },
+
+	{ "threads", FR_READ,
+	  "stats threads - show the size of the thread pool, and why",
+	  command_stats_threads, NULL },
 #endif
 
 	{ "socket", FR_READ,
@@ -34,6 +34,12 @@ typedef struct fr_connection fr_connection_t;
 
 static int fr_connection_pool_check(fr_connection_pool_t *pool);
 
+/*
+ *	How long this thread has spent in fr_connection_get().  See
+ *	fr_connection_wait_usec().
+ */
+fr_thread_local_setup(uint64_t *, fr_connection_wait)	/* macro */
+
 #ifndef NDEBUG
 #ifdef HAVE_PTHREAD_H
 /* #define PTHREAD_DEBUG (1) */
@@ -144,8 +150,22 @@ struct fr_connection_pool_t {
 
 	fr_connection_create_t	create;		//!< Function used to create new connections.
 	fr_connection_alive_t	alive;		//!< Function used to check status of connections.
+
+	fr_connection_pool_t	*list_prev;	//!< Previous pool in the list of all pools.
+	fr_connection_pool_t	*list_next;	//!< Next pool in the list of all pools.
 };
 
+/*
+ *	All of the pools, so that their stats can be reported.  The
+ *	mutex is only taken when pools are created or freed, and when
+ *	the stats are read, never when connections are reserved.
+ */
+static fr_connection_pool_t *pool_list = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	pool_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 #ifndef HAVE_PTHREAD_H
 #  define pthread_mutex_lock(_x)
 #  define pthread_mutex_unlock(_x)
@@ -427,7 +447,13 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool, time_t n
 	 *	about other threads opening new connections, as we
 	 *	already have no free connections.
 	 */
+#ifdef HAVE_PTHREAD_H
+	module_instantiate_unlock();
+#endif
 	conn = pool->create(ctx, pool->opaque);
+#ifdef HAVE_PTHREAD_H
+	module_instantiate_relock();
+#endif
 	if (!conn) {
 		ERROR("%s: Opening connection failed (%" PRIu64 ")", pool->log_prefix, number);
 
@@ -929,6 +955,23 @@ static fr_connection_t *fr_connection_reconnect_internal(fr_connection_pool_t *p
 	return new_conn;
 }
 
+/** Remove a pool from the list of all pools
+ *
+ */
+static int _connection_pool_free(fr_connection_pool_t *pool)
+{
+	pthread_mutex_lock(&pool_list_mutex);
+	if (pool->list_prev) {
+		pool->list_prev->list_next = pool->list_next;
+	} else {
+		pool_list = pool->list_next;
+	}
+	if (pool->list_next) pool->list_next->list_prev = pool->list_prev;
+	pthread_mutex_unlock(&pool_list_mutex);
+
+	return 0;
+}
+
 /** Create a new connection pool
  *
  * Allocates structures used by the connection pool, initialises the various
@@ -1100,6 +1143,14 @@ fr_connection_pool_t *fr_connection_pool_init(TALLOC_CTX *ctx,
 
 	fr_connection_exec_trigger(pool, "start");
 
+	pthread_mutex_lock(&pool_list_mutex);
+	pool->list_next = pool_list;
+	if (pool_list) pool_list->list_prev = pool;
+	pool_list = pool;
+	pthread_mutex_unlock(&pool_list_mutex);
+
+	talloc_set_destructor(pool, _connection_pool_free);
+
 	return pool;
 }
 
@@ -1245,6 +1296,34 @@ int fr_connection_pool_get_num(fr_connection_pool_t *pool)
 }
 
 
+/** Call a function with the stats of every connection pool
+ *
+ * The counters are read without taking the pool mutexes, so each is
+ * accurate, but they may not all be from exactly the same instant.
+ *
+ * @param[in] callback to call for each pool.
+ * @param[in] ctx to pass to the callback.
+ */
+void fr_connection_pool_stats_walk(fr_connection_pool_stats_cb_t callback, void *ctx)
+{
+	fr_connection_pool_t		*pool;
+	fr_connection_pool_stats_t	stats;
+
+	pthread_mutex_lock(&pool_list_mutex);
+	for (pool = pool_list; pool != NULL; pool = pool->list_next) {
+		stats.name = pool->log_prefix;
+		stats.num = pool->num;
+		stats.active = pool->active;
+		stats.pending = pool->pending;
+		stats.max = pool->max;
+		stats.opened = pool->count;
+		stats.last_at_max = pool->last_at_max;
+
+		callback(ctx, &stats);
+	}
+	pthread_mutex_unlock(&pool_list_mutex);
+}
+
 /** Delete a connection pool
  *
  * Closes, unlinks and frees all connections in the connection pool, then frees
@@ -1320,7 +1399,56 @@ void fr_connection_pool_free(fr_connection_pool_t *pool)
  */
 void *fr_connection_get(fr_connection_pool_t *pool)
 {
-	return fr_connection_get_internal(pool, true);
+	void		*conn;
+	uint64_t	*wait;
+	struct timeval	start, end;
+
+	wait = fr_thread_local_get(fr_connection_wait);
+	if (!wait) return fr_connection_get_internal(pool, true);
+
+	gettimeofday(&start, NULL);
+	conn = fr_connection_get_internal(pool, true);
+	gettimeofday(&end, NULL);
+
+	if (timercmp(&end, &start, >)) {
+		*wait += ((uint64_t) (end.tv_sec - start.tv_sec) * 1000000) + end.tv_usec - start.tv_usec;
+	}
+
+	return conn;
+}
+
+static void _fr_connection_wait_free(void *arg)
+{
+	free(arg);
+}
+
+/** Return how long the calling thread has spent getting connections
+ *
+ * This includes waiting for the pool mutex, and opening new connections
+ * when there were no spare ones.  The first call from a thread starts
+ * the count, and returns 0.
+ *
+ * @return the total time in microseconds.
+ */
+uint64_t fr_connection_wait_usec(void)
+{
+	uint64_t *wait;
+
+	wait = fr_thread_local_init(fr_connection_wait, _fr_connection_wait_free);
+	if (!wait) {
+		/*
+		 *	malloc is thread safe, talloc is not
+		 */
+		wait = calloc(1, sizeof(*wait));
+		if (!wait) return 0;
+
+		if (fr_thread_local_set(fr_connection_wait, wait) != 0) {
+			free(wait);
+			return 0;
+		}
+	}
+
+	return *wait;
 }
 
 /** Release a connection
@@ -29,25 +29,66 @@ RCSID("$Id$")
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 
+#ifndef HAVE_CRYPT_R
 /*
- *  No pthreads, no mutex.
+ *  No crypt_r(), so crypt() has to be serialised.
  */
 static bool fr_crypt_init = false;
 static pthread_mutex_t fr_crypt_mutex;
 #endif
 
+/*
+ *  A check waiting for a hashing thread.  It lives on the stack of
+ *  the thread which submitted it.
+ */
+typedef struct fr_crypt_job {
+	char const		*key;
+	char const		*crypted;
+	int			rcode;
+	bool			done;
+	pthread_cond_t		cond;		//!< Signalled when done.
+	struct fr_crypt_job	*next;
+} fr_crypt_job_t;
 
 /*
- * performs a crypt password check in an thread-safe way.
- *
- * returns:  0 -- check succeeded
- *	  -1 -- failed to crypt
- *	   1 -- check failed
+ *  The hashing thread pool.  If it's not running, checks are done
+ *  by the calling thread.
  */
-int fr_crypt_check(char const *key, char const *crypted)
+typedef struct fr_crypt_pool {
+	pthread_t		*threads;
+	uint32_t		num_threads;
+	uint32_t		max_queue;
+	uint32_t		num_queued;
+
+	fr_crypt_job_t		*head;
+	fr_crypt_job_t		*tail;
+
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;		//!< Signalled when a job is queued.
+	bool			stop;
+} fr_crypt_pool_t;
+
+static fr_crypt_pool_t crypt_pool;
+#endif
+
+
+/*
+ *  Hash the key, and compare it to the crypted password.
+ */
+static int crypt_check(char const *key, char const *crypted)
 {
 	char *passwd;
 	int cmp = 0;
+#ifdef HAVE_CRYPT_R
+	struct crypt_data data;
+
+	data.initialized = 0;
+
+	passwd = crypt_r(key, crypted, &data);
+	if (passwd) {
+		cmp = strcmp(crypted, passwd);
+	}
+#else
 
 #ifdef HAVE_PTHREAD_H
 	/*
@@ -75,6 +116,7 @@ int fr_crypt_check(char const *key, char const *crypted)
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_unlock(&fr_crypt_mutex);
 #endif
+#endif	/* HAVE_CRYPT_R */
 
 	/*
 	 *	Error.
@@ -95,3 +137,163 @@ int fr_crypt_check(char const *key, char const *crypted)
 	 */
 	return 1;
 }
+
+#ifdef HAVE_PTHREAD_H
+static void *crypt_pool_thread(UNUSED void *arg)
+{
+	fr_crypt_job_t *job;
+	int rcode;
+
+	pthread_mutex_lock(&crypt_pool.mutex);
+	while (true) {
+		while (!crypt_pool.head && !crypt_pool.stop) {
+			pthread_cond_wait(&crypt_pool.cond, &crypt_pool.mutex);
+		}
+		if (crypt_pool.stop) break;
+
+		job = crypt_pool.head;
+		crypt_pool.head = job->next;
+		if (!crypt_pool.head) crypt_pool.tail = NULL;
+		crypt_pool.num_queued--;
+
+		pthread_mutex_unlock(&crypt_pool.mutex);
+		rcode = crypt_check(job->key, job->crypted);
+		pthread_mutex_lock(&crypt_pool.mutex);
+
+		job->rcode = rcode;
+		job->done = true;
+		pthread_cond_signal(&job->cond);
+	}
+	pthread_mutex_unlock(&crypt_pool.mutex);
+
+	return NULL;
+}
+
+/*
+ *  Queue a check for the hashing threads, and wait for it.
+ */
+static int crypt_pool_check(char const *key, char const *crypted)
+{
+	fr_crypt_job_t job;
+
+	memset(&job, 0, sizeof(job));
+	job.key = key;
+	job.crypted = crypted;
+
+	pthread_mutex_lock(&crypt_pool.mutex);
+	if (crypt_pool.num_queued >= crypt_pool.max_queue) {
+		pthread_mutex_unlock(&crypt_pool.mutex);
+		return -2;
+	}
+
+	pthread_cond_init(&job.cond, NULL);
+	if (crypt_pool.tail) {
+		crypt_pool.tail->next = &job;
+	} else {
+		crypt_pool.head = &job;
+	}
+	crypt_pool.tail = &job;
+	crypt_pool.num_queued++;
+	pthread_cond_signal(&crypt_pool.cond);
+
+	while (!job.done) pthread_cond_wait(&job.cond, &crypt_pool.mutex);
+	pthread_mutex_unlock(&crypt_pool.mutex);
+
+	pthread_cond_destroy(&job.cond);
+
+	return job.rcode;
+}
+#endif
+
+/*
+ * Start threads to do crypt checks, so that slow hashes don't tie
+ * up every request thread.  At most max_queue checks may be waiting
+ * for a thread.  Any more are refused.
+ *
+ * returns:  0 -- pool started, or num_threads is 0
+ *	  -1 -- failed to start the pool
+ */
+int fr_crypt_pool_init(uint32_t num_threads, uint32_t max_queue)
+{
+#ifdef HAVE_PTHREAD_H
+	uint32_t i;
+
+	if (!num_threads || crypt_pool.threads) return 0;
+
+	crypt_pool.threads = calloc(num_threads, sizeof(crypt_pool.threads[0]));
+	if (!crypt_pool.threads) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	crypt_pool.max_queue = max_queue;
+	crypt_pool.stop = false;
+	pthread_mutex_init(&crypt_pool.mutex, NULL);
+	pthread_cond_init(&crypt_pool.cond, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		int rcode;
+
+		rcode = pthread_create(&crypt_pool.threads[i], NULL, crypt_pool_thread, NULL);
+		if (rcode != 0) {
+			fr_strerror_printf("Failed creating hashing thread: %s", fr_syserror(rcode));
+			fr_crypt_pool_free();
+			return -1;
+		}
+		crypt_pool.num_threads++;
+	}
+
+	return 0;
+#else
+	if (!num_threads) return 0;
+
+	fr_strerror_printf("Hashing threads require pthread support");
+	return -1;
+#endif
+}
+
+/*
+ * Stop the hashing threads.  Checks are then done by the caller.
+ */
+void fr_crypt_pool_free(void)
+{
+#ifdef HAVE_PTHREAD_H
+	uint32_t i, num_threads;
+
+	if (!crypt_pool.threads) return;
+
+	pthread_mutex_lock(&crypt_pool.mutex);
+	crypt_pool.stop = true;
+	num_threads = crypt_pool.num_threads;
+	pthread_cond_broadcast(&crypt_pool.cond);
+	pthread_mutex_unlock(&crypt_pool.mutex);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(crypt_pool.threads[i], NULL);
+	}
+
+	free(crypt_pool.threads);
+	crypt_pool.threads = NULL;
+	crypt_pool.num_threads = 0;
+
+	pthread_cond_destroy(&crypt_pool.cond);
+	pthread_mutex_destroy(&crypt_pool.mutex);
+#endif
+}
+
+/*
+ * performs a crypt password check in an thread-safe way.
+ *
+ * returns:  0 -- check succeeded
+ *	  -1 -- failed to crypt
+ *	  -2 -- too many checks waiting for a hashing thread
+ *	   1 -- check failed
+ */
+int fr_crypt_check(char const *key, char const *crypted)
+{
+#ifdef HAVE_PTHREAD_H
+	if (crypt_pool.num_threads) return crypt_pool_check(key, crypted);
+#endif
+
+	return crypt_check(key, crypted);
+}
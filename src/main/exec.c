@@ -46,7 +46,7 @@ RCSID("$Id$")
 #define MAX_ARGV (256)
 
 #define USEC 1000000
-static void tv_sub(struct timeval *end, struct timeval *start,
+static void tv_sub(struct timeval const *end, struct timeval const *start,
 		   struct timeval *elapsed)
 {
 	elapsed->tv_sec = end->tv_sec - start->tv_sec;
@@ -648,3 +648,188 @@ wait:
 
 	return -1;
 }
+
+/*
+ *	A program which is started once, and then handles many
+ *	requests over its stdin and stdout.
+ */
+struct radius_helper {
+	pid_t		pid;
+	int		to_child;		//!< Child's stdin.
+	int		from_child;		//!< Child's stdout.
+	char const	*cmd;			//!< Command line, for log messages.
+	size_t		used;			//!< Bytes in buffer.
+	char		buffer[4096];		//!< Output from the child which hasn't been returned yet.
+};
+
+/*
+ *	How long (in milliseconds) a helper gets to exit after SIGTERM
+ *	before it's killed.  Helpers are freed when a connection pool is
+ *	closed or reconnected, so we can't wait long.
+ */
+#define HELPER_GRACE (100)
+
+static int _radius_helper_free(radius_helper_t *helper)
+{
+	int status;
+
+	if (helper->to_child >= 0) close(helper->to_child);
+	if (helper->from_child >= 0) close(helper->from_child);
+
+	if (helper->pid > 0) {
+		DEBUG2("Stopping helper PID %u (%s)", (unsigned int) helper->pid, helper->cmd);
+		kill(helper->pid, SIGTERM);
+
+		if (rad_waitpid_timeout(helper->pid, &status, HELPER_GRACE) == 0) {
+			DEBUG2("Helper PID %u didn't exit, killing it", (unsigned int) helper->pid);
+			kill(helper->pid, SIGKILL);
+			rad_waitpid(helper->pid, &status);
+		}
+	}
+
+	return 0;
+}
+
+/** Start a long-running helper program
+ *
+ * The program is not given any environment, and no xlat expansion is done
+ * on the command line, as there's no request.  The helper is stopped when
+ * the returned structure is freed.
+ *
+ * @param ctx to allocate the helper in.
+ * @param cmd Command to execute.
+ * @return the helper, or NULL on error.
+ */
+radius_helper_t *radius_helper_start(TALLOC_CTX *ctx, char const *cmd)
+{
+	radius_helper_t *helper;
+
+	helper = talloc_zero(ctx, radius_helper_t);
+	if (!helper) return NULL;
+
+	helper->to_child = -1;
+	helper->from_child = -1;
+	helper->cmd = talloc_typed_strdup(helper, cmd);
+	talloc_set_destructor(helper, _radius_helper_free);
+
+	helper->pid = radius_start_program(cmd, NULL, true, &helper->to_child, &helper->from_child, NULL, false);
+	if (helper->pid < 0) {
+		ERROR("Failed starting helper \"%s\"", cmd);
+		talloc_free(helper);
+		return NULL;
+	}
+
+	if ((fr_nonblock(helper->to_child) < 0) || (fr_nonblock(helper->from_child) < 0)) {
+		ERROR("Failed setting helper pipes non-blocking: %s", fr_syserror(errno));
+		talloc_free(helper);
+		return NULL;
+	}
+
+	DEBUG2("Started helper PID %u (%s)", (unsigned int) helper->pid, cmd);
+
+	return helper;
+}
+
+/** Write data to a helper's stdin
+ *
+ * @param helper to write to.
+ * @param data to write.
+ * @param len of data.
+ * @param timeout how long to wait for the pipe to become writable.
+ * @return 0 on success, -1 on error (the helper should then be freed).
+ */
+int radius_helper_write(radius_helper_t *helper, char const *data, size_t len, struct timeval *timeout)
+{
+	struct iovec vector[1];
+
+	memcpy(&vector[0].iov_base, &data, sizeof(vector[0].iov_base));
+	vector[0].iov_len = len;
+
+	if (fr_writev(helper->to_child, vector, 1, timeout) != (ssize_t) len) {
+		fr_strerror_printf("Failed writing to helper PID %u: %s", (unsigned int) helper->pid,
+				   fr_strerror());
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Read one line of output from a helper
+ *
+ * @param helper to read from.
+ * @param out where to write the line.  The trailing newline is removed.
+ * @param outlen size of out.
+ * @param deadline time after which we give up.
+ * @return length of the line, or -1 on error (the helper should then be freed).
+ */
+ssize_t radius_helper_read_line(radius_helper_t *helper, char *out, size_t outlen, struct timeval const *deadline)
+{
+	char		*nl;
+	size_t		len;
+	ssize_t		rcode;
+	fd_set		fds;
+	struct timeval	now, wait;
+
+	while (true) {
+		nl = memchr(helper->buffer, '\n', helper->used);
+		if (nl) {
+			len = nl - helper->buffer;
+			if (len >= outlen) {
+				fr_strerror_printf("Line from helper PID %u is too long", (unsigned int) helper->pid);
+				return -1;
+			}
+
+			memcpy(out, helper->buffer, len);
+			out[len] = '\0';
+
+			helper->used -= len + 1;
+			memmove(helper->buffer, nl + 1, helper->used);
+
+			if ((len > 0) && (out[len - 1] == '\r')) out[--len] = '\0';
+
+			return len;
+		}
+
+		if (helper->used == sizeof(helper->buffer)) {
+			fr_strerror_printf("Line from helper PID %u is too long", (unsigned int) helper->pid);
+			return -1;
+		}
+
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, deadline, <)) {
+		timeout:
+			fr_strerror_printf("Timeout waiting for helper PID %u", (unsigned int) helper->pid);
+			return -1;
+		}
+		tv_sub(deadline, &now, &wait);
+
+		FD_ZERO(&fds);
+		FD_SET(helper->from_child, &fds);
+
+		rcode = select(helper->from_child + 1, &fds, NULL, NULL, &wait);
+		if (rcode == 0) goto timeout;
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			fr_strerror_printf("Failed waiting for helper PID %u: %s", (unsigned int) helper->pid,
+					   fr_syserror(errno));
+			return -1;
+		}
+
+		rcode = read(helper->from_child, helper->buffer + helper->used, sizeof(helper->buffer) - helper->used);
+		if (rcode == 0) {
+			fr_strerror_printf("Helper PID %u exited", (unsigned int) helper->pid);
+			return -1;
+		}
+
+		if (rcode < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+
+			fr_strerror_printf("Failed reading from helper PID %u: %s", (unsigned int) helper->pid,
+					   fr_syserror(errno));
+			return -1;
+		}
+
+		helper->used += rcode;
+	}
+}
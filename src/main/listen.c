@@ -77,6 +77,11 @@ static int command_write_magic(int newfd, listen_socket_t *sock);
 #endif
 #endif
 
+#ifdef WITH_METRICS
+static int metrics_tcp_recv(rad_listen_t *listener);
+static int metrics_tcp_send(rad_listen_t *listener, REQUEST *request);
+#endif
+
 static fr_protocol_t master_listen[];
 
 /*
@@ -234,6 +239,14 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		if (now == client->last_new_client) goto unknown;
 	}
 
+	/*
+	 *	We recently asked the virtual server about this IP,
+	 *	and it said no.  This check is done before updating
+	 *	last_new_client, so a misconfigured NAS doesn't use
+	 *	up the rate limit for everyone else.
+	 */
+	if (client_negative_find(client, ipaddr, now)) goto unknown;
+
 	client->last_new_client = now;
 
 	request = request_alloc(NULL);
@@ -286,6 +299,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		ERROR("Virtual-Server %s returned %s, creating dynamic client failed", request->server,
 		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
 		talloc_free(request);
+		client_negative_add(client, ipaddr, now);
 		goto unknown;
 
 	/*
@@ -295,6 +309,7 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		DEBUG("Virtual-Server %s returned %s, ignoring client", request->server,
 		      fr_int2str(mod_rcode_table, rcode, "<INVALID>"));
 		talloc_free(request);
+		client_negative_add(client, ipaddr, now);
 		goto unknown;
 	}
 
@@ -310,7 +325,11 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		/*
 		 *	This frees the client if it isn't valid.
 		 */
-		if (!client_add_dynamic(clients, client, created)) goto unknown;
+		if (!client_add_dynamic(clients, client, created)) {
+			talloc_free(request);
+			client_negative_add(client, ipaddr, now);
+			goto unknown;
+		}
 	}
 
 	request->server = client->server;
@@ -318,7 +337,10 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	talloc_free(request);
 
-	if (!created) goto unknown;
+	if (!created) {
+		client_negative_add(client, ipaddr, now);
+		goto unknown;
+	}
 
 	return created;
 #endif
@@ -699,6 +721,12 @@ static int dual_tcp_accept(rad_listen_t *listener)
 		this->send = command_tcp_send;
 		command_write_magic(this->fd, sock);
 	} else
+#endif
+#ifdef WITH_METRICS
+	if (this->type == RAD_LISTEN_METRICS) {
+		this->recv = metrics_tcp_recv;
+		this->send = metrics_tcp_send;
+	} else
 #endif
 	{
 
@@ -2184,6 +2212,7 @@ static int proxy_socket_decode(UNUSED rad_listen_t *listener, REQUEST *request)
 #endif
 
 #include "command.c"
+#include "metrics.c"
 
 /*
  *	Temporarily NOT const!
@@ -2262,6 +2291,15 @@ static fr_protocol_t master_listen[RAD_LISTEN_MAX] = {
 	{ 0, "coa", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
 #endif
 
+#ifdef WITH_METRICS
+	/* Prometheus / OpenMetrics scrapes */
+	{ RLM_MODULE_INIT, "metrics", sizeof(listen_socket_t), NULL,
+	  metrics_socket_parse, common_socket_free,
+	  dual_tcp_accept, metrics_tcp_send,
+	  common_socket_print, metrics_socket_encode, metrics_socket_decode },
+#else
+	{ 0, "metrics", 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
+#endif
 };
 
 
@@ -2341,6 +2379,12 @@ static int listen_bind(rad_listen_t *this)
 			break;
 #endif
 
+#ifdef WITH_METRICS
+		case RAD_LISTEN_METRICS:
+			sock->my_port = METRICS_PORT;
+			break;
+#endif
+
 #ifdef WITH_COA
 		case RAD_LISTEN_COA:
 			svp = getservbyname ("radius-dynauth", "udp");
@@ -2687,6 +2731,9 @@ static int _listener_free(rad_listen_t *this)
 #ifdef WITH_COMMAND_SOCKET
 	    || ((this->type == RAD_LISTEN_COMMAND) &&
 		(((fr_command_socket_t *) this->data)->magic != COMMAND_SOCKET_MAGIC))
+#endif
+#ifdef WITH_METRICS
+	    || (this->type == RAD_LISTEN_METRICS)
 #endif
 		) {
 		listen_socket_t *sock = this->data;
@@ -2909,6 +2956,9 @@ static const FR_NAME_NUMBER listen_compare[] = {
 #endif
 #ifdef WITH_COA
 	{ "coa",	RAD_LISTEN_COA },
+#endif
+#ifdef WITH_METRICS
+	{ "metrics",	RAD_LISTEN_METRICS },
 #endif
 	{ NULL, 0 },
 };
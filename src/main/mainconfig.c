@@ -159,6 +159,17 @@ static const CONF_PARSER security_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *  Sampled request tracing.  See trace.c
+ */
+static const CONF_PARSER trace_config[] = {
+	{ "sample_rate", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.trace_sample_rate), "0" },
+	{ "filename", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.trace_file), "${logdir}/trace.json" },
+	{ "max_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.trace_max_size), "10485760" },
+	{ "max_files", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.trace_max_files), "5" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER resources[] = {
 	/*
 	 *	Don't set a default here.  It's set in the code, below.  This means that
@@ -190,6 +201,8 @@ static const CONF_PARSER server_config[] = {
 	{ "max_request_time", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.max_request_time), STRINGIFY(MAX_REQUEST_TIME) },
 	{ "cleanup_delay", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.cleanup_delay), STRINGIFY(CLEANUP_DELAY) },
 	{ "max_requests", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.max_requests), STRINGIFY(MAX_REQUESTS) },
+	{ "instantiate_threads", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.instantiate_threads), "0" },
+	{ "lazy_virtual_servers", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.lazy_virtual_servers), "no" },
 	{ "pidfile", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.pid_file), "${run_dir}/radiusd.pid"},
 	{ "checkrad", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.checkrad), "${sbindir}/checkrad" },
 
@@ -202,6 +215,8 @@ static const CONF_PARSER server_config[] = {
 
 	{ "resources", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) resources },
 
+	{ "trace", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) trace_config },
+
 	/*
 	 *	People with old configs will have these.  They are listed
 	 *	AFTER the "log" section, so if they exist in radiusd.conf,
@@ -972,10 +987,14 @@ do {\
 	FR_TIMEVAL_BOUND_CHECK("reject_delay", &main_config.reject_delay, <=, 10, 0);
 
 	FR_INTEGER_BOUND_CHECK("cleanup_delay", main_config.cleanup_delay, <=, 10);
+	FR_INTEGER_BOUND_CHECK("instantiate_threads", main_config.instantiate_threads, <=, 64);
 
 	FR_INTEGER_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, >=, 2 * 1024);
 	FR_INTEGER_BOUND_CHECK("resources.talloc_pool_size", main_config.talloc_pool_size, <=, 1024 * 1024);
 
+	FR_INTEGER_BOUND_CHECK("trace.max_size", main_config.trace_max_size, >=, 64 * 1024);
+	FR_INTEGER_BOUND_CHECK("trace.max_files", main_config.trace_max_files, <=, 100);
+
 	/*
 	 * Set default initial request processing delay to 1/3 of a second.
 	 * Will be updated by the lowest response window across all home servers,
@@ -1049,7 +1068,7 @@ do {\
  */
 int main_config_free(void)
 {
-	virtual_servers_free(0);
+	virtual_servers_free(true);
 
 	/*
 	 *	Clean up the configuration data
@@ -1128,6 +1147,11 @@ static int hup_callback(void *ctx, void *data)
 	return 1;
 }
 
+static double hup_elapsed(struct timeval const *start, struct timeval const *end)
+{
+	return (end->tv_sec - start->tv_sec) + ((end->tv_usec - start->tv_usec) / 1000000.0);
+}
+
 void main_config_hup(void)
 {
 	int rcode;
@@ -1135,6 +1159,7 @@ void main_config_hup(void)
 	CONF_SECTION *cs;
 	time_t when;
 	char buffer[1024];
+	struct timeval start, parsed, loaded, done;
 
 	static time_t last_hup = 0;
 
@@ -1183,6 +1208,8 @@ void main_config_hup(void)
 		return;
 	}
 
+	gettimeofday(&start, NULL);
+
 	cs = cf_section_alloc(NULL, "main", NULL);
 	if (!cs) return;
 
@@ -1196,6 +1223,8 @@ void main_config_hup(void)
 		return;
 	}
 
+	gettimeofday(&parsed, NULL);
+
 	cc = talloc_zero(cs_cache, cached_config_t);
 	if (!cc) {
 		ERROR("Out of memory");
@@ -1223,10 +1252,22 @@ void main_config_hup(void)
 	 */
 	modules_hup(cf_section_sub_find(cs, "modules"));
 
+	gettimeofday(&loaded, NULL);
+
 	/*
-	 *	Load new servers BEFORE freeing old ones.
+	 *	Load new servers BEFORE freeing old ones.  Requests
+	 *	already in progress carry on with the old servers,
+	 *	which are freed when the last of them finishes.
 	 */
-	virtual_servers_load(cs);
+	if (virtual_servers_load(cs) < 0) {
+		ERROR("HUP - Failed loading virtual servers from %s", buffer);
+		return;
+	}
+
+	virtual_servers_free(false);
 
-	virtual_servers_free(cc->created - (main_config.max_request_time * 4));
+	gettimeofday(&done, NULL);
+	INFO("HUP - Reloaded in %.3fs (read %.3fs, modules %.3fs, servers %.3fs)",
+	     hup_elapsed(&start, &done), hup_elapsed(&start, &parsed),
+	     hup_elapsed(&parsed, &loaded), hup_elapsed(&loaded, &done));
 }
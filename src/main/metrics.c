@@ -0,0 +1,720 @@
+/*
+ * metrics.c	Serve statistics to Prometheus, and other OpenMetrics scrapers.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2016 The FreeRADIUS server project
+ */
+
+/*
+ *	This file is included by listen.c, in the same way as
+ *	command.c.  A "metrics" listener is a TCP socket which
+ *	speaks just enough HTTP/1.0 to answer "GET /metrics".
+ *
+ *	Connections are accepted by dual_tcp_accept(), so the
+ *	scraper has to be listed as a client (with proto = tcp, or *).
+ *	The page is generated by the main thread.  Most counters are
+ *	read without locks, so one scrape may not be consistent
+ *	across all of them.  Some locks are also taken:
+ *
+ *	  - the queue mutex, briefly, by thread_pool_stats().  Worker
+ *	    threads take it on every dequeue.
+ *	  - the lock on the list of module and section statistics.
+ *	    Worker threads only take it when compiling a virtual
+ *	    server on first use.  The counters themselves are atomic.
+ *	  - the lock on the list of connection pools, which is only
+ *	    taken when a pool is created or freed.
+ *
+ *	The page is written without blocking, see metrics_write().
+ */
+#ifdef WITH_METRICS
+
+#include <freeradius-devel/modcall.h>
+
+#include <sys/uio.h>
+
+#define METRICS_PORT		(9812)
+#define METRICS_BUFFER_SIZE	(2048)
+
+typedef struct metrics_buffer_t {
+	size_t		used;
+	char		buffer[METRICS_BUFFER_SIZE];
+} metrics_buffer_t;
+
+/*
+ *	The global packet counters.
+ */
+typedef struct metrics_stats_t {
+	char const	*role;			//!< "server" for packets we receive, "proxy" for ones we send.
+	char const	*type;
+	fr_stats_t	*stats;
+} metrics_stats_t;
+
+static metrics_stats_t metrics_stats[] = {
+	{ "server",	"auth",		&radius_auth_stats },
+#ifdef WITH_ACCOUNTING
+	{ "server",	"acct",		&radius_acct_stats },
+#endif
+#ifdef WITH_COA
+	{ "server",	"coa",		&radius_coa_stats },
+	{ "server",	"disconnect",	&radius_dsc_stats },
+#endif
+#ifdef WITH_PROXY
+	{ "proxy",	"auth",		&proxy_auth_stats },
+#ifdef WITH_ACCOUNTING
+	{ "proxy",	"acct",		&proxy_acct_stats },
+#endif
+#ifdef WITH_COA
+	{ "proxy",	"coa",		&proxy_coa_stats },
+	{ "proxy",	"disconnect",	&proxy_dsc_stats },
+#endif
+#endif
+	{ NULL, NULL, NULL }
+};
+
+#define METRICS_NUM_STATS ((sizeof(metrics_stats) / sizeof(metrics_stats[0])) - 1)
+
+typedef struct metrics_counter_t {
+	char const	*name;
+	char const	*help;
+	size_t		offset;
+} metrics_counter_t;
+
+static metrics_counter_t const metrics_counters[] = {
+	{ "requests",		"Requests received, or proxied.",		offsetof(fr_stats_t, total_requests) },
+	{ "invalid_requests",	"Requests from unknown clients.",		offsetof(fr_stats_t, total_invalid_requests) },
+	{ "dup_requests",	"Duplicate requests.",				offsetof(fr_stats_t, total_dup_requests) },
+	{ "responses",		"Responses sent, or received from home servers.", offsetof(fr_stats_t, total_responses) },
+	{ "access_accepts",	"Access-Accepts.",				offsetof(fr_stats_t, total_access_accepts) },
+	{ "access_rejects",	"Access-Rejects.",				offsetof(fr_stats_t, total_access_rejects) },
+	{ "access_challenges",	"Access-Challenges.",				offsetof(fr_stats_t, total_access_challenges) },
+	{ "malformed_requests",	"Packets which could not be decoded.",		offsetof(fr_stats_t, total_malformed_requests) },
+	{ "bad_authenticators",	"Packets with a bad authenticator.",		offsetof(fr_stats_t, total_bad_authenticators) },
+	{ "packets_dropped",	"Packets dropped.",				offsetof(fr_stats_t, total_packets_dropped) },
+	{ "no_records",		"Accounting requests which were not recorded.",	offsetof(fr_stats_t, total_no_records) },
+	{ "unknown_types",	"Packets of an unknown type.",			offsetof(fr_stats_t, total_unknown_types) },
+	{ "timeouts",		"Requests which timed out.",			offsetof(fr_stats_t, total_timeouts) },
+	{ NULL, NULL, 0 }
+};
+
+#define METRICS_COUNTER(_stats, _offset) ((uint64_t) *(fr_uint_t const *) (((uint8_t const *) (_stats)) + (_offset)))
+
+/*
+ *	The upper bounds of fr_stats_t.elapsed[], see stats_time().
+ */
+static char const *metrics_elapsed_le[8] = {
+	"1e-05", "0.0001", "0.001", "0.01", "0.1", "1.0", "10.0", "+Inf"
+};
+
+/*
+ *	Copied out of the home_server_t, so that each family is
+ *	rendered from the same values.
+ */
+typedef struct metrics_home_t {
+	char const	*name;
+	char		address[128];
+	uint16_t	port;
+	bool		up;
+	uint32_t	outstanding;
+	uint64_t	requests;
+	uint64_t	responses;
+	uint64_t	timeouts;
+} metrics_home_t;
+
+typedef struct metrics_snapshot_t {
+	TALLOC_CTX			*ctx;
+
+	fr_stats_t			stats[METRICS_NUM_STATS];
+
+	metrics_home_t			*home;
+	int				num_home;
+
+	fr_connection_pool_stats_t	*pool;
+	int				num_pool;
+
+	modcall_stats_t			*module;
+	int				num_module;
+} metrics_snapshot_t;
+
+static void CC_HINT(format (printf, 2, 3)) mprintf(char **out, char const *fmt, ...)
+{
+	va_list ap;
+
+	if (!*out) return;
+
+	va_start(ap, fmt);
+	*out = talloc_vasprintf_append_buffer(*out, fmt, ap);
+	va_end(ap);
+}
+
+static void metrics_family(char **out, char const *name, char const *type, char const *help)
+{
+	mprintf(out, "# TYPE freeradius_%s %s\n# HELP freeradius_%s %s\n", name, type, name, help);
+}
+
+/*
+ *	Label values can be anything people put in the configuration.
+ */
+static void metrics_label(char **out, char const *name, char const *value)
+{
+	char const	*p;
+	char		buffer[256];
+	size_t		i = 0;
+
+	for (p = value; *p && (i < (sizeof(buffer) - 2)); p++) {
+		switch (*p) {
+		case '\\':
+		case '"':
+			buffer[i++] = '\\';
+			buffer[i++] = *p;
+			break;
+
+		case '\n':
+			buffer[i++] = '\\';
+			buffer[i++] = 'n';
+			break;
+
+		default:
+			buffer[i++] = *p;
+			break;
+		}
+	}
+	buffer[i] = '\0';
+
+	mprintf(out, "%s=\"%s\"", name, buffer);
+}
+
+static void metrics_home_label(char **out, metrics_home_t const *home)
+{
+	metrics_label(out, "{home_server", home->name);
+	mprintf(out, ",address=\"%s\",port=\"%u\"}", home->address, home->port);
+}
+
+static void metrics_pool_cb(void *ctx, fr_connection_pool_stats_t const *stats)
+{
+	metrics_snapshot_t *snap = ctx;
+
+	snap->pool = talloc_realloc(snap->ctx, snap->pool, fr_connection_pool_stats_t, snap->num_pool + 1);
+	if (!snap->pool) {
+		snap->num_pool = 0;
+		return;
+	}
+
+	snap->pool[snap->num_pool] = *stats;
+	snap->pool[snap->num_pool].name = talloc_strdup(snap->pool, stats->name);
+	snap->num_pool++;
+}
+
+static void metrics_module_cb(void *ctx, modcall_stats_t const *stats)
+{
+	metrics_snapshot_t *snap = ctx;
+
+	snap->module = talloc_realloc(snap->ctx, snap->module, modcall_stats_t, snap->num_module + 1);
+	if (!snap->module) {
+		snap->num_module = 0;
+		return;
+	}
+
+	snap->module[snap->num_module] = *stats;
+	snap->module[snap->num_module].name = talloc_strdup(snap->module, stats->name);
+	snap->num_module++;
+}
+
+static void metrics_snapshot(metrics_snapshot_t *snap)
+{
+	size_t i;
+
+	for (i = 0; i < METRICS_NUM_STATS; i++) {
+		snap->stats[i] = *metrics_stats[i].stats;
+	}
+
+#ifdef WITH_PROXY
+	for (i = 0; i < 256; i++) {
+		home_server_t	*home;
+		metrics_home_t	*mh;
+		time_t		now;
+
+		home = home_server_bynumber(i);
+		if (!home) break;
+
+		/*
+		 *	Internal "virtual" home server.
+		 */
+		if (home->ipaddr.af == AF_UNSPEC) continue;
+
+		snap->home = talloc_realloc(snap->ctx, snap->home, metrics_home_t, snap->num_home + 1);
+		if (!snap->home) {
+			snap->num_home = 0;
+			break;
+		}
+		mh = &snap->home[snap->num_home++];
+
+		mh->name = home->log_name ? home->log_name : "";
+		ip_ntoh(&home->ipaddr, mh->address, sizeof(mh->address));
+		mh->port = home->port;
+
+		/*
+		 *	The same reasoning as "show home_server list".
+		 */
+		now = time(NULL);
+		mh->up = (home->state == HOME_STATE_ALIVE) ||
+			 ((home->state == HOME_STATE_UNKNOWN) &&
+			  ((home->last_packet_recv + (int) home->ping_interval) >= now));
+
+		mh->outstanding = home->currently_outstanding;
+		mh->requests = home->stats.total_requests;
+		mh->responses = home->stats.total_responses;
+		mh->timeouts = home->stats.total_timeouts;
+	}
+#endif
+
+	fr_connection_pool_stats_walk(metrics_pool_cb, snap);
+	modcall_stats_walk(metrics_module_cb, snap);
+}
+
+static void metrics_render_stats(char **out, metrics_snapshot_t const *snap)
+{
+	int	i, j;
+	size_t	k;
+
+	for (i = 0; metrics_counters[i].name != NULL; i++) {
+		metrics_family(out, metrics_counters[i].name, "counter", metrics_counters[i].help);
+
+		for (k = 0; k < METRICS_NUM_STATS; k++) {
+			mprintf(out, "freeradius_%s_total{role=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+				metrics_counters[i].name, metrics_stats[k].role, metrics_stats[k].type,
+				METRICS_COUNTER(&snap->stats[k], metrics_counters[i].offset));
+		}
+	}
+
+	metrics_family(out, "response_time_seconds", "histogram",
+		       "Time from receiving a request to sending the response.");
+	for (k = 0; k < METRICS_NUM_STATS; k++) {
+		uint64_t count = 0;
+
+		for (j = 0; j < 8; j++) {
+			count += snap->stats[k].elapsed[j];
+			mprintf(out, "freeradius_response_time_seconds_bucket{role=\"%s\",type=\"%s\",le=\"%s\"} %" PRIu64 "\n",
+				metrics_stats[k].role, metrics_stats[k].type, metrics_elapsed_le[j], count);
+		}
+		mprintf(out, "freeradius_response_time_seconds_count{role=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+			metrics_stats[k].role, metrics_stats[k].type, count);
+		mprintf(out, "freeradius_response_time_seconds_sum{role=\"%s\",type=\"%s\"} %" PRIu64 ".%06" PRIu64 "\n",
+			metrics_stats[k].role, metrics_stats[k].type,
+			snap->stats[k].elapsed_usec / 1000000, snap->stats[k].elapsed_usec % 1000000);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static char const *metrics_queue_names[] = {
+	"internal", "proxy", "auth", "acct", "detail"
+};
+
+static void metrics_render_threads(char **out)
+{
+	int			i;
+	int			array[RAD_LISTEN_MAX], pps[2];
+	uint64_t		shed[QUEUE_SHED_MAX];
+	thread_pool_stats_t	stats;
+
+	thread_pool_stats(&stats);
+	thread_pool_queue_stats(array, pps);
+	thread_pool_shed_stats(shed);
+
+	metrics_family(out, "threads", "gauge", "Request processing threads.");
+	mprintf(out, "freeradius_threads{state=\"total\"} %u\n", stats.total_threads);
+	mprintf(out, "freeradius_threads{state=\"active\"} %u\n", stats.active_threads);
+
+	metrics_family(out, "threads_max", "gauge", "The most threads which can be started.");
+	mprintf(out, "freeradius_threads_max %u\n", stats.max_threads);
+
+	metrics_family(out, "queue_length", "gauge", "Requests waiting for a thread.");
+	for (i = 0; i < (int) (sizeof(metrics_queue_names) / sizeof(metrics_queue_names[0])); i++) {
+		mprintf(out, "freeradius_queue_length{queue=\"%s\"} %d\n", metrics_queue_names[i], array[i]);
+	}
+
+	metrics_family(out, "queue_pps", "gauge", "Packets per second into, and out of, the queue.");
+	mprintf(out, "freeradius_queue_pps{direction=\"in\"} %d\n", pps[0]);
+	mprintf(out, "freeradius_queue_pps{direction=\"out\"} %d\n", pps[1]);
+
+	metrics_family(out, "queue_shed", "counter", "Requests discarded by the queue, without being processed.");
+	mprintf(out, "freeradius_queue_shed_total{reason=\"full\"} %" PRIu64 "\n", shed[QUEUE_SHED_FULL]);
+	mprintf(out, "freeradius_queue_shed_total{reason=\"acct_limit\"} %" PRIu64 "\n", shed[QUEUE_SHED_ACCT_LIMIT]);
+	mprintf(out, "freeradius_queue_shed_total{reason=\"auth_delay\"} %" PRIu64 "\n", shed[QUEUE_SHED_AUTH_DELAY]);
+	mprintf(out, "freeradius_queue_shed_total{reason=\"acct_delay\"} %" PRIu64 "\n", shed[QUEUE_SHED_ACCT_DELAY]);
+}
+#endif
+
+static void metrics_render_home(char **out, metrics_snapshot_t const *snap)
+{
+	int i;
+
+	if (!snap->num_home) return;
+
+	metrics_family(out, "home_server_up", "gauge", "Whether the home server is responding.");
+	for (i = 0; i < snap->num_home; i++) {
+		mprintf(out, "freeradius_home_server_up");
+		metrics_home_label(out, &snap->home[i]);
+		mprintf(out, " %d\n", snap->home[i].up);
+	}
+
+	metrics_family(out, "home_server_outstanding", "gauge", "Requests sent to the home server, without a response.");
+	for (i = 0; i < snap->num_home; i++) {
+		mprintf(out, "freeradius_home_server_outstanding");
+		metrics_home_label(out, &snap->home[i]);
+		mprintf(out, " %u\n", snap->home[i].outstanding);
+	}
+
+	metrics_family(out, "home_server_requests", "counter", "Requests sent to the home server.");
+	for (i = 0; i < snap->num_home; i++) {
+		mprintf(out, "freeradius_home_server_requests_total");
+		metrics_home_label(out, &snap->home[i]);
+		mprintf(out, " %" PRIu64 "\n", snap->home[i].requests);
+	}
+
+	metrics_family(out, "home_server_responses", "counter", "Responses received from the home server.");
+	for (i = 0; i < snap->num_home; i++) {
+		mprintf(out, "freeradius_home_server_responses_total");
+		metrics_home_label(out, &snap->home[i]);
+		mprintf(out, " %" PRIu64 "\n", snap->home[i].responses);
+	}
+
+	metrics_family(out, "home_server_timeouts", "counter", "Requests the home server did not respond to.");
+	for (i = 0; i < snap->num_home; i++) {
+		mprintf(out, "freeradius_home_server_timeouts_total");
+		metrics_home_label(out, &snap->home[i]);
+		mprintf(out, " %" PRIu64 "\n", snap->home[i].timeouts);
+	}
+}
+
+static void metrics_render_pools(char **out, metrics_snapshot_t const *snap)
+{
+	int i;
+
+	if (!snap->num_pool) return;
+
+	metrics_family(out, "pool_connections", "gauge", "Connections in the pool.");
+	for (i = 0; i < snap->num_pool; i++) {
+		metrics_label(out, "freeradius_pool_connections{pool", snap->pool[i].name);
+		mprintf(out, ",state=\"open\"} %u\n", snap->pool[i].num);
+		metrics_label(out, "freeradius_pool_connections{pool", snap->pool[i].name);
+		mprintf(out, ",state=\"active\"} %u\n", snap->pool[i].active);
+		metrics_label(out, "freeradius_pool_connections{pool", snap->pool[i].name);
+		mprintf(out, ",state=\"pending\"} %u\n", snap->pool[i].pending);
+	}
+
+	metrics_family(out, "pool_connections_max", "gauge", "The most connections the pool will open.");
+	for (i = 0; i < snap->num_pool; i++) {
+		metrics_label(out, "freeradius_pool_connections_max{pool", snap->pool[i].name);
+		mprintf(out, "} %u\n", snap->pool[i].max);
+	}
+
+	metrics_family(out, "pool_opened", "counter", "Connections opened by the pool.");
+	for (i = 0; i < snap->num_pool; i++) {
+		metrics_label(out, "freeradius_pool_opened_total{pool", snap->pool[i].name);
+		mprintf(out, "} %" PRIu64 "\n", snap->pool[i].opened);
+	}
+}
+
+static void metrics_render_modules(char **out, metrics_snapshot_t const *snap)
+{
+	int i;
+
+	if (!snap->num_module) return;
+
+#define MODULE_LABEL(_name) \
+	metrics_label(out, "freeradius_" _name "{type", \
+		      (snap->module[i].type == MODCALL_STATS_MODULE) ? "module" : "section"); \
+	metrics_label(out, ",name", snap->module[i].name)
+
+	metrics_family(out, "module_calls", "counter", "Calls to a module, or a section.");
+	for (i = 0; i < snap->num_module; i++) {
+		MODULE_LABEL("module_calls_total");
+		mprintf(out, "} %" PRIu64 "\n", snap->module[i].calls);
+	}
+
+	metrics_family(out, "module_errors", "counter", "Calls which returned fail, or invalid.");
+	for (i = 0; i < snap->num_module; i++) {
+		MODULE_LABEL("module_errors_total");
+		mprintf(out, "} %" PRIu64 "\n", snap->module[i].errors);
+	}
+
+	metrics_family(out, "module_time_seconds", "counter", "Time spent in a module, or a section.");
+	for (i = 0; i < snap->num_module; i++) {
+		MODULE_LABEL("module_time_seconds_total");
+		mprintf(out, "} %" PRIu64 ".%06" PRIu64 "\n",
+			snap->module[i].total_usec / 1000000, snap->module[i].total_usec % 1000000);
+	}
+
+	metrics_family(out, "module_pool_wait_seconds", "counter",
+		       "Of the time spent in a module, how much was spent getting pool connections.");
+	for (i = 0; i < snap->num_module; i++) {
+		MODULE_LABEL("module_pool_wait_seconds_total");
+		mprintf(out, "} %" PRIu64 ".%06" PRIu64 "\n",
+			snap->module[i].pool_wait_usec / 1000000, snap->module[i].pool_wait_usec % 1000000);
+	}
+#undef MODULE_LABEL
+}
+
+/*
+ *	Render the whole page.
+ */
+static char *metrics_render(TALLOC_CTX *ctx)
+{
+	char			*out;
+	metrics_snapshot_t	snap;
+
+	memset(&snap, 0, sizeof(snap));
+	snap.ctx = talloc_new(ctx);
+	if (!snap.ctx) return NULL;
+
+	metrics_snapshot(&snap);
+
+	out = talloc_strdup(ctx, "");
+
+	metrics_family(&out, "start_time_seconds", "gauge", "When the server was started.");
+	mprintf(&out, "freeradius_start_time_seconds %ld\n", (long) fr_start_time);
+
+	metrics_render_stats(&out, &snap);
+#ifdef HAVE_PTHREAD_H
+	metrics_render_threads(&out);
+#endif
+	metrics_render_home(&out, &snap);
+	metrics_render_pools(&out, &snap);
+	metrics_render_modules(&out, &snap);
+
+	mprintf(&out, "# EOF\n");
+
+	talloc_free(snap.ctx);
+
+	return out;
+}
+
+static void metrics_close_socket(rad_listen_t *this)
+{
+	this->status = RAD_LISTEN_STATUS_EOL;
+
+	/*
+	 *	This removes the socket from the event fd, so no one
+	 *	will be calling us any more.
+	 */
+	radius_update_listener(this);
+}
+
+/*
+ *	The socket is non-blocking, and the event loop only tells us
+ *	when sockets are readable, so we can't wait for a scraper to
+ *	read the page.  Instead, the socket buffer is made big enough
+ *	to hold the whole response, and if the kernel still won't take
+ *	all of it, the connection is dropped.  A slow scraper gets a
+ *	truncated page (which it rejects, as it has a Content-Length),
+ *	but it can't stall the main thread.
+ */
+static void metrics_write(rad_listen_t *this, char const *status, char const *body, bool head)
+{
+	char		header[256];
+	size_t		body_len = body ? strlen(body) : 0;
+	ssize_t		r;
+	size_t		left, len;
+	int		i, size;
+	socklen_t	optlen;
+	struct iovec	iov[2];
+
+	snprintf(header, sizeof(header),
+		 "HTTP/1.0 %s\r\n"
+		 "Content-Type: %s\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n"
+		 "\r\n", status,
+		 body ? "application/openmetrics-text; version=1.0.0; charset=utf-8" : "text/plain",
+		 body_len);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = strlen(header);
+	memcpy(&iov[1].iov_base, &body, sizeof(iov[1].iov_base));
+	iov[1].iov_len = head ? 0 : body_len;
+
+	left = iov[0].iov_len + iov[1].iov_len;
+
+	/*
+	 *	The kernel caps this at net.core.wmem_max, so it's
+	 *	only a hint.
+	 */
+	optlen = sizeof(size);
+	if ((getsockopt(this->fd, SOL_SOCKET, SO_SNDBUF, &size, &optlen) == 0) &&
+	    (size >= 0) && ((size_t) size < left) && (left <= INT_MAX)) {
+		size = left;
+		(void) setsockopt(this->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+
+	while (left > 0) {
+		r = writev(this->fd, iov, 2);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			goto error;
+		}
+
+		left -= r;
+		for (i = 0; i < 2; i++) {
+			len = ((size_t) r < iov[i].iov_len) ? (size_t) r : iov[i].iov_len;
+
+			iov[i].iov_base = ((uint8_t *) iov[i].iov_base) + len;
+			iov[i].iov_len -= len;
+			r -= len;
+		}
+	}
+
+	return;
+
+error:
+	{
+		int	err = errno;
+		char	buffer[256];
+
+		this->print(this, buffer, sizeof(buffer));
+		RATE_LIMIT(WARN("Metrics scraper on %s did not accept the whole response: %s", buffer,
+				((err == EAGAIN) || (err == EWOULDBLOCK)) ? "Socket buffer is full" : fr_syserror(err)));
+	}
+}
+
+/*
+ *	Read the request.  Once we have the headers, answer it and
+ *	close the connection.
+ */
+static int metrics_tcp_recv(rad_listen_t *this)
+{
+	ssize_t			len;
+	listen_socket_t		*sock = this->data;
+	metrics_buffer_t	*mb = (void *) sock->packet;
+	char			*p, *method, *path;
+	char			*page;
+	bool			head = false;
+
+	if (!mb) {
+		mb = talloc_zero(sock, metrics_buffer_t);
+		if (!mb) goto do_close;
+		sock->packet = (void *) mb;
+
+		fr_nonblock(this->fd);
+	}
+
+	len = read(this->fd, mb->buffer + mb->used, sizeof(mb->buffer) - mb->used - 1);
+	if (len < 0) {
+		if ((errno == EINTR) || (errno == EAGAIN)) return 0;
+		goto do_close;
+	}
+	if (len == 0) goto do_close;
+
+	mb->used += len;
+	mb->buffer[mb->used] = '\0';
+	sock->last_packet = time(NULL);
+
+	/*
+	 *	Wait for the end of the headers.  We don't care what's
+	 *	in them.
+	 */
+	if (!strstr(mb->buffer, "\r\n\r\n") && !strstr(mb->buffer, "\n\n")) {
+		if (mb->used < (sizeof(mb->buffer) - 1)) return 0;
+
+		metrics_write(this, "431 Request Header Fields Too Large", NULL, false);
+		goto do_close;
+	}
+
+	/*
+	 *	"GET /metrics HTTP/1.1"
+	 */
+	method = mb->buffer;
+	p = strchr(method, ' ');
+	if (!p) goto bad_request;
+	*(p++) = '\0';
+
+	path = p;
+	p = strpbrk(path, " ?\r\n");
+	if (!p) goto bad_request;
+	*p = '\0';
+
+	if (strcmp(method, "HEAD") == 0) {
+		head = true;
+
+	} else if (strcmp(method, "GET") != 0) {
+		metrics_write(this, "405 Method Not Allowed", NULL, false);
+		goto do_close;
+	}
+
+	if ((strcmp(path, "/metrics") != 0) && (strcmp(path, "/") != 0)) {
+		metrics_write(this, "404 Not Found", NULL, false);
+		goto do_close;
+	}
+
+	page = metrics_render(this);
+	if (!page) {
+		metrics_write(this, "500 Internal Server Error", NULL, false);
+		goto do_close;
+	}
+
+	metrics_write(this, "200 OK", page, head);
+	talloc_free(page);
+	goto do_close;
+
+bad_request:
+	metrics_write(this, "400 Bad Request", NULL, false);
+
+do_close:
+	metrics_close_socket(this);
+	return 0;
+}
+
+/*
+ *	Should never be called.  We write() directly.
+ */
+static int metrics_tcp_send(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_encode(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_decode(UNUSED rad_listen_t *listener, UNUSED REQUEST *request)
+{
+	return 0;
+}
+
+static int metrics_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
+{
+	listen_socket_t *sock;
+
+	if (common_socket_parse(cs, this) < 0) return -1;
+
+#ifdef WITH_TLS
+	if (this->tls) {
+		cf_log_err_cs(cs, "TLS is not supported for metrics sockets");
+		return -1;
+	}
+#endif
+
+	sock = this->data;
+	if (sock->proto != IPPROTO_TCP) {
+		cf_log_err_cs(cs, "Metrics sockets must have \"proto = tcp\"");
+		return -1;
+	}
+
+	return 0;
+}
+#endif	/* WITH_METRICS */
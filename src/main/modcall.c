@@ -77,11 +77,13 @@ typedef struct {
 	vp_tmpl_t	*vpt;		/* switch */
 	fr_cond_t		*cond;		/* if/elsif */
 	bool			done_pass2;
+	struct modcall_stats_entry_t *stats;	/* top-level sections and policies */
 } modgroup;
 
 typedef struct {
 	modcallable mc;
 	module_instance_t *modinst;
+	struct modcall_stats_entry_t *stats;
 } modsingle;
 
 typedef struct {
@@ -272,6 +274,252 @@ static void safe_unlock(module_instance_t *instance)
 #define safe_unlock(foo)
 #endif
 
+/*
+ *	Latency statistics.  There's one entry per module instance,
+ *	and one per section or policy name, no matter how many times
+ *	they're compiled.  Entries are kept until the server exits,
+ *	so that compiled sections from older configurations can
+ *	still point to them.
+ *
+ *	The counters are updated with atomic adds, so timing a call
+ *	takes no locks.
+ */
+typedef struct modcall_stats_entry_t {
+	modcall_stats_t		stats;
+} modcall_stats_entry_t;
+
+static rbtree_t *modcall_stats_tree = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t modcall_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define STATS_LOCK(_x)	pthread_mutex_lock(_x)
+#  define STATS_UNLOCK(_x)	pthread_mutex_unlock(_x)
+#else
+#  define STATS_LOCK(_x)
+#  define STATS_UNLOCK(_x)
+#endif
+
+static int modcall_stats_cmp(void const *one, void const *two)
+{
+	modcall_stats_entry_t const *a = one;
+	modcall_stats_entry_t const *b = two;
+
+	if (a->stats.type != b->stats.type) return (a->stats.type < b->stats.type) ? -1 : +1;
+
+	return strcmp(a->stats.name, b->stats.name);
+}
+
+/** Find, or create, the statistics for a module or section
+ *
+ * @param type of thing being timed.
+ * @param name of the module instance or section.
+ * @return the entry, or NULL on error.
+ */
+static modcall_stats_entry_t *modcall_stats_find(modcall_stats_type_t type, char const *name)
+{
+	modcall_stats_entry_t my_entry, *entry;
+
+	my_entry.stats.type = type;
+	my_entry.stats.name = name;
+
+	STATS_LOCK(&modcall_stats_mutex);
+	if (!modcall_stats_tree) {
+		modcall_stats_tree = rbtree_create(talloc_autofree_context(), modcall_stats_cmp, NULL, 0);
+		if (!modcall_stats_tree) {
+			STATS_UNLOCK(&modcall_stats_mutex);
+			return NULL;
+		}
+	}
+
+	entry = rbtree_finddata(modcall_stats_tree, &my_entry);
+	if (!entry) {
+		entry = talloc_zero(modcall_stats_tree, modcall_stats_entry_t);
+		entry->stats.type = type;
+		entry->stats.name = talloc_strdup(entry, name);
+		if (!rbtree_insert(modcall_stats_tree, entry)) {
+			talloc_free(entry);
+			entry = NULL;
+		}
+	}
+	STATS_UNLOCK(&modcall_stats_mutex);
+
+	return entry;
+}
+
+/*
+ *	Name a top-level section after its virtual server, e.g.
+ *	"server default authorize", or "server default Auth-Type PAP".
+ *	Policies are named "policy <name>".
+ */
+static modcall_stats_entry_t *modcall_stats_section(modcallable *parent, CONF_SECTION *cs, char const *name)
+{
+	char		buffer[256];
+	CONF_SECTION	*server;
+	char const	*name2;
+
+	if (parent) {
+		snprintf(buffer, sizeof(buffer), "policy %s", name);
+		return modcall_stats_find(MODCALL_STATS_SECTION, buffer);
+	}
+
+	for (server = cf_item_parent(cf_section_to_item(cs));
+	     server != NULL;
+	     server = cf_item_parent(cf_section_to_item(server))) {
+		if (strcmp(cf_section_name1(server), "server") == 0) break;
+	}
+
+	name2 = cf_section_name2(cs);
+	snprintf(buffer, sizeof(buffer), "server %s %s%s%s",
+		 (server && cf_section_name2(server)) ? cf_section_name2(server) : "default",
+		 cf_section_name1(cs), name2 ? " " : "", name2 ? name2 : "");
+
+	return modcall_stats_find(MODCALL_STATS_SECTION, buffer);
+}
+
+static uint64_t modcall_stats_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+	}
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return ((uint64_t) tv.tv_sec * 1000000) + tv.tv_usec;
+	}
+}
+
+static void modcall_stats_update(modcall_stats_entry_t *entry, uint64_t start, uint64_t wait_start, rlm_rcode_t rcode)
+{
+	uint64_t	now, elapsed, wait;
+	int		bucket;
+
+	now = modcall_stats_now();
+	elapsed = (now > start) ? (now - start) : 0;
+	wait = fr_connection_wait_usec() - wait_start;
+
+	for (bucket = 0; (bucket < (MODCALL_STATS_BUCKETS - 1)) && ((elapsed >> (bucket + 1)) != 0); bucket++) {
+		/* nothing */
+	}
+
+	fr_atomic_counter_add(&entry->stats.calls, 1);
+	if ((rcode == RLM_MODULE_FAIL) || (rcode == RLM_MODULE_INVALID)) {
+		fr_atomic_counter_add(&entry->stats.errors, 1);
+	}
+	fr_atomic_counter_add(&entry->stats.total_usec, elapsed);
+	fr_atomic_counter_max(&entry->stats.max_usec, elapsed);
+	fr_atomic_counter_add(&entry->stats.pool_wait_usec, wait);
+	fr_atomic_counter_add(&entry->stats.histogram[bucket], 1);
+}
+
+typedef struct modcall_stats_walk_t {
+	modcall_stats_cb_t	callback;
+	void			*ctx;
+} modcall_stats_walk_t;
+
+static int modcall_stats_walk_cb(void *ctx, void *data)
+{
+	modcall_stats_walk_t	*walk = ctx;
+	modcall_stats_entry_t	*entry = data;
+	modcall_stats_t		copy;
+	int			i;
+
+	if (!walk->callback) {
+		fr_atomic_counter_set(&entry->stats.calls, 0);
+		fr_atomic_counter_set(&entry->stats.errors, 0);
+		fr_atomic_counter_set(&entry->stats.total_usec, 0);
+		fr_atomic_counter_set(&entry->stats.max_usec, 0);
+		fr_atomic_counter_set(&entry->stats.pool_wait_usec, 0);
+		for (i = 0; i < MODCALL_STATS_BUCKETS; i++) {
+			fr_atomic_counter_set(&entry->stats.histogram[i], 0);
+		}
+		return 0;
+	}
+
+	/*
+	 *	Calls in progress may be counted in some of the
+	 *	fields and not yet in others.
+	 */
+	copy.type = entry->stats.type;
+	copy.name = entry->stats.name;
+	copy.calls = fr_atomic_counter_get(&entry->stats.calls);
+	copy.errors = fr_atomic_counter_get(&entry->stats.errors);
+	copy.total_usec = fr_atomic_counter_get(&entry->stats.total_usec);
+	copy.max_usec = fr_atomic_counter_get(&entry->stats.max_usec);
+	copy.pool_wait_usec = fr_atomic_counter_get(&entry->stats.pool_wait_usec);
+	for (i = 0; i < MODCALL_STATS_BUCKETS; i++) {
+		copy.histogram[i] = fr_atomic_counter_get(&entry->stats.histogram[i]);
+	}
+
+	walk->callback(walk->ctx, &copy);
+
+	return 0;
+}
+
+/** Call a function with a copy of the statistics for every module and section
+ *
+ * Modules are first, then sections, each in order of name.
+ */
+void modcall_stats_walk(modcall_stats_cb_t callback, void *ctx)
+{
+	modcall_stats_walk_t walk;
+
+	walk.callback = callback;
+	walk.ctx = ctx;
+
+	STATS_LOCK(&modcall_stats_mutex);
+	if (modcall_stats_tree) rbtree_walk(modcall_stats_tree, RBTREE_IN_ORDER, modcall_stats_walk_cb, &walk);
+	STATS_UNLOCK(&modcall_stats_mutex);
+}
+
+/** Zero the statistics for every module and section
+ *
+ */
+void modcall_stats_reset(void)
+{
+	modcall_stats_walk(NULL, NULL);
+}
+
+/** Estimate a percentile of the call latency
+ *
+ * @param stats to look at.
+ * @param percent to find, e.g. 50 or 99.
+ * @return the latency in microseconds, interpolated within the
+ *	histogram bucket where it falls.
+ */
+uint64_t modcall_stats_percentile(modcall_stats_t const *stats, unsigned int percent)
+{
+	uint64_t	want, seen = 0;
+	int		i;
+
+	if (!stats->calls) return 0;
+
+	want = ((stats->calls * percent) + 99) / 100;
+	if (!want) want = 1;
+
+	for (i = 0; i < MODCALL_STATS_BUCKETS; i++) {
+		uint64_t low, high;
+
+		if ((seen + stats->histogram[i]) < want) {
+			seen += stats->histogram[i];
+			continue;
+		}
+
+		low = i ? ((uint64_t) 1 << i) : 0;
+		high = ((uint64_t) 1 << (i + 1)) - 1;
+		if (high > stats->max_usec) high = stats->max_usec;
+		if (low > high) low = high;
+
+		return low + (((high - low) * (want - seen)) / stats->histogram[i]);
+	}
+
+	return stats->max_usec;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, modsingle *sp, REQUEST *request)
 {
 	int blocked;
@@ -298,9 +546,23 @@ static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, m
 	 */
 	request->module = sp->modinst->name;
 
-	safe_lock(sp->modinst);
-	request->rcode = sp->modinst->entry->module->methods[component](sp->modinst->insthandle, request);
-	safe_unlock(sp->modinst);
+	if (sp->stats) {
+		uint64_t start, wait_start;
+
+		wait_start = fr_connection_wait_usec();
+		start = modcall_stats_now();
+
+		safe_lock(sp->modinst);
+		request->rcode = sp->modinst->entry->module->methods[component](sp->modinst->insthandle, request);
+		safe_unlock(sp->modinst);
+
+		modcall_stats_update(sp->stats, start, wait_start, request->rcode);
+		if (request->trace) request_trace_span(request, "module", sp->modinst->name, start);
+	} else {
+		safe_lock(sp->modinst);
+		request->rcode = sp->modinst->entry->module->methods[component](sp->modinst->insthandle, request);
+		safe_unlock(sp->modinst);
+	}
 
 	request->module = "";
 
@@ -786,9 +1048,23 @@ redo:
 		}
 
 		MOD_LOG_OPEN_BRACE;
-		modcall_child(request, component,
-			      depth + 1, entry, g->children,
-			      &result, true);
+		if (g->stats) {
+			uint64_t start, wait_start;
+
+			wait_start = fr_connection_wait_usec();
+			start = modcall_stats_now();
+
+			modcall_child(request, component,
+				      depth + 1, entry, g->children,
+				      &result, true);
+
+			modcall_stats_update(g->stats, start, wait_start, result);
+			if (request->trace) request_trace_span(request, "section", g->stats->stats.name, start);
+		} else {
+			modcall_child(request, component,
+				      depth + 1, entry, g->children,
+				      &result, true);
+		}
 		MOD_LOG_CLOSE_BRACE;
 		goto calculate_result;
 	} /* MOD_GROUP */
@@ -2669,6 +2945,7 @@ allocate_csingle:
 
 	single = talloc_zero(parent, modsingle);
 	single->modinst = this;
+	single->stats = modcall_stats_find(MODCALL_STATS_MODULE, this->name);
 	*modname = this->entry->module->name;
 
 	csingle = mod_singletocallable(single);
@@ -2803,6 +3080,8 @@ static modcallable *do_compile_modgroup(modcallable *parent,
 		}
 	}
 
+	if (!parent || (c->type == MOD_POLICY)) g->stats = modcall_stats_section(parent, cs, c->name);
+
 #ifdef WITH_UNLANG
 	/*
 	 *	Do load-time optimizations
@@ -44,7 +44,12 @@ typedef struct indexed_modcallable {
 typedef struct virtual_server_t {
 	char const	*name;
 	time_t		created;
-	int		can_free;
+	uint32_t	generation;	//!< Which load of the configuration this came from.
+	uint32_t	superseded;	//!< Generation which replaced it, or 0.
+	bool		lazy;		//!< Compile on first use.
+	bool		compiled;	//!< Sections have been compiled, and pass2 run.  Read
+					//!< with fr_atomic_load() outside compile_mutex.
+	bool		failed;		//!< Compiling on first use failed.  Don't retry.
 	CONF_SECTION	*cs;
 	rbtree_t	*components;
 	modcallable	*mc[MOD_COUNT];
@@ -58,10 +63,79 @@ typedef struct virtual_server_t {
 #define VIRTUAL_SERVER_HASH_SIZE (256)
 static virtual_server_t *virtual_servers[VIRTUAL_SERVER_HASH_SIZE];
 
+/*
+ *	Each load of the virtual servers is a new generation.  A
+ *	request is pinned to the generation which was current when
+ *	it arrived, and sees only the servers from that generation,
+ *	even if the configuration is reloaded while it's being
+ *	processed.  A new generation becomes visible only once all
+ *	of its servers have loaded, and a superseded server is freed
+ *	once the last request which could use it has finished.
+ */
+struct server_generation_t {
+	uint32_t			number;
+	uint32_t			requests;	//!< Requests pinned to this generation.  Changed
+							//!< atomically.
+	rbtree_t			*servers;	//!< Servers seen by this generation, by name.  Never
+							//!< changed once published, so it's searched without
+							//!< locks.
+	struct server_generation_t	*next;
+};
+
+static uint32_t			generation_loading = 0;		//!< Being loaded, not yet seen.
+static server_generation_t	*generation_current = NULL;	//!< Seen by new requests.
+static server_generation_t	*generations = NULL;		//!< Newest first.
+
+/*
+ *	Protects the list of generations, and the current generation.
+ *	The lists of servers are only changed by the main thread.
+ */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t		server_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define SERVER_LOCK		pthread_mutex_lock(&server_mutex)
+#  define SERVER_UNLOCK		pthread_mutex_unlock(&server_mutex)
+#else
+#  define SERVER_LOCK
+#  define SERVER_UNLOCK
+#endif
+
+/*
+ *	Serializes compiling virtual servers on first use.  See
+ *	virtual_server_ready().
+ */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t		compile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define COMPILE_LOCK		pthread_mutex_lock(&compile_mutex)
+#  define COMPILE_UNLOCK	pthread_mutex_unlock(&compile_mutex)
+#else
+#  define COMPILE_LOCK
+#  define COMPILE_UNLOCK
+#endif
+
 static rbtree_t *module_tree = NULL;
 
 static rbtree_t *instance_tree = NULL;
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Modules may be instantiated by several threads at once.  The
+ *	threads take turns holding instantiate_mutex, and only let go
+ *	of it while a connection pool is opening its initial
+ *	connections.  See modules_instantiate_parallel().
+ */
+static pthread_mutex_t	instantiate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	instantiate_cond = PTHREAD_COND_INITIALIZER;
+static bool		instantiate_parallel = false;
+
+typedef struct instantiate_queue_t {
+	CONF_SECTION		*modules;
+	module_instance_t	**nodes;		//!< Modules still to be instantiated.
+	int			num;
+	int			next;
+	bool			failed;
+} instantiate_queue_t;
+#endif
+
 struct fr_module_hup_t {
 	module_instance_t	*mi;
 	time_t			when;
@@ -301,15 +375,50 @@ static int virtual_server_idx(char const *name)
 	return hash & (VIRTUAL_SERVER_HASH_SIZE - 1);
 }
 
-static virtual_server_t *virtual_server_find(char const *name)
+static int virtual_server_name_cmp(void const *one, void const *two)
+{
+	virtual_server_t const *a = one;
+	virtual_server_t const *b = two;
+
+	if (!a->name && !b->name) return 0;
+	if (!a->name) return -1;
+	if (!b->name) return +1;
+
+	return strcmp(a->name, b->name);
+}
+
+/** Find the version of a virtual server seen by a generation
+ *
+ * The caller must hold a pin on the generation.
+ *
+ * @param name of the server, or NULL for the default server.
+ * @param gen to look in.
+ * @return the server, or NULL if it doesn't exist in that generation.
+ */
+static virtual_server_t *virtual_server_find(char const *name, server_generation_t *gen)
+{
+	virtual_server_t my_server;
+
+	my_server.name = name;
+
+	return rbtree_finddata(gen->servers, &my_server);
+}
+
+/** Find the version of a virtual server seen by the generation being loaded
+ *
+ * Only the main thread changes the lists of servers, so this needs no
+ * locks when called from virtual_servers_load().
+ */
+static virtual_server_t *virtual_server_find_loading(char const *name)
 {
-	rlm_rcode_t rcode;
 	virtual_server_t *server;
 
-	rcode = virtual_server_idx(name);
-	for (server = virtual_servers[rcode];
+	for (server = virtual_servers[virtual_server_idx(name)];
 	     server != NULL;
 	     server = server->next) {
+		if (server->generation > generation_loading) continue;
+		if (server->superseded && (server->superseded <= generation_loading)) continue;
+
 		if (!name && !server->name) break;
 
 		if ((name && server->name) &&
@@ -319,16 +428,108 @@ static virtual_server_t *virtual_server_find(char const *name)
 	return server;
 }
 
+/** Pin a request to a generation of virtual servers
+ *
+ * New requests are pinned to the current generation.  They are
+ * pinned by the main thread, which is also the only thread which
+ * publishes and frees generations, so this needs no locks.
+ *
+ * Child requests which can outlive their parent (i.e. CoA) take their
+ * own pin on the parent's generation.  It can't be freed while the
+ * parent holds its pin.
+ *
+ * @param parent to share the generation of, or NULL for the current
+ *	generation.
+ * @return the generation, to be passed to virtual_servers_unpin().
+ */
+server_generation_t *virtual_servers_pin(REQUEST *parent)
+{
+	server_generation_t *gen;
+
+	gen = parent ? parent->generation : generation_current;
+	if (gen) fr_atomic_add(&gen->requests, 1);
+
+	return gen;
+}
+
+/** Pin to the current generation from a thread other than the main one
+ *
+ */
+static server_generation_t *virtual_servers_pin_current(void)
+{
+	server_generation_t *gen;
+
+	SERVER_LOCK;
+	gen = generation_current;
+	if (gen) fr_atomic_add(&gen->requests, 1);
+	SERVER_UNLOCK;
+
+	return gen;
+}
+
+/** Release a pin on a generation of virtual servers
+ *
+ * @param gen returned by virtual_servers_pin().
+ * @return true if this was the last request using an old generation,
+ *	and virtual_servers_free() may now be able to free something.
+ */
+bool virtual_servers_unpin(server_generation_t *gen)
+{
+	if (!gen) return false;
+
+	if (fr_atomic_sub(&gen->requests, 1) > 0) return false;
+
+	return (gen != fr_atomic_load(&generation_current));
+}
+
 static int _virtual_server_free(virtual_server_t *server)
 {
 	if (server->components) rbtree_free(server->components);
 	return 0;
 }
 
-void virtual_servers_free(time_t when)
+/** Free virtual servers
+ *
+ * @param all if true, free every server.  Otherwise free only the
+ *	servers which have been superseded, and which no request
+ *	pinned to an older generation can still use.
+ */
+void virtual_servers_free(bool all)
 {
-	int i;
+	int i, freed = 0;
 	virtual_server_t **last;
+	server_generation_t *gen, **gen_last;
+	uint32_t oldest;
+
+	SERVER_LOCK;
+
+	/*
+	 *	Forget old generations which no request is pinned to.
+	 *	Nothing can pin them again, as only the current
+	 *	generation, or one which a parent request is pinned
+	 *	to, can be pinned.
+	 */
+	gen_last = &generations;
+	while ((gen = *gen_last) != NULL) {
+		if (all ||
+		    ((gen != generation_current) && (fr_atomic_load(&gen->requests) == 0))) {
+			*gen_last = gen->next;
+			talloc_free(gen);
+			continue;
+		}
+
+		gen_last = &gen->next;
+	}
+	if (all) fr_atomic_store(&generation_current, NULL);
+
+	/*
+	 *	Requests from the oldest pinned generation onwards may
+	 *	still be running.
+	 */
+	oldest = generation_current ? generation_current->number : 0;
+	for (gen = generations; gen != NULL; gen = gen->next) {
+		if (gen->number < oldest) oldest = gen->number;
+	}
 
 	for (i = 0; i < VIRTUAL_SERVER_HASH_SIZE; i++) {
 		virtual_server_t *server, *next;
@@ -342,21 +543,119 @@ void virtual_servers_free(time_t when)
 			/*
 			 *	If we delete it, fix the links so that
 			 *	we don't orphan anything.  Also,
-			 *	delete it if it's old, AND a newer one
-			 *	was defined.
+			 *	delete it if a newer one was defined,
+			 *	AND nothing can still be using it.
 			 *
 			 *	Otherwise, the last pointer gets set to
 			 *	the one we didn't delete.
 			 */
-			if ((when == 0) ||
-			    ((server->created < when) && server->can_free)) {
+			if (all ||
+			    (server->superseded && (server->superseded <= oldest))) {
 				*last = server->next;
 				talloc_free(server);
+				freed++;
 			} else {
 				last = &(server->next);
 			}
 		}
 	}
+
+	SERVER_UNLOCK;
+
+	if (!all && freed) DEBUG2("Freed %i virtual server(s) from older configurations", freed);
+}
+
+/** Forget a generation which failed to load
+ *
+ */
+static void virtual_servers_discard(uint32_t generation)
+{
+	int i;
+	virtual_server_t **last, *server, *next;
+
+	for (i = 0; i < VIRTUAL_SERVER_HASH_SIZE; i++) {
+		last = &virtual_servers[i];
+		for (server = virtual_servers[i];
+		     server != NULL;
+		     server = next) {
+			next = server->next;
+
+			if (server->generation == generation) {
+				*last = server->next;
+				talloc_free(server);
+			} else {
+				last = &(server->next);
+			}
+		}
+	}
+}
+
+/** Make a generation which has finished loading visible to new requests
+ *
+ * Servers from older generations which have a replacement of the
+ * same name are marked as superseded.  Servers without a
+ * replacement are kept, as listeners and clients may still refer
+ * to them.
+ *
+ * The table of servers the generation sees is built first, and is
+ * never changed afterwards.  Requests pinned to the generation
+ * search it without locks.
+ */
+static int virtual_servers_publish(uint32_t generation)
+{
+	int i;
+	virtual_server_t *server;
+	server_generation_t *gen;
+
+	gen = talloc_zero(NULL, server_generation_t);
+	if (!gen) return -1;
+
+	gen->number = generation;
+	gen->servers = rbtree_create(gen, virtual_server_name_cmp, NULL, 0);
+	if (!gen->servers) {
+	error:
+		ERROR("Failed creating table of virtual servers");
+		talloc_free(gen);
+		return -1;
+	}
+
+	/*
+	 *	The new servers, then the older ones they don't
+	 *	replace.
+	 */
+	for (i = 0; i < VIRTUAL_SERVER_HASH_SIZE; i++) {
+		for (server = virtual_servers[i]; server != NULL; server = server->next) {
+			if (server->generation != generation) continue;
+
+			if (!rbtree_insert(gen->servers, server)) goto error;
+		}
+	}
+
+	for (i = 0; i < VIRTUAL_SERVER_HASH_SIZE; i++) {
+		for (server = virtual_servers[i]; server != NULL; server = server->next) {
+			if ((server->generation >= generation) || server->superseded) continue;
+
+			if (rbtree_finddata(gen->servers, server)) continue;
+
+			if (!rbtree_insert(gen->servers, server)) goto error;
+		}
+	}
+
+	for (i = 0; i < VIRTUAL_SERVER_HASH_SIZE; i++) {
+		for (server = virtual_servers[i]; server != NULL; server = server->next) {
+			if ((server->generation >= generation) || server->superseded) continue;
+
+			if (rbtree_finddata(gen->servers, server) != server) server->superseded = generation;
+		}
+	}
+
+	SERVER_LOCK;
+	gen->next = generations;
+	generations = gen;
+	fr_atomic_store(&generation_current, gen);
+	SERVER_UNLOCK;
+
+	return 0;
 }
 
 static int indexed_modcallable_cmp(void const *one, void const *two)
@@ -714,27 +1013,11 @@ module_instance_t *module_find(CONF_SECTION *modules, char const *askedname)
 }
 
 
-/** Load a module, and instantiate it.
+/** Instantiate a module which has been bootstrapped
  *
  */
-module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedname)
+static int module_instantiate_node(module_instance_t *node)
 {
-	module_instance_t *node;
-
-	/*
-	 *	Find the module.  If it's not there, do nothing.
-	 */
-	node = module_find(modules, askedname);
-	if (!node) {
-		ERROR("Cannot find module \"%s\"", askedname);
-		return NULL;
-	}
-
-	/*
-	 *	The module is already instantiated.  Return it.
-	 */
-	if (node->instantiated) return node;
-
 	/*
 	 *	Now that ALL modules are instantiated, and ALL xlats
 	 *	are defined, go compile the config items marked as XLAT.
@@ -742,24 +1025,34 @@ module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedna
 	if (node->entry->module->config &&
 	    (cf_section_parse_pass2(node->cs, node->insthandle,
 				    node->entry->module->config) < 0)) {
-		return NULL;
+		return -1;
 	}
 
 	/*
 	 *	Call the instantiate method, if any.
 	 */
 	if (node->entry->module->instantiate) {
+		struct timeval start, end;
+		uint64_t usec;
+
 		cf_log_module(node->cs, "Instantiating module \"%s\" from file %s", node->name,
 			      cf_section_filename(node->cs));
 
+		gettimeofday(&start, NULL);
+
 		/*
 		 *	Call the module's instantiation routine.
 		 */
 		if ((node->entry->module->instantiate)(node->cs, node->insthandle) < 0) {
 			cf_log_err_cs(node->cs, "Instantiation failed for module \"%s\"", node->name);
 
-			return NULL;
+			return -1;
 		}
+
+		gettimeofday(&end, NULL);
+		usec = ((end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+		cf_log_module(node->cs, "Instantiated module \"%s\" in %u.%06u seconds", node->name,
+			      (unsigned int) (usec / 1000000), (unsigned int) (usec % 1000000));
 	}
 
 #ifdef HAVE_PTHREAD_H
@@ -781,9 +1074,167 @@ module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedna
 	node->instantiated = true;
 	node->last_hup = time(NULL); /* don't let us load it, then immediately hup it */
 
+	return 0;
+}
+
+/** Load a module, and instantiate it.
+ *
+ */
+module_instance_t *module_instantiate(CONF_SECTION *modules, char const *askedname)
+{
+	module_instance_t *node;
+
+	/*
+	 *	Find the module.  If it's not there, do nothing.
+	 */
+	node = module_find(modules, askedname);
+	if (!node) {
+		ERROR("Cannot find module \"%s\"", askedname);
+		return NULL;
+	}
+
+	/*
+	 *	The module is already instantiated.  Return it.
+	 */
+	if (node->instantiated) return node;
+
+#ifdef HAVE_PTHREAD_H
+	if (instantiate_parallel) {
+		int rcode;
+
+		/*
+		 *	Another thread is instantiating the module
+		 *	we depend on.  Wait for it to finish.
+		 */
+		if (node->instantiating && !pthread_equal(node->instantiating_thread, pthread_self())) {
+			while (node->instantiating) pthread_cond_wait(&instantiate_cond, &instantiate_mutex);
+
+			return node->instantiated ? node : NULL;
+		}
+
+		node->instantiating = true;
+		node->instantiating_thread = pthread_self();
+
+		rcode = module_instantiate_node(node);
+
+		node->instantiating = false;
+		pthread_cond_broadcast(&instantiate_cond);
+
+		return (rcode < 0) ? NULL : node;
+	}
+#endif
+
+	if (module_instantiate_node(node) < 0) return NULL;
+
 	return node;
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Let other threads instantiate modules while this one blocks
+ *
+ * Called by the connection pool around opening a connection.  Does
+ * nothing unless modules are being instantiated in parallel.
+ */
+void module_instantiate_unlock(void)
+{
+	if (instantiate_parallel) pthread_mutex_unlock(&instantiate_mutex);
+}
+
+/** Undo module_instantiate_unlock()
+ *
+ */
+void module_instantiate_relock(void)
+{
+	if (instantiate_parallel) pthread_mutex_lock(&instantiate_mutex);
+}
+
+static void *instantiate_worker(void *arg)
+{
+	instantiate_queue_t	*queue = arg;
+	module_instance_t	*node;
+
+	pthread_mutex_lock(&instantiate_mutex);
+	while (!queue->failed && (queue->next < queue->num)) {
+		node = queue->nodes[queue->next++];
+
+		if (!module_instantiate(queue->modules, node->name)) queue->failed = true;
+	}
+	pthread_mutex_unlock(&instantiate_mutex);
+
+	return NULL;
+}
+
+/** Instantiate modules using a number of threads
+ *
+ * Most of the time taken to instantiate modules goes on opening
+ * the initial connections to databases, directories, etc.  Here
+ * each thread takes the next module from the queue, and holds
+ * instantiate_mutex while instantiating it.  The connection pool
+ * releases the mutex while it waits for a connection to open, so
+ * other threads can get on with their modules.  Everything else a
+ * module does during instantiation is still serialised.
+ *
+ * If one module instantiates another (e.g. sqlippool and sql), the
+ * second is instantiated by whichever thread gets there first, and
+ * the other waits for it.
+ *
+ * @param modules section.
+ * @param nodes to instantiate.
+ * @param num nodes.
+ * @return 0 on success, -1 on failure.
+ */
+static int modules_instantiate_parallel(CONF_SECTION *modules, module_instance_t **nodes, int num)
+{
+	instantiate_queue_t	queue;
+	pthread_t		*threads;
+	int			i, num_threads;
+	struct timeval		start, end;
+	uint64_t		usec;
+
+	num_threads = main_config.instantiate_threads;
+	if (num_threads > num) num_threads = num;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.modules = modules;
+	queue.nodes = nodes;
+	queue.num = num;
+
+	threads = talloc_zero_array(NULL, pthread_t, num_threads);
+	if (!threads) return -1;
+
+	DEBUG2("%s: Instantiating %i modules using %i threads", main_config.name, num, num_threads);
+	gettimeofday(&start, NULL);
+
+	instantiate_parallel = true;
+	for (i = 0; i < num_threads; i++) {
+		int rcode;
+
+		rcode = pthread_create(&threads[i], NULL, instantiate_worker, &queue);
+		if (rcode != 0) {
+			ERROR("Failed creating thread to instantiate modules: %s", fr_syserror(rcode));
+			break;
+		}
+	}
+
+	/*
+	 *	If we couldn't create any threads, do the work here.
+	 */
+	if (i == 0) instantiate_worker(&queue);
+
+	while (i > 0) pthread_join(threads[--i], NULL);
+	instantiate_parallel = false;
+
+	gettimeofday(&end, NULL);
+	usec = ((end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec);
+	DEBUG2("%s: Instantiated %i modules in %u.%06u seconds", main_config.name, queue.next,
+	       (unsigned int) (usec / 1000000), (unsigned int) (usec % 1000000));
+
+	talloc_free(threads);
+
+	return queue.failed ? -1 : 0;
+}
+#endif
+
 
 module_instance_t *module_instantiate_method(CONF_SECTION *modules, char const *name, rlm_components_t *method)
 {
@@ -977,21 +1428,88 @@ static indexed_modcallable *new_sublist(CONF_SECTION *cs,
 	return c;
 }
 
+static int virtual_server_compile(virtual_server_t *server);
+static int virtual_server_pass2(virtual_server_t *server);
+
+/** Compile a virtual server if this is the first time it's been used
+ *
+ * @param server to check.
+ * @return true if the server can be used, false if it failed to compile.
+ */
+static bool virtual_server_ready(virtual_server_t *server)
+{
+	bool compiled;
+
+	/*
+	 *	Pairs with the store below, so that a thread which
+	 *	sees "compiled" also sees the compiled sections.
+	 */
+	if (fr_atomic_load(&server->compiled)) return true;
+
+	COMPILE_LOCK;
+	compiled = server->compiled;
+	if (!compiled && !server->failed) {
+		INFO("Compiling virtual server %s on first use", server->name);
+
+		if ((virtual_server_compile(server) < 0) ||
+		    (virtual_server_pass2(server) < 0)) {
+			ERROR("Failed compiling virtual server %s.  Requests for it will fail until "
+			      "the configuration is fixed, and reloaded", server->name);
+			server->failed = true;
+		} else {
+			compiled = true;
+			fr_atomic_store(&server->compiled, true);
+		}
+	}
+	COMPILE_UNLOCK;
+
+	return compiled;
+}
+
 rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 {
 	rlm_rcode_t rcode;
 	modcallable *list = NULL;
 	virtual_server_t *server;
 
+	/*
+	 *	Requests which aren't pinned to a generation (e.g.
+	 *	the ones used to look up dynamic clients) are pinned
+	 *	to the current one for the duration of the call.
+	 */
+	if (!request->generation) {
+		request->generation = virtual_servers_pin_current();
+		if (!request->generation) {
+			REDEBUG("No virtual servers have been loaded");
+			return RLM_MODULE_FAIL;
+		}
+
+		rcode = indexed_modcall(comp, idx, request);
+
+		/*
+		 *	If the server was HUPed during the call, the
+		 *	old servers are freed on the next reclaim.
+		 */
+		(void) virtual_servers_unpin(request->generation);
+		request->generation = NULL;
+
+		return rcode;
+	}
+
 	/*
 	 *	Hack to find the correct virtual server.
 	 */
-	server = virtual_server_find(request->server);
+	server = virtual_server_find(request->server, request->generation);
 	if (!server) {
 		RDEBUG("No such virtual server \"%s\"", request->server);
 		return RLM_MODULE_FAIL;
 	}
 
+	if (!virtual_server_ready(server)) {
+		REDEBUG("Virtual server \"%s\" failed to compile", request->server);
+		return RLM_MODULE_FAIL;
+	}
+
 	if (idx == 0) {
 		list = server->mc[comp];
 		if (!list) {
@@ -1246,43 +1764,22 @@ static int load_component_section(CONF_SECTION *cs,
 	return 0;
 }
 
-static int load_byserver(CONF_SECTION *cs)
+/** Compile the sections of a virtual server
+ *
+ * @param server to compile.
+ * @return 0 on success, -1 on error.
+ */
+static int virtual_server_compile(virtual_server_t *server)
 {
 	rlm_components_t comp;
 	bool found;
-	char const *name = cf_section_name2(cs);
-	rbtree_t *components;
-	virtual_server_t *server = NULL;
+	CONF_SECTION *cs = server->cs;
+	rbtree_t *components = server->components;
 	indexed_modcallable *c;
 	bool is_bare;
 
-	if (name) {
-		cf_log_info(cs, "server %s { # from file %s",
-			    name, cf_section_filename(cs));
-	} else {
-		cf_log_info(cs, "server { # from file %s",
-			    cf_section_filename(cs));
-	}
-
 	is_bare = (cf_item_parent(cf_section_to_item(cs)) == NULL);
 
-	server = talloc_zero(cs, virtual_server_t);
-	server->name = name;
-	server->created = time(NULL);
-	server->cs = cs;
-	server->components = components = rbtree_create(server, indexed_modcallable_cmp, NULL, 0);
-	if (!components) {
-		ERROR("Failed to initialize components");
-
-	error:
-		if (rad_debug_lvl == 0) {
-			ERROR("Failed to load virtual server %s",
-			      (name != NULL) ? name : "<default>");
-		}
-		return -1;
-	}
-	talloc_set_destructor(server, _virtual_server_free);
-
 	/*
 	 *	Loop over all of the known components, finding their
 	 *	configuration section, and loading it.
@@ -1331,7 +1828,7 @@ static int load_byserver(CONF_SECTION *cs)
 		}
 
 		if (load_component_section(subcs, components, comp) < 0) {
-			goto error;
+			return -1;
 		}
 
 		if (rad_debug_lvl > 3) {
@@ -1370,7 +1867,7 @@ static int load_byserver(CONF_SECTION *cs)
 			cf_log_module(cs, "Loading vmps {...}");
 			if (load_component_section(subcs, components,
 						   MOD_POST_AUTH) < 0) {
-				goto error;
+				return -1;
 			}
 			c = lookup_by_index(components,
 					    MOD_POST_AUTH, 0);
@@ -1403,7 +1900,7 @@ static int load_byserver(CONF_SECTION *cs)
 						       components,
 						       da,
 						       MOD_POST_AUTH)) {
-				goto error; /* FIXME: memleak? */
+				return -1; /* FIXME: memleak? */
 			}
 			c = lookup_by_index(components,
 					    MOD_POST_AUTH, 0);
@@ -1414,40 +1911,91 @@ static int load_byserver(CONF_SECTION *cs)
 #endif
 	} while (0);
 
-	if (name) {
-		cf_log_info(cs, "} # server %s", name);
-	} else {
-		cf_log_info(cs, "} # server");
+	return 0;
+}
+
+/*
+ *	Is there a listener for this virtual server?  If so, it will
+ *	be used as soon as packets arrive.
+ */
+static bool virtual_server_has_listener(CONF_SECTION *config, CONF_SECTION *cs)
+{
+	CONF_SECTION *subcs;
+	CONF_PAIR *cp;
+	char const *name = cf_section_name2(cs);
+
+	if (cf_subsection_find_next(cs, NULL, "listen")) return true;
+
+	for (subcs = cf_subsection_find_next(config, NULL, "listen");
+	     subcs != NULL;
+	     subcs = cf_subsection_find_next(config, subcs, "listen")) {
+		cp = cf_pair_find(subcs, "virtual_server");
+		if (cp && cf_pair_value(cp) && (strcmp(cf_pair_value(cp), name) == 0)) return true;
+	}
+
+	return false;
+}
+
+static int load_byserver(CONF_SECTION *cs, bool lazy)
+{
+	rlm_components_t comp;
+	char const *name = cf_section_name2(cs);
+	virtual_server_t *server = NULL;
+
+	server = talloc_zero(cs, virtual_server_t);
+	server->name = name;
+	server->created = time(NULL);
+	server->generation = generation_loading;
+	server->cs = cs;
+	server->components = rbtree_create(server, indexed_modcallable_cmp, NULL, 0);
+	if (!server->components) {
+		ERROR("Failed to initialize components");
+
+	error:
+		if (rad_debug_lvl == 0) {
+			ERROR("Failed to load virtual server %s",
+			      (name != NULL) ? name : "<default>");
+		}
+		return -1;
 	}
+	talloc_set_destructor(server, _virtual_server_free);
 
-	if (rad_debug_lvl == 0) {
-		INFO("Loaded virtual server %s",
-		       (name != NULL) ? name : "<default>");
+	server->lazy = lazy;
+	if (lazy) {
+		cf_log_info(cs, "server %s { ... } # from file %s, compiled on first use",
+			    name, cf_section_filename(cs));
+	} else {
+		if (name) {
+			cf_log_info(cs, "server %s { # from file %s",
+				    name, cf_section_filename(cs));
+		} else {
+			cf_log_info(cs, "server { # from file %s",
+				    cf_section_filename(cs));
+		}
+
+		if (virtual_server_compile(server) < 0) goto error;
+
+		if (name) {
+			cf_log_info(cs, "} # server %s", name);
+		} else {
+			cf_log_info(cs, "} # server");
+		}
+
+		if (rad_debug_lvl == 0) {
+			INFO("Loaded virtual server %s",
+			       (name != NULL) ? name : "<default>");
+		}
 	}
 
 	/*
-	 *	Now that it is OK, insert it into the list.
-	 *
-	 *	This is thread-safe...
+	 *	Now that it is OK, insert it into the list.  It
+	 *	isn't seen by requests until the whole generation
+	 *	has loaded.
 	 */
 	comp = virtual_server_idx(name);
 	server->next = virtual_servers[comp];
 	virtual_servers[comp] = server;
 
-	/*
-	 *	Mark OLDER ones of the same name as being unused.
-	 */
-	server = server->next;
-	while (server) {
-		if ((!name && !server->name) ||
-		    (name && server->name &&
-		     (strcmp(server->name, name) == 0))) {
-			server->can_free = true;
-			break;
-		}
-		server = server->next;
-	}
-
 	return 0;
 }
 
@@ -1461,6 +2009,26 @@ static int pass2_cb(UNUSED void *ctx, void *data)
 	return 0;
 }
 
+/*
+ *	Run pass 2 over the conditions and xlats of a compiled server.
+ */
+static int virtual_server_pass2(virtual_server_t *server)
+{
+	int i;
+
+	for (i = MOD_AUTHENTICATE; i < MOD_COUNT; i++) {
+		if (!modcall_pass2(server->mc[i])) return -1;
+	}
+
+	if (server->components &&
+	    (rbtree_walk(server->components, RBTREE_IN_ORDER,
+			 pass2_cb, NULL) != 0)) {
+		return -1;
+	}
+
+	return 0;
+}
+
 
 /*
  *	Load all of the virtual servers.
@@ -1470,9 +2038,12 @@ int virtual_servers_load(CONF_SECTION *config)
 	CONF_SECTION *cs;
 	virtual_server_t *server;
 	static bool first_time = true;
+	bool lazy;
 
 	DEBUG2("%s: #### Loading Virtual Servers ####", main_config.name);
 
+	generation_loading = (generation_current ? generation_current->number : 0) + 1;
+
 	/*
 	 *	If we have "server { ...}", then there SHOULD NOT be
 	 *	bare "authorize", etc. sections.  if there is no such
@@ -1485,15 +2056,19 @@ int virtual_servers_load(CONF_SECTION *config)
 							   "server"),
 				   "server", NULL);
 	if (cs) {
-		if (load_byserver(cs) < 0) {
-			return -1;
-		}
+		if (load_byserver(cs, false) < 0) goto error;
 	} else {
-		if (load_byserver(config) < 0) {
-			return -1;
-		}
+		if (load_byserver(config, false) < 0) goto error;
 	}
 
+	/*
+	 *	Servers which are only used by clients, home servers,
+	 *	or Virtual-Server can be compiled on first use.  When
+	 *	checking the configuration, everything is compiled, so
+	 *	that all errors are found.
+	 */
+	lazy = main_config.lazy_virtual_servers && !check_config;
+
 	/*
 	 *	Load all of the virtual servers.
 	 */
@@ -1505,7 +2080,7 @@ int virtual_servers_load(CONF_SECTION *config)
 		name2 = cf_section_name2(cs);
 		if (!name2) continue; /* handled above */
 
-		server = virtual_server_find(name2);
+		server = virtual_server_find_loading(name2);
 		if (server &&
 		    (cf_top_section(server->cs) == config)) {
 			ERROR("Duplicate virtual server \"%s\" in file %s:%d and file %s:%d",
@@ -1514,37 +2089,24 @@ int virtual_servers_load(CONF_SECTION *config)
 			       cf_section_lineno(server->cs),
 			       cf_section_filename(cs),
 			       cf_section_lineno(cs));
-			return -1;
+			goto error;
 		}
 
-		if (load_byserver(cs) < 0) {
-			/*
-			 *	Once we successfully started once,
-			 *	continue loading the OTHER servers,
-			 *	even if one fails.
-			 */
-			if (!first_time) continue;
-			return -1;
-		}
+		/*
+		 *	A reload either replaces all of the servers,
+		 *	or none of them.
+		 */
+		if (load_byserver(cs, lazy && !virtual_server_has_listener(config, cs)) < 0) goto error;
 	}
 
 	/*
 	 *	Try to compile the "authorize", etc. sections which
 	 *	aren't in a virtual server.
 	 */
-	server = virtual_server_find(NULL);
-	if (server) {
-		int i;
-
-		for (i = MOD_AUTHENTICATE; i < MOD_COUNT; i++) {
-			if (!modcall_pass2(server->mc[i])) return -1;
-		}
-
-		if (server->components &&
-		    (rbtree_walk(server->components, RBTREE_IN_ORDER,
-				 pass2_cb, NULL) != 0)) {
-			return -1;
-		}
+	server = virtual_server_find_loading(NULL);
+	if (server && (server->generation == generation_loading)) {
+		if (virtual_server_pass2(server) < 0) goto error;
+		server->compiled = true;
 	}
 
 	/*
@@ -1554,31 +2116,47 @@ int virtual_servers_load(CONF_SECTION *config)
 	for (cs = cf_subsection_find_next(config, NULL, "server");
 	     cs != NULL;
 	     cs = cf_subsection_find_next(config, cs, "server")) {
-		int i;
 		char const *name2;
 
 		name2 = cf_section_name2(cs);
 
-		server = virtual_server_find(name2);
-		if (!server) continue;
+		server = virtual_server_find_loading(name2);
+		if (!server || (server->generation != generation_loading)) continue;
 
-		for (i = MOD_AUTHENTICATE; i < MOD_COUNT; i++) {
-			if (!modcall_pass2(server->mc[i])) return -1;
-		}
+		/*
+		 *	virtual_server_ready() compiles the lazy ones
+		 *	when they're first used.
+		 */
+		if (server->compiled || server->lazy) continue;
 
-		if (server->components &&
-		    (rbtree_walk(server->components, RBTREE_IN_ORDER,
-				 pass2_cb, NULL) != 0)) {
-			return -1;
-		}
+		if (virtual_server_pass2(server) < 0) goto error;
+		server->compiled = true;
 	}
 
+	/*
+	 *	Everything loaded.  Switch new requests over to the
+	 *	new servers.
+	 */
+	if (virtual_servers_publish(generation_loading) < 0) goto error;
+
 	/*
 	 *	If we succeed the first time around, remember that.
 	 */
 	first_time = false;
 
 	return 0;
+
+error:
+	/*
+	 *	Keep using the previous generation.
+	 */
+	if (!first_time) {
+		ERROR("Failed loading virtual servers, continuing with the previous configuration");
+		virtual_servers_discard(generation_loading);
+	}
+	generation_loading = generation_current ? generation_current->number : 0;
+
+	return -1;
 }
 
 int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
@@ -2127,6 +2705,45 @@ int modules_init(CONF_SECTION *config)
 	 *	because we've now split up the modules into
 	 *	mods-enabled.
 	 */
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	No ordering was asked for here, so these can be done
+	 *	in parallel.  Not when the server is single threaded
+	 *	(-X, -s, -t), or producing memory reports, which
+	 *	can't be done with threads.
+	 */
+	if ((main_config.instantiate_threads > 1) && main_config.spawn_workers &&
+	    !main_config.memory_report) {
+		module_instance_t	**nodes;
+		int			num = 0;
+		int			rcode;
+
+		nodes = talloc_zero_array(NULL, module_instance_t *, rbtree_num_elements(instance_tree));
+		if (!nodes) return -1;
+
+		for (ci = cf_item_find_next(modules, NULL);
+		     ci != NULL;
+		     ci = cf_item_find_next(modules, ci)) {
+			char const *name;
+			module_instance_t *module;
+			CONF_SECTION *subcs;
+
+			if (!cf_item_is_section(ci)) continue;
+
+			subcs = cf_item_to_section(ci);
+			name = cf_section_name2(subcs);
+			if (!name) name = cf_section_name1(subcs);
+
+			module = module_find(modules, name);
+			if (module && !module->instantiated) nodes[num++] = module;
+		}
+
+		rcode = (num > 0) ? modules_instantiate_parallel(modules, nodes, num) : 0;
+		talloc_free(nodes);
+		if (rcode < 0) return -1;
+	}
+#endif
+
 	for (ci=cf_item_find_next(modules, NULL);
 	     ci != NULL;
 	     ci=next) {
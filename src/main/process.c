@@ -558,6 +558,13 @@ static void request_free(REQUEST *request)
 	rad_assert(!request->in_request_hash);
 	rad_assert(!request->in_proxy_hash);
 
+	/*
+	 *	If this was the last request using an old
+	 *	configuration, have the main thread free it.
+	 */
+	if (virtual_servers_unpin(request->generation)) radius_signal_self(RADIUS_SIGNAL_SELF_RECLAIM);
+	request->generation = NULL;
+
 	if ((request->options & RAD_REQUEST_OPTION_CTX) == 0) {
 		talloc_free(request);
 		return;
@@ -1009,6 +1016,7 @@ static void request_queue_or_run(REQUEST *request,
 			/*
 			 *	A child thread will eventually pick it up.
 			 */
+			if (request->trace) request_trace_begin(request, REQUEST_TRACE_QUEUE);
 			if (request_enqueue(request)) return;
 
 			/*
@@ -1473,6 +1481,12 @@ static void request_finish(REQUEST *request, int action)
 		}
 
 	done:
+		/*
+		 *	Before the request is handed back to the
+		 *	master thread, which may free it.
+		 */
+		if (request->trace) request_trace_finish(request);
+
 		RDEBUG2("Finished request");
 		request_cleanup_delay_init(request);
 
@@ -1487,6 +1501,8 @@ static void request_finish(REQUEST *request, int action)
 		request->listener->encode(request->listener, request);
 		request->process = request_response_delay;
 
+		if (request->trace) request_trace_finish(request);
+
 		FINAL_STATE(REQUEST_RESPONSE_DELAY);
 	}
 }
@@ -1744,11 +1760,19 @@ skip_dup:
 		return 1;
 	}
 
+	if (main_config.trace_sample_rate) request_trace_start(request);
+
 	/*
 	 *	Mark it as a "real" request with a context.
 	 */
 	request->options |= RAD_REQUEST_OPTION_CTX;
 
+	/*
+	 *	It sees the current configuration until it's done,
+	 *	even if the server is HUPed in the meantime.
+	 */
+	request->generation = virtual_servers_pin(NULL);
+
 	/*
 	 *	Remember the request in the list.
 	 */
@@ -2545,6 +2569,7 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	request->proxy_reply = talloc_steal(request, packet);
 	packet->timestamp = now;
 	request->priority = RAD_LISTEN_PROXY;
+	if (request->trace) request_trace_end(request, REQUEST_TRACE_PROXY);
 
 #ifdef WITH_STATS
 	/*
@@ -3246,6 +3271,12 @@ static int request_proxy(REQUEST *request)
 	gettimeofday(&request->proxy->timestamp, NULL);
 	request->home_server->last_packet_sent = request->proxy->timestamp.tv_sec;
 
+	/*
+	 *	Before the packet is sent, as the reply may be
+	 *	received before this function returns.
+	 */
+	if (request->trace) request_trace_begin(request, REQUEST_TRACE_PROXY);
+
 	/*
 	 *	Encode the packet before we do anything else.
 	 */
@@ -4466,9 +4497,16 @@ static void coa_separate(REQUEST *request)
 	rad_assert(request->ev == NULL);
 	rad_assert(!request->in_request_hash);
 	rad_assert(request->coa == NULL);
+	rad_assert(request->trace == NULL);
 
 	rad_assert(request->proxy_reply || request->proxy_listener);
 
+	/*
+	 *	It may now outlive the parent, so it needs its own
+	 *	pin on the configuration.
+	 */
+	request->generation = virtual_servers_pin(request->parent);
+
 	(void) talloc_steal(NULL, request);
 	request->parent->coa = NULL;
 	request->parent = NULL;
@@ -5114,6 +5152,13 @@ static void handle_signal_self(int flag)
 		return;
 	} /* else exit/term flags weren't set */
 
+	/*
+	 *	Free configuration which no request is using.
+	 */
+	if ((flag & RADIUS_SIGNAL_SELF_RECLAIM) != 0) {
+		virtual_servers_free(false);
+	}
+
 	/*
 	 *	Tell the even loop to stop processing.
 	 */
@@ -47,6 +47,7 @@ extern log_lvl_t rad_debug_lvl;
 #ifdef HAVE_PTHREAD_H
 pid_t rad_fork(void);
 pid_t rad_waitpid(pid_t pid, int *status);
+pid_t rad_waitpid_timeout(pid_t pid, int *status, int timeout);
 
 pid_t rad_fork(void)
 {
@@ -57,6 +58,11 @@ pid_t rad_waitpid(pid_t pid, int *status)
 {
 	return waitpid(pid, status, 0);
 }
+
+pid_t rad_waitpid_timeout(pid_t pid, int *status, UNUSED int timeout)
+{
+	return waitpid(pid, status, WNOHANG);
+}
 #endif
 
 static ssize_t xlat_test(UNUSED void *instance, UNUSED REQUEST *request,
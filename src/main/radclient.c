@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/radpaths.h>
 #include <freeradius-devel/conf.h>
 #include <ctype.h>
+#include <math.h>
 
 #ifdef HAVE_GETOPT_H
 #  include <getopt.h>
@@ -40,6 +41,8 @@ typedef struct REQUEST REQUEST;	/* to shut up warnings about mschap.h */
 #include "smbdes.h"
 #include "mschap.h"
 
+#define USEC (1000000)
+
 static int retries = 3;
 static float timeout = 5;
 static char const *secret = NULL;
@@ -86,6 +89,7 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  <command>              One of auth, acct, status, coa, disconnect or auto.\n");
 	fprintf(stderr, "  -4                     Use IPv4 address of server\n");
 	fprintf(stderr, "  -6                     Use IPv6 address of server.\n");
+	fprintf(stderr, "  -a <arrival>           Load mode arrivals, 'fixed' (default) or 'poisson'.\n");
 	fprintf(stderr, "  -c <count>             Send each packet 'count' times.\n");
 	fprintf(stderr, "  -d <raddb>             Set user dictionary directory (defaults to " RADDBDIR ").\n");
 	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
@@ -94,13 +98,17 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -J <file>              Write load mode results to a JSON file ('-' for stdout).\n");
+	fprintf(stderr, "  -L <rate>              Load mode.  Send 'rate' packets/s, without waiting for replies.\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -o <num>               Load mode maximum outstanding requests (default 4096).\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <seconds>           Load mode duration (default 10).\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -818,6 +826,31 @@ static void deallocate_id(rc_request_t *request)
 	if (request->reply) rad_free(&request->reply);
 }
 
+/*
+ *	Update the password in a packet, after its authentication
+ *	vector has been set.
+ */
+static void password_update(RADIUS_PACKET *packet, VALUE_PAIR *password)
+{
+	VALUE_PAIR *vp;
+
+	if ((vp = fr_pair_find_by_num(packet->vps, PW_USER_PASSWORD, 0, TAG_ANY)) != NULL) {
+		fr_pair_value_strcpy(vp, password->vp_strvalue);
+
+	} else if ((vp = fr_pair_find_by_num(packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY)) != NULL) {
+		uint8_t buffer[17];
+
+		rad_chap_encode(packet, buffer, fr_rand() & 0xff, password);
+		fr_pair_value_memcpy(vp, buffer, 17);
+
+	} else if (fr_pair_find_by_num(packet->vps, PW_MS_CHAP_PASSWORD, 0, TAG_ANY) != NULL) {
+		mschapv1_encode(packet, &packet->vps, password->vp_strvalue);
+
+	} else {
+		DEBUG("WARNING: No password in the request");
+	}
+}
+
 /*
  *	Send one packet.
  */
@@ -883,25 +916,7 @@ static int send_one_packet(rc_request_t *request)
 		 *	Update the password, so it can be encrypted with the
 		 *	new authentication vector.
 		 */
-		if (request->password) {
-			VALUE_PAIR *vp;
-
-			if ((vp = fr_pair_find_by_num(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY)) != NULL) {
-				fr_pair_value_strcpy(vp, request->password->vp_strvalue);
-
-			} else if ((vp = fr_pair_find_by_num(request->packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY)) != NULL) {
-				uint8_t buffer[17];
-
-				rad_chap_encode(request->packet, buffer, fr_rand() & 0xff, request->password);
-				fr_pair_value_memcpy(vp, buffer, 17);
-
-			} else if (fr_pair_find_by_num(request->packet->vps, PW_MS_CHAP_PASSWORD, 0, TAG_ANY) != NULL) {
-				mschapv1_encode(request->packet, &request->packet->vps, request->password->vp_strvalue);
-
-			} else {
-				DEBUG("WARNING: No password in the request");
-			}
-		}
+		if (request->password) password_update(request->packet, request->password);
 
 		request->timestamp = time(NULL);
 		request->tries = 1;
@@ -1155,6 +1170,521 @@ packet_done:
 	return 0;
 }
 
+/*
+ *	Open-loop load generation.
+ *
+ *	Packets are sent on a schedule (fixed interval, or Poisson
+ *	arrivals), whether or not the server has replied to earlier
+ *	ones.  Latency is measured from when the schedule said the
+ *	packet should have been sent, so that if radclient falls
+ *	behind, the delay is charged to the server and isn't hidden
+ *	by sending less often (coordinated omission).
+ */
+
+/*
+ *	Log-linear histogram buckets.  Each power of two is split into
+ *	LOAD_SUB_COUNT buckets, which gives ~3% resolution from 1us
+ *	upwards, without needing to know the range in advance.
+ */
+#define LOAD_SUB_BITS		(5)
+#define LOAD_SUB_COUNT		(1 << LOAD_SUB_BITS)
+#define LOAD_BUCKETS		((64 - LOAD_SUB_BITS + 1) * LOAD_SUB_COUNT)
+
+typedef struct rc_load_hist {
+	uint64_t	count;
+	uint64_t	sum;		//!< Of latencies, in microseconds.
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	bucket[LOAD_BUCKETS];
+} rc_load_hist_t;
+
+typedef struct rc_load_request rc_load_request_t;
+
+struct rc_load_request {
+	rc_load_request_t	*prev;
+	rc_load_request_t	*next;
+
+	RADIUS_PACKET		*packet;	//!< Copy of the template packet.
+	uint64_t		scheduled;	//!< When the schedule said to send it.
+	uint64_t		sent;		//!< When it was actually sent.
+};
+
+typedef struct rc_load {
+	uint32_t		rate;		//!< Target packets per second.
+	bool			poisson;	//!< Exponential inter-arrival times.
+	uint32_t		duration;	//!< Seconds to send for.
+	uint32_t		max_outstanding;
+	char const		*json_file;
+
+	uint64_t		sent;
+	uint64_t		received;
+	uint64_t		timeouts;
+	uint64_t		rejects;
+	uint64_t		errors;		//!< Send failures, and bad replies.
+	uint64_t		skipped;	//!< Not sent, max_outstanding was reached.
+	uint64_t		lag_max;	//!< Furthest behind schedule we sent.
+	uint64_t		elapsed;
+
+	rc_load_hist_t		*all;
+	rc_load_hist_t		*code[FR_MAX_PACKET_CODE];
+
+	uint32_t		outstanding;
+	rc_load_request_t	*head;		//!< Oldest outstanding request.
+	rc_load_request_t	*tail;
+} rc_load_t;
+
+static rc_load_t load = {
+	.duration = 10,
+	.max_outstanding = 4096
+};
+
+static const struct {
+	char const	*name;
+	double		q;
+} load_percentiles[] = {
+	{ "p50",	0.50 },
+	{ "p90",	0.90 },
+	{ "p99",	0.99 },
+	{ "p999",	0.999 },
+	{ "p9999",	0.9999 }
+};
+
+#define LOAD_NUM_PERCENTILES	(sizeof(load_percentiles) / sizeof(load_percentiles[0]))
+
+static uint64_t load_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ((uint64_t) ts.tv_sec * USEC) + (ts.tv_nsec / 1000);
+	}
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return ((uint64_t) tv.tv_sec * USEC) + tv.tv_usec;
+	}
+}
+
+/*
+ *	Microseconds until the next packet should be sent.
+ */
+static double load_interval(void)
+{
+	double u;
+
+	if (!load.poisson) return (double) USEC / load.rate;
+
+	/*
+	 *	u is in (0, 1], so log(u) is finite.
+	 */
+	u = ((double) fr_rand() + 1.0) / 4294967296.0;
+
+	return -log(u) * USEC / load.rate;
+}
+
+static unsigned int load_bucket(uint64_t value)
+{
+	unsigned int msb = LOAD_SUB_BITS;
+
+	if (value < LOAD_SUB_COUNT) return value;
+
+	while ((msb < 63) && ((value >> (msb + 1)) != 0)) msb++;
+
+	return ((msb - LOAD_SUB_BITS + 1) * LOAD_SUB_COUNT) +
+		((value >> (msb - LOAD_SUB_BITS)) & (LOAD_SUB_COUNT - 1));
+}
+
+/*
+ *	The highest value which goes into a bucket.
+ */
+static uint64_t load_bucket_value(unsigned int bucket)
+{
+	unsigned int msb;
+	uint64_t low;
+
+	if (bucket < LOAD_SUB_COUNT) return bucket;
+
+	msb = (bucket / LOAD_SUB_COUNT) - 1 + LOAD_SUB_BITS;
+	low = ((uint64_t) 1 << msb) | ((uint64_t) (bucket % LOAD_SUB_COUNT) << (msb - LOAD_SUB_BITS));
+
+	return low + ((uint64_t) 1 << (msb - LOAD_SUB_BITS)) - 1;
+}
+
+static void load_hist_add(rc_load_hist_t **hist_p, uint64_t value)
+{
+	rc_load_hist_t *hist = *hist_p;
+
+	if (!hist) {
+		hist = *hist_p = talloc_zero(talloc_autofree_context(), rc_load_hist_t);
+		if (!hist) return;
+		hist->min = value;
+	}
+
+	hist->count++;
+	hist->sum += value;
+	if (value < hist->min) hist->min = value;
+	if (value > hist->max) hist->max = value;
+	hist->bucket[load_bucket(value)]++;
+}
+
+static uint64_t load_hist_percentile(rc_load_hist_t const *hist, double q)
+{
+	unsigned int i;
+	uint64_t rank, seen = 0, value;
+
+	rank = (uint64_t) (q * hist->count);
+	if (rank < (q * hist->count)) rank++;
+	if (rank == 0) rank = 1;
+
+	for (i = 0; i < LOAD_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank) break;
+	}
+
+	value = load_bucket_value(i);
+	if (value < hist->min) return hist->min;
+	if (value > hist->max) return hist->max;
+
+	return value;
+}
+
+/*
+ *	Release the ID, and forget about the request.
+ */
+static void load_request_done(rc_load_request_t *this)
+{
+	fr_packet_list_id_free(pl, this->packet, true);
+
+	if (this->prev) {
+		this->prev->next = this->next;
+	} else {
+		load.head = this->next;
+	}
+
+	if (this->next) {
+		this->next->prev = this->prev;
+	} else {
+		load.tail = this->prev;
+	}
+
+	load.outstanding--;
+	talloc_free(this);
+}
+
+static void load_send(rc_request_t *template, uint64_t scheduled)
+{
+	rc_load_request_t *this;
+	RADIUS_PACKET *packet;
+	uint64_t now;
+
+	if (load.outstanding >= load.max_outstanding) {
+		load.skipped++;
+		return;
+	}
+
+	this = talloc_zero(talloc_autofree_context(), rc_load_request_t);
+	if (!this) {
+		load.errors++;
+		return;
+	}
+
+	this->packet = packet = rad_alloc(this, true);
+	if (!packet) goto error;
+
+	packet->code = template->packet->code;
+	packet->dst_ipaddr = template->packet->dst_ipaddr;
+	packet->dst_port = template->packet->dst_port;
+	packet->src_ipaddr = client_ipaddr;
+	packet->sockfd = -1;
+	packet->vps = fr_pair_list_copy(packet, template->packet->vps);
+
+	/*
+	 *	Any of our sockets will do.
+	 */
+	if (!fr_packet_list_id_alloc(pl, ipproto, &this->packet, NULL)) {
+	error:
+		talloc_free(this);
+		load.errors++;
+		return;
+	}
+
+	if (template->password) password_update(packet, template->password);
+
+	if (rad_send(packet, NULL, secret) < 0) {
+		fr_packet_list_id_free(pl, packet, true);
+		goto error;
+	}
+
+	now = load_now();
+	this->scheduled = scheduled;
+	this->sent = now;
+	if ((now > scheduled) && ((now - scheduled) > load.lag_max)) load.lag_max = now - scheduled;
+
+	this->prev = load.tail;
+	if (load.tail) {
+		load.tail->next = this;
+	} else {
+		load.head = this;
+	}
+	load.tail = this;
+
+	load.outstanding++;
+	load.sent++;
+}
+
+static void load_reply(RADIUS_PACKET *reply)
+{
+	RADIUS_PACKET **packet_p;
+	rc_load_request_t *this;
+	uint64_t now;
+
+	reply->dst_ipaddr = client_ipaddr;
+	reply->dst_port = client_port;
+
+#ifdef WITH_TCP
+	if (ipproto == IPPROTO_TCP) {
+		reply->src_ipaddr = server_ipaddr;
+		reply->src_port = server_port;
+	}
+#endif
+
+	packet_p = fr_packet_list_find_byreply(pl, reply);
+	if (!packet_p) {
+		load.errors++;
+		return;
+	}
+	this = fr_packet2myptr(rc_load_request_t, packet, packet_p);
+
+	/*
+	 *	We only need the code, so there's no point in
+	 *	decoding the attributes.
+	 *
+	 *	IDs are re-used once a request times out, so a
+	 *	late reply to the old packet can match a newer one.
+	 *	It fails verification, and the newer request is
+	 *	left to get its own reply, or time out.
+	 */
+	if (rad_verify(reply, this->packet, secret) < 0) {
+		load.errors++;
+		return;
+	}
+
+	now = load_now();
+	load.received++;
+
+	load_hist_add(&load.all, now - this->scheduled);
+	if (is_radius_code(reply->code)) load_hist_add(&load.code[reply->code], now - this->scheduled);
+
+	switch (reply->code) {
+	case PW_CODE_ACCESS_REJECT:
+	case PW_CODE_COA_NAK:
+	case PW_CODE_DISCONNECT_NAK:
+		load.rejects++;
+		break;
+
+	default:
+		break;
+	}
+
+	load_request_done(this);
+}
+
+/*
+ *	Wait up to "wait" microseconds for replies, and then read
+ *	however many are ready, up to a limit, so that we don't fall
+ *	too far behind on sending.
+ */
+static void load_recv(uint64_t wait)
+{
+	fd_set		set;
+	struct timeval	tv;
+	int		max_fd, i;
+	RADIUS_PACKET	*reply;
+
+	tv.tv_sec = wait / USEC;
+	tv.tv_usec = wait % USEC;
+
+	for (i = 0; i < 64; i++) {
+		FD_ZERO(&set);
+
+		max_fd = fr_packet_list_fd_set(pl, &set);
+		if (max_fd < 0) exit(1);
+
+		if (select(max_fd, &set, NULL, NULL, &tv) <= 0) return;
+
+		reply = fr_packet_list_recv(pl, &set);
+		if (reply) {
+			load_reply(reply);
+			rad_free(&reply);
+		} else {
+			load.errors++;
+#ifdef WITH_TCP
+			if (proto) exit(1);
+#endif
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+	}
+}
+
+static void load_run(void)
+{
+	rc_request_t	*template = request_head;
+	uint64_t	start, end, now, deadline, timeout_usec;
+	double		next;
+
+	timeout_usec = timeout * USEC;
+
+	start = load_now();
+	end = start + ((uint64_t) load.duration * USEC);
+	next = start;
+
+	while (true) {
+		now = load_now();
+
+		/*
+		 *	Send everything which is due.  If we've fallen
+		 *	behind, we catch up, rather than skipping.
+		 */
+		while ((next <= now) && (next < end)) {
+			load_send(template, (uint64_t) next);
+
+			template = template->next;
+			if (!template) template = request_head;
+
+			next += load_interval();
+		}
+
+		now = load_now();
+		while (load.head && ((now - load.head->sent) >= timeout_usec)) {
+			load.timeouts++;
+			load_request_done(load.head);
+		}
+
+		if ((next >= end) && !load.outstanding) break;
+
+		deadline = (next < end) ? (uint64_t) next : end + timeout_usec;
+		if (load.head && ((load.head->sent + timeout_usec) < deadline)) {
+			deadline = load.head->sent + timeout_usec;
+		}
+
+		load_recv((deadline > now) ? (deadline - now) : 0);
+	}
+
+	load.elapsed = load_now() - start;
+}
+
+static void load_summary_line(char const *name, rc_load_hist_t const *hist)
+{
+	unsigned int i;
+
+	printf("\t%-24s %10" PRIu64 " %10" PRIu64, name, hist->count, hist->min);
+	for (i = 0; i < LOAD_NUM_PERCENTILES; i++) {
+		printf(" %10" PRIu64, load_hist_percentile(hist, load_percentiles[i].q));
+	}
+	printf(" %10" PRIu64 "\n", hist->max);
+}
+
+static void load_summary(void)
+{
+	unsigned int i;
+	double secs = (double) load.elapsed / USEC;
+
+	if (secs <= 0) secs = 1;
+
+	printf("Load summary:\n"
+	       "\tTarget rate   : %u/s (%s)\n"
+	       "\tElapsed       : %.3f s\n"
+	       "\tSent          : %" PRIu64 " (%.1f/s)\n"
+	       "\tReceived      : %" PRIu64 " (%.1f/s)\n"
+	       "\tTimeouts      : %" PRIu64 "\n"
+	       "\tRejects       : %" PRIu64 "\n"
+	       "\tErrors        : %" PRIu64 "\n"
+	       "\tSkipped       : %" PRIu64 "\n"
+	       "\tMax send lag  : %" PRIu64 " us\n",
+	       load.rate, load.poisson ? "poisson" : "fixed",
+	       (double) load.elapsed / USEC,
+	       load.sent, load.sent / secs,
+	       load.received, load.received / secs,
+	       load.timeouts, load.rejects, load.errors, load.skipped, load.lag_max);
+
+	if (!load.all) return;
+
+	printf("Latency (us):\n\t%-24s %10s %10s", "", "count", "min");
+	for (i = 0; i < LOAD_NUM_PERCENTILES; i++) printf(" %10s", load_percentiles[i].name);
+	printf(" %10s\n", "max");
+
+	for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
+		if (!load.code[i]) continue;
+
+		load_summary_line(fr_packet_codes[i], load.code[i]);
+	}
+	load_summary_line("all", load.all);
+}
+
+static void load_json_hist(FILE *fp, rc_load_hist_t const *hist)
+{
+	unsigned int i;
+
+	fprintf(fp, "{\"count\":%" PRIu64 ",\"min_us\":%" PRIu64 ",\"mean_us\":%.1f",
+		hist->count, hist->min, (double) hist->sum / hist->count);
+	for (i = 0; i < LOAD_NUM_PERCENTILES; i++) {
+		fprintf(fp, ",\"%s_us\":%" PRIu64, load_percentiles[i].name,
+			load_hist_percentile(hist, load_percentiles[i].q));
+	}
+	fprintf(fp, ",\"max_us\":%" PRIu64 "}", hist->max);
+}
+
+static int load_json(char const *filename)
+{
+	FILE *fp;
+	unsigned int i;
+	bool first = true;
+
+	if (strcmp(filename, "-") == 0) {
+		fp = stdout;
+	} else {
+		fp = fopen(filename, "w");
+		if (!fp) {
+			ERROR("Error opening %s: %s", filename, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	fprintf(fp, "{\"rate\":%u,\"arrival\":\"%s\",\"duration\":%u,\"timeout\":%.3f,"
+		"\"max_outstanding\":%u,\"elapsed_us\":%" PRIu64 ","
+		"\"sent\":%" PRIu64 ",\"received\":%" PRIu64 ",\"timeouts\":%" PRIu64 ","
+		"\"rejects\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"skipped\":%" PRIu64 ","
+		"\"max_send_lag_us\":%" PRIu64 ",\"latency\":{",
+		load.rate, load.poisson ? "poisson" : "fixed", load.duration, timeout,
+		load.max_outstanding, load.elapsed,
+		load.sent, load.received, load.timeouts,
+		load.rejects, load.errors, load.skipped,
+		load.lag_max);
+
+	for (i = 0; i < FR_MAX_PACKET_CODE; i++) {
+		if (!load.code[i]) continue;
+
+		fprintf(fp, "%s\"%s\":", first ? "" : ",", fr_packet_codes[i]);
+		load_json_hist(fp, load.code[i]);
+		first = false;
+	}
+
+	if (load.all) {
+		fprintf(fp, "%s\"all\":", first ? "" : ",");
+		load_json_hist(fp, load.all);
+	}
+	fprintf(fp, "}}\n");
+
+	if (fp != stdout) fclose(fp);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int		c;
@@ -1192,7 +1722,7 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:p:qr:sS:t:vx"
+	while ((c = getopt(argc, argv, "46a:c:d:D:f:Fhi:J:L:n:o:p:qr:sS:t:T:vx"
 #ifdef WITH_TCP
 		"P:"
 #endif
@@ -1205,6 +1735,16 @@ int main(int argc, char **argv)
 			force_af = AF_INET6;
 			break;
 
+		case 'a':
+			if (strcmp(optarg, "poisson") == 0) {
+				load.poisson = true;
+			} else if (strcmp(optarg, "fixed") == 0) {
+				load.poisson = false;
+			} else {
+				usage();
+			}
+			break;
+
 		case 'c':
 			if (!isdigit((int) *optarg))
 				usage();
@@ -1253,11 +1793,31 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'J':
+			load.json_file = optarg;
+			break;
+
+		case 'L':
+			if (!isdigit((int) *optarg)) usage();
+			load.rate = atoi(optarg);
+			if (load.rate == 0) usage();
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
 			break;
 
+			/*
+			 *	Each socket has 256 IDs, and we can
+			 *	have up to 256 sockets.
+			 */
+		case 'o':
+			if (!isdigit((int) *optarg)) usage();
+			load.max_outstanding = atoi(optarg);
+			if ((load.max_outstanding == 0) || (load.max_outstanding > 65536)) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1337,6 +1897,12 @@ int main(int argc, char **argv)
 			timeout = atof(optarg);
 			break;
 
+		case 'T':
+			if (!isdigit((int) *optarg)) usage();
+			load.duration = atoi(optarg);
+			if (load.duration == 0) usage();
+			break;
+
 		case 'v':
 			fr_debug_lvl = 1;
 			DEBUG("%s", radclient_version);
@@ -1487,6 +2053,46 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 *	Open-loop load.  The packets we read are used as
+	 *	templates, and are sent round-robin.
+	 */
+	if (load.rate) {
+		uint32_t i, num_sockets;
+
+		/*
+		 *	Open enough sockets for all of the outstanding
+		 *	requests to have an ID.
+		 */
+		num_sockets = (load.max_outstanding + 255) / 256;
+		for (i = 1; i < num_sockets; i++) {
+#ifdef WITH_TCP
+			if (proto) {
+				sockfd = fr_socket_client_tcp(NULL, &server_ipaddr, server_port, false);
+			} else
+#endif
+			sockfd = fr_socket(&client_ipaddr, 0);
+			if (sockfd < 0) {
+				ERROR("Error opening socket");
+				exit(1);
+			}
+
+			if (!fr_packet_list_socket_add(pl, sockfd, ipproto, &server_ipaddr,
+						       server_port, NULL)) {
+				ERROR("Can't add new socket");
+				exit(1);
+			}
+		}
+
+		load_run();
+
+		if (do_output) load_summary();
+		if (load.json_file && (load_json(load.json_file) < 0)) exit(1);
+
+		if (load.received == 0) exit(1);
+		exit(0);
+	}
+
 	/*
 	 *	Walk over the packets to send, until
 	 *	we're all done.
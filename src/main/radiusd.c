@@ -469,6 +469,7 @@ int main(int argc, char *argv[])
 	/*
 	 *   Load the modules
 	 */
+	main_config.spawn_workers = spawn_flag;
 	if (modules_init(main_config.config) < 0) exit(EXIT_FAILURE);
 
 	/*
@@ -94,6 +94,10 @@ pid_t rad_waitpid(pid_t pid, int *status)
 {
 	return waitpid(pid, status, 0);
 }
+pid_t rad_waitpid_timeout(pid_t pid, int *status, UNUSED int timeout)
+{
+	return waitpid(pid, status, WNOHANG);
+}
 #endif
 
 static void NEVER_RETURNS usage(int status)
@@ -43,17 +43,51 @@ RCSID("$Id$")
 
 #define RS_ASSERT(_x) if (!(_x) && !fr_assert(_x)) exit(1)
 
+#ifdef WITH_RS_THREADS
+#  define RS_THREAD_LOCAL __THREAD
+#else
+#  define RS_THREAD_LOCAL
+#endif
+
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
-static fr_event_list_t *events;
-static bool cleanup;
+/*
+ *	Analysis state.  Each worker thread gets its own copy.
+ */
+static RS_THREAD_LOCAL char timestr[50];
+static RS_THREAD_LOCAL TALLOC_CTX *request_ctx;		//!< Where requests and packets are allocated.
+static RS_THREAD_LOCAL rbtree_t *request_tree = NULL;
+static RS_THREAD_LOCAL rbtree_t *link_tree = NULL;
+static RS_THREAD_LOCAL fr_event_list_t *events;
+static RS_THREAD_LOCAL bool cleanup;
+static RS_THREAD_LOCAL uint64_t packets_seen = 0;
+static RS_THREAD_LOCAL uint64_t count_offset = 0;	//!< Added to packet counts, so they're unique
+static RS_THREAD_LOCAL uint64_t count_step = 1;		//!< across threads.
+
+static uint64_t captured = 0;			//!< Packets processed, for the capture limit.
+static bool capture_done = false;		//!< The capture limit was reached.  Set and read
+						//!< with fr_atomic_*(), as every thread checks it.
+static bool interrupted;			//!< We were asked to exit by a signal.
 
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
+#ifdef WITH_RS_THREADS
+static rs_thread_t *workers;			//!< conf->threads worker threads.
+static int workers_running;			//!< How many of them we started.
+
+/*
+ *	Serialises log output, pcap output, and the capture count
+ *	between worker threads.
+ */
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define RS_OUTPUT_LOCK	pthread_mutex_lock(&output_mutex)
+#  define RS_OUTPUT_UNLOCK	pthread_mutex_unlock(&output_mutex)
+#else
+#  define RS_OUTPUT_LOCK
+#  define RS_OUTPUT_UNLOCK
+#endif
+
 typedef int (*rbcmp)(void const *, void const *);
 
 static char const *radsniff_version = "radsniff version " RADIUSD_VERSION_STRING
@@ -90,6 +124,7 @@ static const FR_NAME_NUMBER rs_events[] = {
 };
 
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -501,7 +536,182 @@ static inline void rs_packet_print(rs_request_t *request, uint64_t count, rs_sta
 	if (!conf->logger) return;
 
 	if (request) request->logged = true;
+
+	RS_OUTPUT_LOCK;
 	conf->logger(count, status, handle, packet, elapsed, latency, response, body);
+	RS_OUTPUT_UNLOCK;
+}
+
+/*
+ *	Map a latency in microseconds to a histogram bucket.
+ */
+static unsigned int rs_hist_bucket(uint32_t value)
+{
+	unsigned int msb = RS_HIST_SUB_BITS;
+
+	if (value < RS_HIST_SUB_COUNT) return value;
+
+	while ((msb < 31) && ((value >> (msb + 1)) != 0)) msb++;
+
+	return ((msb - RS_HIST_SUB_BITS + 1) * RS_HIST_SUB_COUNT) +
+		((value >> (msb - RS_HIST_SUB_BITS)) & (RS_HIST_SUB_COUNT - 1));
+}
+
+/*
+ *	The highest value which goes into a bucket.
+ */
+static uint64_t rs_hist_bucket_value(unsigned int bucket)
+{
+	unsigned int msb;
+	uint64_t low;
+
+	if (bucket < RS_HIST_SUB_COUNT) return bucket;
+
+	msb = (bucket / RS_HIST_SUB_COUNT) - 1 + RS_HIST_SUB_BITS;
+	low = ((uint64_t) 1 << msb) | ((uint64_t) (bucket % RS_HIST_SUB_COUNT) << (msb - RS_HIST_SUB_BITS));
+
+	return low + ((uint64_t) 1 << (msb - RS_HIST_SUB_BITS)) - 1;
+}
+
+static void rs_hist_add(rs_histogram_t *hist, struct timeval const *latency)
+{
+	uint64_t	usec;
+	uint32_t	value;
+
+	usec = ((uint64_t) latency->tv_sec * 1000000) + latency->tv_usec;
+	value = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+
+	if (!hist->count || (value < hist->min)) hist->min = value;
+	if (value > hist->max) hist->max = value;
+	hist->count++;
+	hist->bucket[rs_hist_bucket(value)]++;
+}
+
+#ifdef WITH_RS_THREADS
+static void rs_hist_merge(rs_histogram_t *out, rs_histogram_t const *in)
+{
+	unsigned int i;
+
+	if (!in->count) return;
+
+	if (!out->count || (in->min < out->min)) out->min = in->min;
+	if (in->max > out->max) out->max = in->max;
+	out->count += in->count;
+
+	for (i = 0; i < RS_HIST_BUCKETS; i++) out->bucket[i] += in->bucket[i];
+}
+#endif
+
+/** Get a percentile from a histogram
+ *
+ * @param hist to get the percentile from, must have at least one value.
+ * @param q the percentile, between 0 and 1.
+ * @return the latency in milliseconds.
+ */
+static double rs_hist_percentile(rs_histogram_t const *hist, double q)
+{
+	unsigned int i;
+	uint64_t rank, seen = 0, value;
+
+	rank = (uint64_t) (q * hist->count);
+	if (rank < (q * hist->count)) rank++;
+	if (rank == 0) rank = 1;
+
+	for (i = 0; i < RS_HIST_BUCKETS - 1; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank) break;
+	}
+
+	value = rs_hist_bucket_value(i);
+	if (value < hist->min) value = hist->min;
+	if (value > hist->max) value = hist->max;
+
+	return value / 1000.0;
+}
+
+static int rs_peer_cmp(rs_peer_t const *a, rs_peer_t const *b)
+{
+	int ret;
+
+	if (a->server != b->server) return a->server - b->server;
+
+	ret = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	if (ret != 0) return ret;
+
+	return a->port - b->port;
+}
+
+/** Find the latency entry for a client or server, creating it if we have room
+ *
+ */
+static rs_peer_t *rs_peer_find(rbtree_t *peers, bool server, fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	rs_peer_t find, *peer;
+
+	memset(&find, 0, sizeof(find));
+	find.server = server;
+	find.ipaddr = *ipaddr;
+	find.port = port;
+
+	peer = rbtree_finddata(peers, &find);
+	if (peer) return peer;
+
+	if (rbtree_num_elements(peers) >= RS_PEERS_MAX) return NULL;
+
+	peer = talloc_zero(peers, rs_peer_t);
+	if (!peer) return NULL;
+
+	peer->server = server;
+	peer->ipaddr = *ipaddr;
+	peer->port = port;
+
+	if (!rbtree_insert(peers, peer)) {
+		talloc_free(peer);
+		return NULL;
+	}
+
+	return peer;
+}
+
+static int _rs_peer_print(void *ctx, void *data)
+{
+	rs_peer_t	*peer = data;
+	int		*section = ctx;
+	char		addr[INET6_ADDRSTRLEN];
+	char		name[INET6_ADDRSTRLEN + 7];
+
+	if (!peer->histogram.count) return 0;
+
+	/*
+	 *	Clients sort before servers
+	 */
+	if (*section != peer->server) {
+		INFO("%s latency:", peer->server ? "Server" : "Client");
+		*section = peer->server;
+	}
+
+	inet_ntop(peer->ipaddr.af, &peer->ipaddr.ipaddr, addr, sizeof(addr));
+	if (peer->server) {
+		snprintf(name, sizeof(name), "%s:%u", addr, peer->port);
+	} else {
+		strlcpy(name, addr, sizeof(name));
+	}
+
+	INFO("\t%-21s : %" PRIu64 " linked, p50 %.3lfms, p90 %.3lfms, p99 %.3lfms, p99.9 %.3lfms",
+	     name, peer->histogram.count,
+	     rs_hist_percentile(&peer->histogram, 0.5), rs_hist_percentile(&peer->histogram, 0.9),
+	     rs_hist_percentile(&peer->histogram, 0.99), rs_hist_percentile(&peer->histogram, 0.999));
+
+	return 0;
+}
+
+static int _rs_peer_clear(UNUSED void *ctx, void *data)
+{
+	rs_peer_t *peer = data;
+
+	memset(&peer->histogram, 0, sizeof(peer->histogram));
+
+	return 0;
 }
 
 static void rs_stats_print(rs_latency_t *stats, PW_CODE code)
@@ -534,6 +744,12 @@ static void rs_stats_print(rs_latency_t *stats, PW_CODE code)
 		INFO("\tLow       : %.3lfms", stats->interval.latency_low);
 		INFO("\tAverage   : %.3lfms", stats->interval.latency_average);
 		INFO("\tMA        : %.3lfms", stats->latency_smoothed);
+		if (stats->histogram) {
+			INFO("\tp50       : %.3lfms", stats->interval.latency_p50);
+			INFO("\tp90       : %.3lfms", stats->interval.latency_p90);
+			INFO("\tp99       : %.3lfms", stats->interval.latency_p99);
+			INFO("\tp99.9     : %.3lfms", stats->interval.latency_p999);
+		}
 	}
 
 	if (have_rt || stats->interval.lost || stats->interval.reused) {
@@ -574,8 +790,8 @@ static int rs_check_pcap_drop(fr_pcap_t *in, int interval) {
 	int ret = 0;
 	struct pcap_stat pstats;
 
-	if (pcap_stats(in->handle, &pstats) != 0) {
-		ERROR("%s failed retrieving pcap stats: %s", in->name, pcap_geterr(in->handle));
+	if (fr_pcap_stats(in, &pstats) < 0) {
+		ERROR("%s failed retrieving pcap stats: %s", in->name, fr_strerror());
 		return -1;
 	}
 
@@ -616,6 +832,10 @@ static void rs_stats_process_latency(rs_latency_t *stats)
 		stats->interval.latency_average = unk;
 		stats->interval.latency_high = unk;
 		stats->interval.latency_low = unk;
+		stats->interval.latency_p50 = unk;
+		stats->interval.latency_p90 = unk;
+		stats->interval.latency_p99 = unk;
+		stats->interval.latency_p999 = unk;
 
 		/*
 		 *	We've not yet been able to determine latency, so latency_smoothed is also NaN
@@ -630,6 +850,13 @@ static void rs_stats_process_latency(rs_latency_t *stats)
 		stats->interval.latency_average = (stats->interval.latency_total / stats->interval.linked_total);
 	}
 
+	if (stats->histogram && stats->histogram->count) {
+		stats->interval.latency_p50 = rs_hist_percentile(stats->histogram, 0.5);
+		stats->interval.latency_p90 = rs_hist_percentile(stats->histogram, 0.9);
+		stats->interval.latency_p99 = rs_hist_percentile(stats->histogram, 0.99);
+		stats->interval.latency_p999 = rs_hist_percentile(stats->histogram, 0.999);
+	}
+
 	if (isnan(stats->latency_smoothed)) {
 		stats->latency_smoothed = 0;
 	}
@@ -655,6 +882,97 @@ static void rs_stats_process_counters(rs_latency_t *stats)
 	}
 }
 
+#ifdef WITH_RS_THREADS
+/** Add the interval counters from one set of stats to another
+ *
+ */
+static void rs_stats_merge(rs_latency_t *out, rs_latency_t const *in)
+{
+	int i;
+
+	out->interval.received_total += in->interval.received_total;
+	out->interval.linked_total += in->interval.linked_total;
+	out->interval.unlinked_total += in->interval.unlinked_total;
+	out->interval.reused_total += in->interval.reused_total;
+	out->interval.lost_total += in->interval.lost_total;
+
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) {
+		out->interval.rt_total[i] += in->interval.rt_total[i];
+	}
+
+	out->interval.latency_total += in->interval.latency_total;
+	if (in->interval.latency_high > out->interval.latency_high) {
+		out->interval.latency_high = in->interval.latency_high;
+	}
+	if (in->interval.latency_low &&
+	    (!out->interval.latency_low || (in->interval.latency_low < out->interval.latency_low))) {
+		out->interval.latency_low = in->interval.latency_low;
+	}
+
+	if (out->histogram && in->histogram) rs_hist_merge(out->histogram, in->histogram);
+}
+
+/*
+ *	Add a worker's client/server latency to the main thread's, and reset it.
+ */
+static int _rs_peer_merge(void *ctx, void *data)
+{
+	rbtree_t	*peers = ctx;
+	rs_peer_t	*in = data, *out;
+
+	if (!in->histogram.count) return 0;
+
+	out = rs_peer_find(peers, in->server, &in->ipaddr, in->port);
+	if (out) rs_hist_merge(&out->histogram, &in->histogram);
+
+	memset(&in->histogram, 0, sizeof(in->histogram));
+
+	return 0;
+}
+
+/** Collect the stats for the last interval from the worker threads
+ *
+ * @param stats to add the worker's counters to.
+ * @return true if any of the worker's capture handles dropped packets.
+ */
+static bool rs_threads_collect(rs_stats_t *stats)
+{
+	size_t		i;
+	size_t		rs_codes_len = (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes));
+	int		j;
+	bool		dropped = false;
+	fr_pcap_t	*in_p;
+
+	for (j = 0; j < workers_running; j++) {
+		rs_thread_t *thread = &workers[j];
+
+		pthread_mutex_lock(&thread->mutex);
+		for (in_p = thread->in;
+		     in_p && !dropped;
+		     in_p = in_p->next) {
+			if (rs_check_pcap_drop(in_p, conf->stats.interval) < 0) dropped = true;
+		}
+
+		for (i = 0; i < rs_codes_len; i++) {
+			rs_latency_t *latency = &thread->stats.exchange[rs_useful_codes[i]];
+
+			rs_stats_merge(&stats->exchange[rs_useful_codes[i]], latency);
+			memset(&latency->interval, 0, sizeof(latency->interval));
+			if (latency->histogram) memset(latency->histogram, 0, sizeof(*latency->histogram));
+		}
+
+		if (stats->peers && thread->stats.peers) {
+			rbtree_walk(thread->stats.peers, RBTREE_IN_ORDER, _rs_peer_merge, stats->peers);
+		}
+
+		if (timercmp(&thread->stats.quiet, &stats->quiet, >)) stats->quiet = thread->stats.quiet;
+		pthread_mutex_unlock(&thread->mutex);
+	}
+
+	return dropped;
+}
+#endif
+
 /** Process stats for a single interval
  *
  */
@@ -666,6 +984,7 @@ static void rs_stats_process(void *ctx)
 	rs_update_t		*this = ctx;
 	rs_stats_t		*stats = this->stats;
 	struct timeval		now;
+	bool			dropped = false;
 
 	gettimeofday(&now, NULL);
 
@@ -677,15 +996,23 @@ static void rs_stats_process(void *ctx)
 	 *	Verify that none of the pcap handles have dropped packets.
 	 */
 	INFO("Interface capture rate:");
+#ifdef WITH_RS_THREADS
+	/*
+	 *	This also checks the worker's capture handles.
+	 */
+	if (workers) dropped = rs_threads_collect(stats);
+#endif
 	for (in_p = this->in;
-	     in_p;
+	     in_p && !dropped;
 	     in_p = in_p->next) {
-		if (rs_check_pcap_drop(in_p, conf->stats.interval) < 0) {
-			ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+		if (rs_check_pcap_drop(in_p, conf->stats.interval) < 0) dropped = true;
+	}
 
-			rs_tv_add_ms(&now, conf->stats.timeout, &stats->quiet);
-			goto clear;
-		}
+	if (dropped) {
+		ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+
+		rs_tv_add_ms(&now, conf->stats.timeout, &stats->quiet);
+		goto clear;
 	}
 
 	if ((stats->quiet.tv_sec + (stats->quiet.tv_usec / 1000000.0)) -
@@ -707,6 +1034,12 @@ static void rs_stats_process(void *ctx)
 		}
 	}
 
+	if ((fr_debug_lvl > 0) && stats->peers) {
+		int section = -1;
+
+		rbtree_walk(stats->peers, RBTREE_IN_ORDER, _rs_peer_print, &section);
+	}
+
 #ifdef HAVE_COLLECTDC_H
 	/*
 	 *	Update stats in collectd using the complex structures we
@@ -724,7 +1057,12 @@ static void rs_stats_process(void *ctx)
 	for (i = 0; i < rs_codes_len; i++) {
 		memset(&stats->exchange[rs_useful_codes[i]].interval, 0,
 		       sizeof(stats->exchange[rs_useful_codes[i]].interval));
+		if (stats->exchange[rs_useful_codes[i]].histogram) {
+			memset(stats->exchange[rs_useful_codes[i]].histogram, 0,
+			       sizeof(*stats->exchange[rs_useful_codes[i]].histogram));
+		}
 	}
+	if (stats->peers) rbtree_walk(stats->peers, RBTREE_IN_ORDER, _rs_peer_clear, NULL);
 
 	{
 		static fr_event_t *event;
@@ -757,6 +1095,42 @@ static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency
 	}
 	stats->interval.latency_total += lint;
 
+	if (stats->histogram) rs_hist_add(stats->histogram, latency);
+}
+
+/** Update the latency histograms for the client and server of a request/response pair
+ *
+ */
+static void rs_stats_update_peers(rs_stats_t *stats, RADIUS_PACKET const *request, struct timeval const *latency)
+{
+	rs_peer_t *peer;
+
+	if (!stats->peers) return;
+
+	peer = rs_peer_find(stats->peers, false, &request->src_ipaddr, 0);
+	if (peer) rs_hist_add(&peer->histogram, latency);
+
+	peer = rs_peer_find(stats->peers, true, &request->dst_ipaddr, request->dst_port);
+	if (peer) rs_hist_add(&peer->histogram, latency);
+}
+
+/** Allocate the latency histograms for a set of stats
+ *
+ * Only needed if we're writing out stats.
+ */
+static int rs_stats_init(TALLOC_CTX *ctx, rs_stats_t *stats)
+{
+	size_t i;
+
+	for (i = 0; i < (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes)); i++) {
+		stats->exchange[rs_useful_codes[i]].histogram = talloc_zero(ctx, rs_histogram_t);
+		if (!stats->exchange[rs_useful_codes[i]].histogram) return -1;
+	}
+
+	stats->peers = rbtree_create(ctx, (rbcmp) rs_peer_cmp, NULL, 0);
+	if (!stats->peers) return -1;
+
+	return 0;
 }
 
 /** Copy a subset of attributes from one list into the other
@@ -914,6 +1288,8 @@ static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request,
 {
 	if (!event->out) return 0;
 
+	RS_OUTPUT_LOCK;
+
 	/*
 	 *	If we're filtering by response then the requests then the capture buffer
 	 *	associated with the request should contain buffered request packets.
@@ -956,6 +1332,8 @@ static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request,
 	 */
 	pcap_dump((void *)event->out->dumper, header, data);
 
+	RS_OUTPUT_UNLOCK;
+
 	return 0;
 }
 
@@ -991,11 +1369,47 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 		return 0;
 	}
 
+	RS_OUTPUT_LOCK;
 	pcap_dump((void *)event->out->dumper, header, data);
+	RS_OUTPUT_UNLOCK;
 
 	return 0;
 }
 
+/** Keep a copy of the request, so we can write it out if the response is slow
+ *
+ */
+static int rs_request_keep(rs_request_t *request, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	if (!conf->slow_out) return 0;
+
+	/* Only the latest retransmission is used to calculate latency */
+	TALLOC_FREE(request->slow.header);
+	TALLOC_FREE(request->slow.data);
+
+	if (!(request->slow.header = talloc(request, struct pcap_pkthdr))) return -1;
+	if (!(request->slow.data = talloc_memdup(request, data, header->caplen))) {
+		TALLOC_FREE(request->slow.header);
+		return -1;
+	}
+	memcpy(request->slow.header, header, sizeof(struct pcap_pkthdr));
+
+	return 0;
+}
+
+/** Write out a request/response pair which breached the latency threshold
+ *
+ */
+static void rs_slow_to_pcap(rs_request_t *request, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	if (!request->slow.header) return;
+
+	RS_OUTPUT_LOCK;
+	pcap_dump((void *)conf->slow_out->dumper, request->slow.header, request->slow.data);
+	pcap_dump((void *)conf->slow_out->dumper, header, data);
+	RS_OUTPUT_UNLOCK;
+}
+
 /* This is the same as immediately scheduling the cleanup event */
 #define RS_CLEANUP_NOW(_x, _s)\
 	{\
@@ -1024,7 +1438,6 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*current;		/* Current packet were processing */
@@ -1032,6 +1445,13 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 	rs_request_t		search;
 
+	bool			last = false;		/* The last packet under the capture limit */
+
+	/*
+	 *	Another worker reached the capture limit.
+	 */
+	if (fr_atomic_load(&capture_done)) return;
+
 	memset(&search, 0, sizeof(search));
 
 	if (!start_pcap.tv_sec) {
@@ -1129,7 +1549,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	current = rad_alloc(conf, false);
+	current = rad_alloc(request_ctx, false);
 	if (!current) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1432,7 +1852,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(request_ctx, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
@@ -1496,6 +1916,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 			return;
 		}
 		rs_request_to_pcap(event, original, header, data);
+		rs_request_keep(original, header, data);
 		response = false;
 		break;
 	}
@@ -1507,6 +1928,28 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		return;
 	}
 
+	/*
+	 *	Take a place under the capture limit before the packet is
+	 *	counted or printed.  With several workers, another one may
+	 *	have reached the limit while we were decoding this packet.
+	 */
+	if (conf->limit > 0) {
+		bool over = false;
+
+		RS_OUTPUT_LOCK;
+		if (captured < conf->limit) {
+			last = (++captured == conf->limit);
+		} else {
+			over = true;
+		}
+		RS_OUTPUT_UNLOCK;
+
+		if (over) {
+			if (response && !original) rad_free(&current);
+			return;
+		}
+	}
+
 	rs_tv_sub(&header->ts, &start_pcap, &elapsed);
 
 	/*
@@ -1531,6 +1974,16 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 */
 		rs_stats_update_latency(&stats->exchange[current->code], &latency);
 		rs_stats_update_latency(&stats->exchange[original->expect->code], &latency);
+		rs_stats_update_peers(stats, original->packet, &latency);
+
+		/*
+		 *	Only write out the pair for the first response, retransmissions
+		 *	would just give us duplicates.
+		 */
+		if (conf->slow_out && (status != RS_RTX) &&
+		    ((((uint64_t) latency.tv_sec * 1000) + (latency.tv_usec / 1000)) >= conf->slow_threshold)) {
+			rs_slow_to_pcap(original, header, data);
+		}
 
 		/*
 		 *	Were filtering on response, now print out the full data from the request
@@ -1568,23 +2021,47 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		rad_free(&current);
 	}
 
-	captured++;
 	/*
 	 *	We've hit our capture limit, break out of the event loop
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
+	if (last) {
+		fr_atomic_store(&capture_done, true);
+
+		INFO("Captured %" PRIu64 " packets, exiting...", conf->limit);
+#ifdef WITH_RS_THREADS
+		/*
+		 *	The main thread tells the others to stop
+		 */
+		if (conf->threads) {
+			rs_signal_self(SIGTERM);
+			return;
+		}
+#endif
 		fr_event_loop_exit(events, 1);
 	}
 }
 
+#ifdef WITH_RS_THREADS
+static void rs_thread_dispatch(uint64_t count, fr_pcap_t *in, struct pcap_pkthdr const *header,
+			       uint8_t const *data);
+#endif
+
+/** Process a packet from a live capture handle
+ *
+ */
+static void rs_got_live_packet(void *ctx, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	rs_event_t	*event = ctx;
+
+	packets_seen++;
+	rs_packet_process(((packets_seen - 1) * count_step) + count_offset + 1, event, header, data);
+}
+
 static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 {
-	static uint64_t	count = 0;	/* Packets seen */
 	rs_event_t	*event = ctx;
 	pcap_t		*handle = event->in->handle;
 
-	int i;
 	int ret;
 	const uint8_t *data;
 	struct pcap_pkthdr *header;
@@ -1596,6 +2073,13 @@ static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 		while (!fr_event_loop_exiting(el)) {
 			struct timeval now;
 
+			/*
+			 *	Don't read past the capture limit.  With workers,
+			 *	one of them may have reached it, and the signal
+			 *	telling us to exit won't be read until we return.
+			 */
+			if (fr_atomic_load(&capture_done)) return;
+
 			ret = pcap_next_ex(handle, &header, &data);
 			if (ret == 0) {
 				/* No more packets available at this time */
@@ -1617,12 +2101,23 @@ static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 				return;
 			}
 
+			packets_seen++;
+
+#ifdef WITH_RS_THREADS
+			/*
+			 *	The workers run their own timers
+			 */
+			if (conf->threads) {
+				rs_thread_dispatch(packets_seen, event->in, header, data);
+				continue;
+			}
+#endif
+
 			do {
 				now = header->ts;
 			} while (fr_event_run(el, &now) == 1);
-			count++;
 
-			rs_packet_process(count, event, header, data);
+			rs_packet_process(packets_seen, event, header, data);
 		}
 		return;
 	}
@@ -1631,19 +2126,8 @@ static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 	 *	Consume multiple packets from the capture buffer.
 	 *	We occasionally need to yield to allow events to run.
 	 */
-	for (i = 0; i < RS_FORCE_YIELD; i++) {
-		ret = pcap_next_ex(handle, &header, &data);
-		if (ret == 0) {
-			/* No more packets available at this time */
-			return;
-		}
-		if (ret < 0) {
-			ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-			return;
-		}
-
-		count++;
-		rs_packet_process(count, event, header, data);
+	if (fr_pcap_dispatch(event->in, RS_FORCE_YIELD, rs_got_live_packet, event) < 0) {
+		ERROR("Error requesting next packet: %s", fr_strerror());
 	}
 }
 
@@ -1781,6 +2265,34 @@ static int rs_build_event_flags(int *flags, FR_NAME_NUMBER const *map, char *lis
 	return i;
 }
 
+/** Parse the TPACKET_V3 ring geometry
+ *
+ * @param spec <block KB>[:<blocks>[:<timeout ms>]].
+ * @return 0 on success, -1 on error.
+ */
+static int rs_build_ring(char const *spec)
+{
+	unsigned long	size, blocks = PCAP_RING_BLOCKS_DEFAULT, timeout = PCAP_RING_TIMEOUT_DEFAULT;
+	char		*p;
+
+	size = strtoul(spec, &p, 10);
+	if (*p == ':') {
+		blocks = strtoul(p + 1, &p, 10);
+		if (*p == ':') timeout = strtoul(p + 1, &p, 10);
+	}
+
+	if (*p || !size || (size > (1024 * 1024)) || !blocks || (blocks > 65536) || !timeout) {
+		ERROR("Invalid ring \"%s\", expected <block KB>[:<blocks>[:<timeout ms>]]", spec);
+		return -1;
+	}
+
+	conf->ring_block_size = size * 1024;
+	conf->ring_block_nr = blocks;
+	conf->ring_block_timeout = timeout;
+
+	return 0;
+}
+
 /** Callback for when the request is removed from the request tree
  *
  * @param request being removed.
@@ -1801,6 +2313,456 @@ static void _unmark_link(void *request)
 	this->in_link_tree = false;
 }
 
+#ifdef WITH_RS_THREADS
+/** Hash the addresses and ports of a packet
+ *
+ * Both directions of a flow hash to the same value, so requests and responses are processed
+ * by the same worker.
+ */
+static uint32_t rs_flow_hash(fr_pcap_t *in, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	uint8_t const		*p = data, *end = data + header->caplen;
+	udp_header_t const	*udp;
+	ssize_t			len;
+	uint32_t		src, dst;
+
+	len = fr_link_layer_offset(data, header->caplen, in->link_layer);
+	if ((len < 0) || ((p + len) >= end)) return 0;
+	p += len;
+
+	switch ((p[0] & 0xf0) >> 4) {
+	case 4:
+	{
+		ip_header_t const *ip = (ip_header_t const *)p;
+
+		if ((p + sizeof(*ip)) > end) return 0;
+
+		src = fr_hash(&ip->ip_src, sizeof(ip->ip_src));
+		dst = fr_hash(&ip->ip_dst, sizeof(ip->ip_dst));
+		p += (0x0f & ip->ip_vhl) * 4;
+	}
+		break;
+
+	case 6:
+	{
+		ip_header6_t const *ip6 = (ip_header6_t const *)p;
+
+		if ((p + sizeof(*ip6)) > end) return 0;
+
+		src = fr_hash(&ip6->ip_src, sizeof(ip6->ip_src));
+		dst = fr_hash(&ip6->ip_dst, sizeof(ip6->ip_dst));
+		p += sizeof(*ip6);
+	}
+		break;
+
+	default:
+		return 0;
+	}
+
+	udp = (udp_header_t const *)p;
+	if ((p + sizeof(*udp)) <= end) {
+		src = fr_hash_update(&udp->src, sizeof(udp->src), src);
+		dst = fr_hash_update(&udp->dst, sizeof(udp->dst), dst);
+	}
+
+	return src ^ dst;
+}
+
+/** Hand a batch of packets read by the main thread to a worker
+ *
+ * Blocks if the worker has too much queued already.
+ */
+static void rs_thread_flush(rs_thread_t *thread)
+{
+	if (!thread->batch) return;
+
+	pthread_mutex_lock(&thread->queue_mutex);
+	while ((thread->queue_len >= RS_THREAD_QUEUE_MAX) && !thread->stop) {
+		pthread_cond_wait(&thread->queue_cond, &thread->queue_mutex);
+	}
+	*thread->queue_tail = thread->batch;
+	thread->queue_tail = thread->batch_tail;
+	thread->queue_len += thread->batch_len;
+	pthread_cond_broadcast(&thread->queue_cond);
+	pthread_mutex_unlock(&thread->queue_mutex);
+
+	thread->batch = NULL;
+	thread->batch_tail = &thread->batch;
+	thread->batch_len = 0;
+}
+
+/** Queue a packet read from a file for the worker which handles its flow
+ *
+ * The packet is copied, as libpcap re-uses its buffer for the next one.
+ */
+static void rs_thread_dispatch(uint64_t count, fr_pcap_t *in, struct pcap_pkthdr const *header,
+			       uint8_t const *data)
+{
+	rs_thread_t	*thread;
+	rs_queued_t	*packet;
+
+	/*
+	 *	Has to be set here, the workers only read it.
+	 */
+	if (!start_pcap.tv_sec) start_pcap = header->ts;
+
+	packet = malloc(sizeof(*packet) + header->caplen);
+	if (!packet) {
+		ERROR("Out of memory");
+		return;
+	}
+	packet->next = NULL;
+	packet->count = count;
+	packet->in = in;
+	packet->header = *header;
+	memcpy(packet->data, data, header->caplen);
+
+	thread = &workers[rs_flow_hash(in, header, data) % conf->threads];
+	*thread->batch_tail = packet;
+	thread->batch_tail = &packet->next;
+
+	if (++thread->batch_len >= RS_THREAD_BATCH) rs_thread_flush(thread);
+}
+
+static void rs_queue_free(rs_queued_t *queue)
+{
+	rs_queued_t *next;
+
+	for (; queue; queue = next) {
+		next = queue->next;
+		free(queue);
+	}
+}
+
+/** Setup the analysis state for a worker
+ *
+ */
+static int rs_thread_init(rs_thread_t *thread)
+{
+	events = fr_event_list_create(thread->ctx, NULL);
+	if (!events) return -1;
+
+	request_tree = rbtree_create(thread->ctx, (rbcmp) rs_packet_cmp, _unmark_request, 0);
+	if (!request_tree) return -1;
+
+	if (conf->link_da_num) {
+		link_tree = rbtree_create(thread->ctx, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
+		if (!link_tree) return -1;
+	}
+
+	/*
+	 *	Allocated last, so when the thread's ctx is freed the requests go
+	 *	before the trees and event list they're in.
+	 */
+	request_ctx = talloc_new(thread->ctx);
+	if (!request_ctx) return -1;
+
+	count_offset = thread->id;
+	count_step = conf->threads;
+
+	return 0;
+}
+
+/** Tear down the analysis state for a worker
+ *
+ * Outstanding requests are freed without being counted as lost.
+ */
+static void rs_thread_free(void)
+{
+	cleanup = true;
+	TALLOC_FREE(request_ctx);
+}
+
+/** Worker for live capture
+ *
+ * Reads from this thread's own capture handles, which the kernel feeds with its share
+ * of the packets (see PACKET_FANOUT).
+ */
+static void *rs_thread_capture(void *arg)
+{
+	rs_thread_t	*thread = arg;
+	rs_event_t	*event;
+	fr_pcap_t	*in_p;
+	int		i, num = 0;
+
+	if (rs_thread_init(thread) < 0) {
+	error:
+		ERROR("Failed initialising thread %i", thread->id);
+		rs_signal_self(SIGTERM);
+		return NULL;
+	}
+
+	for (in_p = thread->in; in_p; in_p = in_p->next) num++;
+
+	event = talloc_zero_array(thread->ctx, rs_event_t, num);
+	if (!event) goto error;
+
+	for (in_p = thread->in, i = 0; in_p; in_p = in_p->next, i++) {
+		event[i].list = events;
+		event[i].in = in_p;
+		event[i].out = thread->out;
+		event[i].stats = &thread->stats;
+	}
+
+	for (;;) {
+		fd_set		read_fds;
+		int		max_fd = -1;
+		int		ret;
+		bool		stop;
+		struct timeval	now, wait;
+
+		pthread_mutex_lock(&thread->queue_mutex);
+		stop = thread->stop || thread->queue_done;
+		pthread_mutex_unlock(&thread->queue_mutex);
+		if (stop) break;
+
+		FD_ZERO(&read_fds);
+		for (i = 0; i < num; i++) {
+			FD_SET(event[i].in->fd, &read_fds);
+			if (event[i].in->fd > max_fd) max_fd = event[i].in->fd;
+		}
+
+		/*
+		 *	Wake up regularly to run timers, and see if we should exit.
+		 */
+		wait.tv_sec = 0;
+		wait.tv_usec = 100000;
+
+		ret = select(max_fd + 1, &read_fds, NULL, NULL, &wait);
+		if ((ret < 0) && (errno != EINTR)) {
+			ERROR("Thread %i failed waiting for packets: %s", thread->id, fr_syserror(errno));
+			rs_signal_self(SIGTERM);
+			break;
+		}
+
+		pthread_mutex_lock(&thread->mutex);
+		do {
+			gettimeofday(&now, NULL);
+		} while (fr_event_run(events, &now) == 1);
+
+		if (ret > 0) for (i = 0; i < num; i++) {
+			if (FD_ISSET(event[i].in->fd, &read_fds)) rs_got_packet(events, event[i].in->fd, &event[i]);
+		}
+		pthread_mutex_unlock(&thread->mutex);
+	}
+
+	rs_thread_free();
+
+	return NULL;
+}
+
+/** Worker for packets read from files
+ *
+ * Processes packets queued by rs_thread_dispatch, in the order they were read.  As with
+ * single threaded processing, timers are driven by the packet timestamps.
+ */
+static void *rs_thread_replay(void *arg)
+{
+	rs_thread_t	*thread = arg;
+	rs_event_t	event;
+	rs_queued_t	*batch, *next;
+
+	if (rs_thread_init(thread) < 0) {
+		ERROR("Failed initialising thread %i", thread->id);
+		rs_signal_self(SIGTERM);
+		return NULL;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.list = events;
+	event.out = thread->out;
+	event.stats = &thread->stats;
+
+	for (;;) {
+		pthread_mutex_lock(&thread->queue_mutex);
+		while (!thread->queue && !thread->queue_done && !thread->stop) {
+			pthread_cond_wait(&thread->queue_cond, &thread->queue_mutex);
+		}
+		if (thread->stop || !thread->queue) {
+			pthread_mutex_unlock(&thread->queue_mutex);
+			break;
+		}
+
+		/*
+		 *	Take everything, the main thread can carry on queueing
+		 *	packets while we work through them.
+		 */
+		batch = thread->queue;
+		thread->queue = NULL;
+		thread->queue_tail = &thread->queue;
+		thread->queue_len = 0;
+		pthread_cond_broadcast(&thread->queue_cond);
+		pthread_mutex_unlock(&thread->queue_mutex);
+
+		pthread_mutex_lock(&thread->mutex);
+		for (; batch; batch = next) {
+			struct timeval now;
+
+			/*
+			 *	Don't work through the rest of a large batch
+			 *	if we've been told to stop, or another worker
+			 *	reached the capture limit.
+			 */
+			if (fr_atomic_load(&thread->stop) || fr_atomic_load(&capture_done)) {
+				rs_queue_free(batch);
+				break;
+			}
+
+			next = batch->next;
+
+			do {
+				now = batch->header.ts;
+			} while (fr_event_run(events, &now) == 1);
+
+			event.in = batch->in;
+			rs_packet_process(batch->count, &event, &batch->header, batch->data);
+			free(batch);
+		}
+		pthread_mutex_unlock(&thread->mutex);
+	}
+
+	rs_thread_free();
+
+	return NULL;
+}
+
+/** Create the workers, and open their capture handles
+ *
+ * For live capture the first worker takes over the handles opened by the main thread,
+ * and the others open their own, which join the same fanout groups.
+ *
+ * @param in capture handles opened by the main thread.
+ * @param out where to write pcap data.
+ * @return 0 on success, -1 on error.
+ */
+static int rs_threads_init(fr_pcap_t *in, fr_pcap_t *out)
+{
+	int i;
+
+	workers = talloc_zero_array(conf, rs_thread_t, conf->threads);
+	if (!workers) return -1;
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_thread_t *thread = &workers[i];
+
+		thread->id = i;
+		thread->out = out;
+		thread->queue_tail = &thread->queue;
+		thread->batch_tail = &thread->batch;
+
+		pthread_mutex_init(&thread->mutex, NULL);
+		pthread_mutex_init(&thread->queue_mutex, NULL);
+		pthread_cond_init(&thread->queue_cond, NULL);
+
+		thread->ctx = talloc_new(NULL);
+		if (!thread->ctx) return -1;
+
+		if (conf->stats.interval && (rs_stats_init(thread->ctx, &thread->stats) < 0)) return -1;
+
+		if (!conf->from_dev) continue;
+
+		if (i == 0) {
+			thread->in = in;
+		} else {
+			fr_pcap_t *in_p, **tail = &thread->in;
+
+			for (in_p = in; in_p; in_p = in_p->next) {
+				fr_pcap_t *clone;
+
+				clone = fr_pcap_init(conf, in_p->name, in_p->type);
+				if (!clone) return -1;
+
+				clone->promiscuous = in_p->promiscuous;
+				clone->buffer_pkts = in_p->buffer_pkts;
+				clone->ring_block_size = in_p->ring_block_size;
+				clone->ring_block_nr = in_p->ring_block_nr;
+				clone->ring_block_timeout = in_p->ring_block_timeout;
+				clone->fanout_group = in_p->fanout_group;
+
+				if (fr_pcap_open(clone) < 0) {
+					ERROR("Failed opening pcap handle (%s) for thread %i: %s",
+					      clone->name, i, fr_strerror());
+					return -1;
+				}
+
+				if (conf->pcap_filter && (fr_pcap_apply_filter(clone, conf->pcap_filter) < 0)) {
+					ERROR("Failed applying filter");
+					return -1;
+				}
+
+				*tail = clone;
+				tail = &clone->next;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/** Start the worker threads
+ *
+ * Must be called after we daemonize.
+ */
+static int rs_threads_start(void)
+{
+	int i;
+
+	for (i = 0; i < conf->threads; i++) {
+		int ret;
+
+		ret = pthread_create(&workers[i].pthread_id, NULL,
+				     conf->from_dev ? rs_thread_capture : rs_thread_replay, &workers[i]);
+		if (ret != 0) {
+			ERROR("Failed creating thread %i: %s", i, fr_syserror(ret));
+			return -1;
+		}
+		workers_running++;
+	}
+
+	return 0;
+}
+
+/** Stop the worker threads, and free their resources
+ *
+ * @param drain if true, wait for the workers to process all the packets they've been given.
+ */
+static void rs_threads_stop(bool drain)
+{
+	int i;
+
+	for (i = 0; i < workers_running; i++) {
+		rs_thread_t *thread = &workers[i];
+
+		if (drain) rs_thread_flush(thread);
+
+		pthread_mutex_lock(&thread->queue_mutex);
+		thread->queue_done = true;
+		if (!drain) fr_atomic_store(&thread->stop, true);
+		pthread_cond_broadcast(&thread->queue_cond);
+		pthread_mutex_unlock(&thread->queue_mutex);
+	}
+
+	for (i = 0; i < workers_running; i++) {
+		pthread_join(workers[i].pthread_id, NULL);
+	}
+
+	for (i = 0; i < conf->threads; i++) {
+		rs_thread_t *thread = &workers[i];
+
+		rs_queue_free(thread->queue);
+		rs_queue_free(thread->batch);
+		talloc_free(thread->ctx);
+
+		pthread_cond_destroy(&thread->queue_cond);
+		pthread_mutex_destroy(&thread->queue_mutex);
+		pthread_mutex_destroy(&thread->mutex);
+	}
+
+	workers_running = 0;
+	TALLOC_FREE(workers);
+}
+#endif
+
 #ifdef HAVE_COLLECTDC_H
 /** Re-open the collectd socket
  *
@@ -1874,6 +2836,7 @@ fr_event_list_t *list, int fd, UNUSED void *ctx)
 	case SIGTERM:
 	case SIGQUIT:
 		DEBUG2("Signalling event loop to exit");
+		interrupted = true;
 		fr_event_loop_exit(events, 1);
 		break;
 
@@ -1889,6 +2852,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "Usage: radsniff [options][stats options] -- [pcap files]\n");
 	fprintf(output, "options:\n");
 	fprintf(output, "  -a                    List all interfaces available for capture.\n");
+	fprintf(output, "  -B <ms>               Write request/response pairs slower than this to the file given by -o.\n");
 	fprintf(output, "  -c <count>            Number of packets to capture.\n");
 	fprintf(output, "  -C                    Enable UDP checksum validation.\n");
 	fprintf(output, "  -d <directory>        Set dictionary directory.\n");
@@ -1906,9 +2870,13 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from file (overrides input of -F).\n");
+	fprintf(output, "  -j <threads>          Split packets between this many analysis threads.\n");
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
+	fprintf(output, "  -M <kb>[:<n>[:<ms>]]  Capture into our own ring of <n> blocks of <kb> KB, the kernel\n");
+	fprintf(output, "                        hands over blocks when full, or after <ms> (Linux only).\n");
+	fprintf(output, "  -o <file>             Write request/response pairs slower than -B to file.\n");
 	fprintf(output, "  -p <port>             Filter packets by port (default is 1812).\n");
 	fprintf(output, "  -P <pidfile>          Daemonize and write out <pidfile>.\n");
 	fprintf(output, "  -q                    Print less debugging information.\n");
@@ -1966,6 +2934,7 @@ int main(int argc, char *argv[])
 
 	conf = talloc_zero(NULL, rs_t);
 	RS_ASSERT(conf);
+	request_ctx = conf;
 
 	/*
 	 *  We don't really want probes taking down machines
@@ -1996,7 +2965,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((opt = getopt(argc, argv, "ab:c:Cd:D:e:Ff:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
+	while ((opt = getopt(argc, argv, "ab:B:c:Cd:D:e:Ff:hi:I:j:l:L:mM:o:p:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
 		switch (opt) {
 		case 'a':
 		{
@@ -2027,6 +2996,14 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'B':
+			conf->slow_threshold = atoi(optarg);
+			if (conf->slow_threshold == 0) {
+				ERROR("Invalid latency threshold \"%s\"", optarg);
+				usage(1);
+			}
+			break;
+
 		case 'c':
 			conf->limit = atoi(optarg);
 			if (conf->limit == 0) {
@@ -2077,6 +3054,18 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->threads = atoi(optarg);
+			if ((conf->threads < 1) || (conf->threads > RS_THREADS_MAX)) {
+				ERROR("Number of threads must be between 1 and %i", RS_THREADS_MAX);
+				usage(64);
+			}
+#ifndef WITH_RS_THREADS
+			ERROR("Threads are not supported on this platform");
+			usage(64);
+#endif
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2089,6 +3078,18 @@ int main(int argc, char *argv[])
 			conf->promiscuous = false;
 			break;
 
+		case 'M':
+			if (rs_build_ring(optarg) < 0) usage(64);
+			break;
+
+		case 'o':
+			conf->slow_out = fr_pcap_init(conf, optarg, PCAP_FILE_OUT);
+			if (!conf->slow_out) {
+				ERROR("Failed creating pcap file \"%s\"", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'p':
 			port = atoi(optarg);
 			break;
@@ -2214,6 +3215,12 @@ int main(int argc, char *argv[])
 		conf->from_stdin = false;
 	}
 
+	/* Slow pairs need both a threshold and somewhere to go */
+	if (!conf->slow_threshold != !conf->slow_out) {
+		ERROR("-B and -o must be used together");
+		usage(64);
+	}
+
 	/* Writing to file overrides stdout */
 	if (conf->to_file && conf->to_stdout) {
 		conf->to_stdout = false;
@@ -2486,12 +3493,25 @@ int main(int argc, char *argv[])
 	{
 		fr_pcap_t *tmp;
 		fr_pcap_t **tmp_p = &tmp;
+		int i = 0;
 
 		for (in_p = in;
 		     in_p;
 		     in_p = in_p->next) {
 			in_p->promiscuous = conf->promiscuous;
 			in_p->buffer_pkts = conf->buffer_pkts;
+			in_p->ring_block_size = conf->ring_block_size;
+			in_p->ring_block_nr = conf->ring_block_nr;
+			in_p->ring_block_timeout = conf->ring_block_timeout;
+
+			/*
+			 *	Each thread opens its own handle for the interface,
+			 *	and the kernel splits the packets between them.
+			 */
+			if ((conf->threads > 1) && (in_p->type == PCAP_INTERFACE_IN)) {
+				in_p->fanout_group = ((getpid() + i++) % 0xffff) + 1;
+			}
+
 			if (fr_pcap_open(in_p) < 0) {
 				ERROR("Failed opening pcap handle (%s): %s", in_p->name, fr_strerror());
 				if (conf->from_auto || (in_p->type == PCAP_FILE_IN)) {
@@ -2558,6 +3578,37 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/*
+	 *	...and the one for slow request/response pairs
+	 */
+	if (conf->slow_out) {
+		conf->slow_out->link_layer = -1;
+
+		for (in_p = in;
+		     in_p;
+		     in_p = in_p->next) {
+			if (conf->slow_out->link_layer < 0) {
+				conf->slow_out->link_layer = in_p->link_layer;
+				continue;
+			}
+
+			if (conf->slow_out->link_layer != in_p->link_layer) {
+				ERROR("Asked to write slow pairs to file, but inputs do not have the same link type");
+				ret = 64;
+				goto finish;
+			}
+		}
+
+		if (fr_pcap_open(conf->slow_out) < 0) {
+			ERROR("Failed opening pcap output (%s): %s", conf->slow_out->name, fr_strerror());
+			goto finish;
+		}
+	}
+
+#ifdef WITH_RS_THREADS
+	if (conf->threads && (rs_threads_init(in, out) < 0)) goto finish;
+#endif
+
 	/*
 	 *	Setup and enter the main event loop. Who needs libev when you can roll your own...
 	 */
@@ -2570,6 +3621,11 @@ int main(int argc, char *argv[])
 		memset(&stats, 0, sizeof(stats));
 		memset(&update, 0, sizeof(update));
 
+		if (conf->stats.interval && (rs_stats_init(conf, &stats) < 0)) {
+			ERROR("Failed allocating latency histograms");
+			goto finish;
+		}
+
 		events = fr_event_list_create(conf, _rs_event_status);
 		if (!events) {
 			ERROR();
@@ -2591,8 +3647,10 @@ int main(int argc, char *argv[])
 
 		/*
 		 *  Now add fd's for each of the pcap sessions we opened
+		 *
+		 *  Unless the worker threads are reading from them.
 		 */
-		for (in_p = in;
+		for (in_p = (conf->threads && conf->from_dev) ? NULL : in;
 		     in_p;
 		     in_p = in_p->next) {
 			rs_event_t *event;
@@ -2623,7 +3681,7 @@ int main(int argc, char *argv[])
 
 			update.list = events;
 			update.stats = &stats;
-			update.in = in;
+			update.in = (conf->threads && conf->from_dev) ? NULL : in;
 
 			now.tv_sec += conf->stats.interval;
 			now.tv_usec = 0;
@@ -2655,12 +3713,32 @@ int main(int argc, char *argv[])
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
 
+#ifdef WITH_RS_THREADS
+	if (conf->threads) {
+		if (conf->from_dev) gettimeofday(&start_pcap, NULL);
+
+		if (rs_threads_start() < 0) goto finish;
+	}
+#endif
+
 	fr_event_loop(events);	/* Enter the main event loop */
 
+#ifdef WITH_RS_THREADS
+	/*
+	 *	Unless we were interrupted, let the workers finish
+	 *	any packets we've read from files.
+	 */
+	if (workers) rs_threads_stop(!interrupted);
+#endif
+
 	DEBUG("Done sniffing");
 
 	finish:
 
+#ifdef WITH_RS_THREADS
+	if (workers) rs_threads_stop(false);
+#endif
+
 	cleanup = true;
 
 	/*
@@ -49,6 +49,54 @@ struct realm_regex {
 	realm_regex_t	*next;		//!< The next realm in the list of regular expressions.
 };
 static realm_regex_t *realms_regex = NULL;
+
+/*
+ *	Walking the list means one regex_exec() per realm, which is
+ *	slow when there are thousands of them.  So we compile runs of
+ *	them into one expression, and remember which realm (if any)
+ *	the last few realm names matched.
+ *
+ *	The combined expressions need (*MARK) to say which realm
+ *	matched.
+ */
+#if defined(HAVE_PCRE) && defined(PCRE_EXTRA_MARK)
+#  define WITH_REALM_REGEX_COMBINE
+#  define REALM_REGEX_CHUNK	(128)
+#endif
+
+#define REALM_REGEX_CACHE_SIZE	(1024)
+
+/** One or more regular expressions, matched with one call
+ *
+ */
+typedef struct realm_regex_entry {
+	regex_t		*preg;		//!< Either a combined expression, or a realm's own.
+	uint32_t	first;		//!< Index of the first realm it matches.
+	uint32_t	num;		//!< Number of realms it matches.
+} realm_regex_entry_t;
+
+typedef struct realm_regex_matcher {
+	REALM			**realms;	//!< In the order they were defined.
+	realm_regex_entry_t	*entry;
+	uint32_t		num_entries;
+} realm_regex_matcher_t;
+
+typedef struct realm_regex_cache {
+	char		*name;		//!< NULL if the slot is empty.
+	REALM		*realm;		//!< NULL if no regex matched.
+} realm_regex_cache_t;
+
+static realm_regex_matcher_t	*realm_regex_matcher = NULL;
+static realm_regex_cache_t	realm_regex_cache[REALM_REGEX_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t		realm_regex_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define REGEX_CACHE_LOCK	pthread_mutex_lock(&realm_regex_mutex)
+#  define REGEX_CACHE_UNLOCK	pthread_mutex_unlock(&realm_regex_mutex)
+#else
+#  define REGEX_CACHE_LOCK
+#  define REGEX_CACHE_UNLOCK
+#endif
 #endif /* HAVE_REGEX */
 
 struct realm_config {
@@ -315,6 +363,230 @@ static ssize_t xlat_server_pool(UNUSED void *instance, REQUEST *request,
 }
 #endif
 
+#ifdef HAVE_REGEX
+static void realm_regex_cache_clear(void)
+{
+	int i;
+
+	REGEX_CACHE_LOCK;
+	for (i = 0; i < REALM_REGEX_CACHE_SIZE; i++) {
+		TALLOC_FREE(realm_regex_cache[i].name);
+		realm_regex_cache[i].realm = NULL;
+	}
+	REGEX_CACHE_UNLOCK;
+}
+
+#  ifdef WITH_REALM_REGEX_COMBINE
+/*
+ *	Whether a pattern still means the same thing when it's
+ *	pasted into a larger one.  Anything which refers to groups
+ *	by number, recurses, quotes to the end of the pattern, or
+ *	might be a comment, is matched on its own.
+ */
+static bool realm_regex_combinable(char const *pattern)
+{
+	char const *p;
+
+	for (p = pattern; *p; p++) {
+		if (*p == '#') return false;
+
+		if (*p == '\\') {
+			p++;
+			if (!*p || isdigit((int) *p) || (strchr("Qgk", *p) != NULL)) return false;
+			continue;
+		}
+
+		if (*p != '(') continue;
+
+		if (p[1] == '*') return false;
+		if (p[1] != '?') continue;
+
+		if (isdigit((int) p[2]) || (p[2] && (strchr("R&CP'+", p[2]) != NULL))) return false;
+		if ((p[2] == '-') && isdigit((int) p[3])) return false;
+		if ((p[2] == '<') && (p[3] != '=') && (p[3] != '!')) return false;
+	}
+
+	return true;
+}
+
+/*
+ *	Each realm becomes "(?s:.*?)(?:regex)(*MARK:n)", and they're
+ *	joined with "|" under a "^".  Because of the anchor, PCRE
+ *	tries every alternative at every offset before moving on to
+ *	the next one, so the first realm to match anywhere wins, as
+ *	it does when walking the list.
+ */
+static void realm_regex_flush(realm_regex_matcher_t *m, realm_regex_t **chunk, uint32_t num, uint32_t first)
+{
+	uint32_t i;
+	char *pattern;
+	regex_t *preg;
+	realm_regex_entry_t *entry;
+
+	if (num == 0) return;
+
+	if (num > 1) {
+		pattern = talloc_strdup(m, "^(?:");
+		for (i = 0; i < num; i++) {
+			pattern = talloc_asprintf_append_buffer(pattern, "%s(?s:.*?)(?:%s)(*MARK:%u)",
+								(i > 0) ? "|" : "", chunk[i]->realm->name + 1, i);
+		}
+		pattern = talloc_strdup_append_buffer(pattern, ")");
+
+		if (regex_compile(m, &preg, pattern, talloc_array_length(pattern) - 1,
+				  true, false, false, false) > 0) {
+			entry = &m->entry[m->num_entries++];
+			entry->preg = preg;
+			entry->first = first;
+			entry->num = num;
+			talloc_free(pattern);
+			return;
+		}
+
+		DEBUG3("Failed combining regex realms, matching them one at a time: %s", fr_strerror());
+		talloc_free(pattern);
+	}
+
+	for (i = 0; i < num; i++) {
+		entry = &m->entry[m->num_entries++];
+		entry->preg = chunk[i]->preg;
+		entry->first = first + i;
+		entry->num = 1;
+	}
+}
+#  endif
+
+/*
+ *	Called when the list of regex realms changes.
+ *
+ *	A matcher which is being replaced may still be in use by
+ *	another thread, so it's left for realms_free() to clean up.
+ */
+static void realm_regex_rebuild(void)
+{
+	realm_regex_matcher_t *m;
+	realm_regex_t *rr;
+	uint32_t num = 0, i;
+
+	realm_regex_cache_clear();
+
+	for (rr = realms_regex; rr != NULL; rr = rr->next) num++;
+	if (!num) return;
+
+	m = talloc_zero(NULL, realm_regex_matcher_t);
+	m->realms = talloc_array(m, REALM *, num);
+	m->entry = talloc_zero_array(m, realm_regex_entry_t, num);
+
+#  ifdef WITH_REALM_REGEX_COMBINE
+	{
+		realm_regex_t	*chunk[REALM_REGEX_CHUNK];
+		uint32_t	chunk_num = 0, first = 0;
+
+		for (rr = realms_regex, i = 0; rr != NULL; rr = rr->next, i++) {
+			m->realms[i] = rr->realm;
+
+			if (!realm_regex_combinable(rr->realm->name + 1)) {
+				realm_regex_flush(m, chunk, chunk_num, first);
+				realm_regex_flush(m, &rr, 1, i);
+				chunk_num = 0;
+				first = i + 1;
+				continue;
+			}
+
+			chunk[chunk_num++] = rr;
+			if (chunk_num == REALM_REGEX_CHUNK) {
+				realm_regex_flush(m, chunk, chunk_num, first);
+				chunk_num = 0;
+				first = i + 1;
+			}
+		}
+		realm_regex_flush(m, chunk, chunk_num, first);
+	}
+#  else
+	for (rr = realms_regex, i = 0; rr != NULL; rr = rr->next, i++) {
+		m->realms[i] = rr->realm;
+		m->entry[i].preg = rr->preg;
+		m->entry[i].first = i;
+		m->entry[i].num = 1;
+	}
+	m->num_entries = num;
+#  endif
+
+	DEBUG3("Matching %u regex realms with %u expressions", num, m->num_entries);
+
+	if (realm_regex_matcher) {
+		if (realm_config) {
+			(void) talloc_steal(realm_config, realm_regex_matcher);
+		} else {
+			talloc_free(realm_regex_matcher);
+		}
+	}
+	realm_regex_matcher = m;
+}
+
+/*
+ *	Find the first regex realm which matches "name".
+ *
+ *	@return -1 on error, 0 for no match, 1 on match.
+ */
+static int realm_regex_match(realm_regex_matcher_t *m, char const *name, REALM **out)
+{
+	uint32_t i;
+	size_t len = strlen(name);
+
+	for (i = 0; i < m->num_entries; i++) {
+		realm_regex_entry_t *entry = &m->entry[i];
+		int compare;
+
+#  ifdef WITH_REALM_REGEX_COMBINE
+		if (entry->num > 1) {
+			pcre_extra	extra;
+			unsigned char	*mark = NULL;
+			unsigned long	idx;
+
+			/*
+			 *	The study is shared between threads, so
+			 *	each caller needs its own place to put
+			 *	the mark.
+			 */
+			if (entry->preg->extra) {
+				extra = *entry->preg->extra;
+			} else {
+				memset(&extra, 0, sizeof(extra));
+			}
+			extra.flags |= PCRE_EXTRA_MARK;
+			extra.mark = &mark;
+
+			compare = pcre_exec(entry->preg->compiled, &extra, name, len, 0, 0, NULL, 0);
+			if (compare == PCRE_ERROR_NOMATCH) continue;
+			if ((compare < 0) || !mark) {
+				fr_strerror_printf("regex evaluation failed with code (%i)", compare);
+				return -1;
+			}
+
+			idx = strtoul((char const *) mark, NULL, 10);
+			if (idx >= entry->num) {
+				fr_strerror_printf("Invalid mark \"%s\"", mark);
+				return -1;
+			}
+
+			*out = m->realms[entry->first + idx];
+			return 1;
+		}
+#  endif
+
+		compare = regex_exec(entry->preg, name, len, NULL, NULL);
+		if (compare < 0) return -1;
+		if (compare == 1) {
+			*out = m->realms[entry->first];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+#endif /* HAVE_REGEX */
+
 void realms_free(void)
 {
 #ifdef WITH_PROXY
@@ -336,6 +608,11 @@ void realms_free(void)
 	rbtree_free(realms_byname);
 	realms_byname = NULL;
 
+#ifdef HAVE_REGEX
+	realm_regex_cache_clear();
+	TALLOC_FREE(realm_regex_matcher);
+#endif
+
 	realm_pool_free(NULL);
 
 	talloc_free(realm_config);
@@ -2069,6 +2346,12 @@ int realm_realm_add(REALM *r, UNUSED CONF_SECTION *cs)
 		rr->next = NULL;
 
 		*last = rr;
+
+		/*
+		 *	realms_init() builds the matcher once all of
+		 *	the realms have been loaded.
+		 */
+		if (event_loop_started) realm_regex_rebuild();
 		return 1;
 	}
 #endif
@@ -2255,6 +2538,10 @@ int realms_init(CONF_SECTION *config)
 #endif
 
 	realm_config = rc;
+
+#ifdef HAVE_REGEX
+	realm_regex_rebuild();
+#endif
 	return 1;
 }
 
@@ -2307,22 +2594,43 @@ REALM *realm_find(char const *name)
 	if (realm) return realm;
 
 #ifdef HAVE_REGEX
-	if (realms_regex) {
-		realm_regex_t *this;
+	if (realm_regex_matcher) {
+		realm_regex_cache_t *slot;
+		int compare;
+
+		/*
+		 *	The same realms turn up over and over again, so
+		 *	remember which regex (if any) matched.
+		 */
+		slot = &realm_regex_cache[fr_hash_string(name) % REALM_REGEX_CACHE_SIZE];
 
-		for (this = realms_regex;
-		     this != NULL;
-		     this = this->next) {
-			int compare;
+		REGEX_CACHE_LOCK;
+		if (slot->name && (strcmp(slot->name, name) == 0)) {
+			realm = slot->realm;
+			REGEX_CACHE_UNLOCK;
 
-			compare = regex_exec(this->preg, name, strlen(name), NULL, NULL);
-			if (compare < 0) {
-				ERROR("Failed performing realm comparison: %s", fr_strerror());
-				return NULL;
-			}
-			if (compare == 1) return this->realm;
+			if (realm) return realm;
+			goto do_default;
+		}
+		REGEX_CACHE_UNLOCK;
+
+		realm = NULL;
+		compare = realm_regex_match(realm_regex_matcher, name, &realm);
+		if (compare < 0) {
+			ERROR("Failed performing realm comparison: %s", fr_strerror());
+			return NULL;
 		}
+
+		REGEX_CACHE_LOCK;
+		talloc_free(slot->name);
+		slot->name = talloc_strdup(NULL, name);
+		slot->realm = realm;
+		REGEX_CACHE_UNLOCK;
+
+		if (realm) return realm;
 	}
+
+do_default:
 #endif
 
 	/*
@@ -88,6 +88,8 @@ static void stats_time(fr_stats_t *stats, struct timeval *start,
 
 	tv_sub(end, start, &diff);
 
+	stats->elapsed_usec += ((uint64_t) diff.tv_sec * USEC) + diff.tv_usec;
+
 	if (diff.tv_sec >= 10) {
 		stats->elapsed[7]++;
 	} else {
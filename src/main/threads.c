@@ -28,6 +28,8 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/process.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <ctype.h>
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -59,6 +61,10 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
 #ifdef HAVE_PTHREAD_H
 
 #ifdef HAVE_OPENSSL_CRYPTO_H
@@ -74,6 +80,9 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #ifndef WITH_GCD
 #define SEMAPHORE_LOCKED	(0)
 
+#define USEC			(1000000)
+#define AUTO_SIZE_INTERVAL	(10000)	/* usec between checks of the pool size */
+
 #define THREAD_RUNNING		(1)
 #define THREAD_CANCELLED	(2)
 #define THREAD_EXITED		(3)
@@ -106,6 +115,20 @@ typedef struct thread_fork_t {
 #endif
 
 
+#ifndef WITH_GCD
+/*
+ *	Queue delay tracking for one class of requests.  See
+ *	request_shed().
+ */
+typedef struct fr_codel_t {
+	uint32_t	target;		//!< Acceptable queue delay in ms.  0 to disable.
+	uint32_t	min_delay;	//!< Lowest delay of the oldest queued request seen
+					//!< this interval, in ms.
+	struct timeval	interval_end;	//!< When the current interval finishes.
+	bool		overloaded;	//!< Delay stayed above target for the last interval.
+} fr_codel_t;
+#endif
+
 #ifdef WITH_STATS
 typedef struct fr_pps_t {
 	uint32_t	pps_old;
@@ -140,6 +163,16 @@ typedef struct THREAD_POOL {
 	time_t		time_last_spawned;
 	uint32_t	cleanup_delay;
 	bool		stop_flag;
+
+	uint32_t	hash_threads;		//!< Threads for fr_crypt_check().
+	uint32_t	hash_queue_size;	//!< Max checks waiting for a hash thread.
+
+	char const	*cpu_affinity;		//!< CPUs the request threads may run on.
+	char const	*main_cpu_affinity;	//!< CPUs the main (event) thread may run on.
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	bool		worker_cpus_set;
+	cpu_set_t	worker_cpus;
+#endif
 #endif	/* WITH_GCD */
 	bool		spawn_flag;
 
@@ -173,6 +206,27 @@ typedef struct THREAD_POOL {
 	uint32_t	max_queue_size;
 	uint32_t	num_queued;
 	fr_fifo_t	*fifo[NUM_FIFOS];
+
+	uint32_t	queue_interval;		//!< ms the delay must stay above target before shedding.
+	fr_codel_t	codel_auth;
+	fr_codel_t	codel_acct;
+	uint64_t	shed[QUEUE_SHED_MAX];	//!< Requests thrown away, by reason.
+
+	/*
+	 *	For sizing the pool from queue wait.  See
+	 *	thread_pool_auto_size().
+	 */
+	bool		auto_size;
+	uint32_t	spawn_delay;		//!< ms requests may wait before we add threads.
+	uint32_t	num_cpus;		//!< CPUs the request threads can run on.
+	struct timeval	auto_next;		//!< When the pool is next checked.
+	uint64_t	wait_usec;		//!< Queue wait of requests dequeued since the last check.
+	uint32_t	wait_count;
+	uint64_t	busy_usec;		//!< Time spent processing requests (decays).
+	uint64_t	cpu_usec;		//!< How much of busy_usec was spent on CPU.
+	uint32_t	idle_min;		//!< Fewest idle threads since we last retired any.
+	time_t		time_last_retired;
+	thread_pool_stats_t auto_stats;
 #endif	/* WITH_GCD */
 } THREAD_POOL;
 
@@ -196,7 +250,16 @@ static const CONF_PARSER thread_config[] = {
 	{ "max_spare_servers", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.max_spare_threads), "10" },
 	{ "max_requests_per_server", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.max_requests_per_thread), "0" },
 	{ "cleanup_delay", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.cleanup_delay), "5" },
+	{ "auto_size", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &thread_pool.auto_size), "no" },
+	{ "spawn_delay", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.spawn_delay), "10" },
 	{ "max_queue_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.max_queue_size), "65536" },
+	{ "queue_target_auth", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.codel_auth.target), "0" },
+	{ "queue_target_acct", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.codel_acct.target), "0" },
+	{ "queue_interval", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.queue_interval), "1000" },
+	{ "hash_threads", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.hash_threads), "0" },
+	{ "hash_queue_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.hash_queue_size), "64" },
+	{ "cpu_affinity", FR_CONF_POINTER(PW_TYPE_STRING, &thread_pool.cpu_affinity), NULL },
+	{ "main_cpu_affinity", FR_CONF_POINTER(PW_TYPE_STRING, &thread_pool.main_cpu_affinity), NULL },
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
 	{ "auto_limit_acct", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &thread_pool.auto_limit_acct), NULL },
@@ -335,9 +398,18 @@ int request_enqueue(REQUEST *request)
 	 *	in a while, OR if the thread pool appears to be full,
 	 *	go manage it.
 	 */
-	if ((last_cleaned < request->timestamp) ||
-	    (thread_pool.active_threads == thread_pool.total_threads) ||
-	    (thread_pool.exited_threads > 0)) {
+	if (thread_pool.auto_size) {
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &thread_pool.auto_next, >=) ||
+		    (thread_pool.exited_threads > 0)) {
+			thread_pool_manage(request->timestamp);
+		}
+
+	} else if ((last_cleaned < request->timestamp) ||
+		   (thread_pool.active_threads == thread_pool.total_threads) ||
+		   (thread_pool.exited_threads > 0)) {
 		thread_pool_manage(request->timestamp);
 	}
 
@@ -402,6 +474,7 @@ int request_enqueue(REQUEST *request)
 			 *	roll, we throw the packet away.
 			 */
 			if (thread_pool.num_queued > keep) {
+				thread_pool.shed[QUEUE_SHED_ACCT_LIMIT]++;
 				pthread_mutex_unlock(&thread_pool.queue_mutex);
 				return 0;
 			}
@@ -426,6 +499,7 @@ int request_enqueue(REQUEST *request)
 	thread_pool.request_count++;
 
 	if (thread_pool.num_queued >= thread_pool.max_queue_size) {
+		thread_pool.shed[QUEUE_SHED_FULL]++;
 		pthread_mutex_unlock(&thread_pool.queue_mutex);
 
 		/*
@@ -466,6 +540,115 @@ int request_enqueue(REQUEST *request)
 	return 1;
 }
 
+/*
+ *	Which delay tracking applies to a request.  Only new
+ *	Access-Request and Accounting-Request packets from the
+ *	network are ever shed.  Anything else, or a request coming
+ *	back from a home server, is already under way.
+ */
+static fr_codel_t *request_codel(REQUEST *request)
+{
+	if (request->proxy) return NULL;
+
+#ifdef WITH_DETAIL
+	/*
+	 *	The detail reader waits for each packet, so there's
+	 *	never a queue of them.
+	 */
+	if (request->listener->type == RAD_LISTEN_DETAIL) return NULL;
+#endif
+
+	switch (request->packet->code) {
+	case PW_CODE_ACCESS_REQUEST:
+		return &thread_pool.codel_auth;
+
+	case PW_CODE_ACCOUNTING_REQUEST:
+		return &thread_pool.codel_acct;
+
+	default:
+		return NULL;
+	}
+}
+
+/*
+ *	How long a request has been waiting, in ms.
+ */
+static uint32_t request_delay(REQUEST *request, struct timeval const *now)
+{
+	int64_t elapsed;
+
+	elapsed = ((int64_t) (now->tv_sec - request->packet->timestamp.tv_sec) * 1000) +
+		  ((now->tv_usec - request->packet->timestamp.tv_usec) / 1000);
+	if (elapsed < 0) return 0;
+
+	return (elapsed >= UINT32_MAX) ? (UINT32_MAX - 1) : elapsed;
+}
+
+/*
+ *	Track the delay of the oldest request in a queue.  Called
+ *	with the queue mutex held, on every dequeue.
+ *
+ *	This follows CoDel.  A queue which is only briefly long is
+ *	fine, and is left alone.  If the oldest request has waited
+ *	for longer than the target for a whole "queue_interval", then
+ *	there is a standing queue, and it's overloaded.
+ *
+ *	While it's overloaded, requests at the head of the queue are
+ *	shed as soon as they pass the target, so the oldest one has
+ *	always waited for a little less than that.  The queue stays
+ *	overloaded until the oldest request has waited for less than
+ *	half the target, or the queue has drained.
+ */
+static void codel_update(fr_codel_t *codel, uint32_t delay, struct timeval const *now)
+{
+	if (timercmp(now, &codel->interval_end, >=)) {
+		if (codel->min_delay != UINT32_MAX) {
+			codel->overloaded = codel->overloaded ?
+					    (codel->min_delay >= (codel->target / 2)) :
+					    (codel->min_delay > codel->target);
+		}
+		codel->min_delay = UINT32_MAX;
+
+		codel->interval_end = *now;
+		codel->interval_end.tv_sec += thread_pool.queue_interval / 1000;
+		codel->interval_end.tv_usec += (thread_pool.queue_interval % 1000) * 1000;
+		if (codel->interval_end.tv_usec >= 1000000) {
+			codel->interval_end.tv_sec++;
+			codel->interval_end.tv_usec -= 1000000;
+		}
+	}
+
+	if (delay < codel->min_delay) codel->min_delay = delay;
+}
+
+/*
+ *	Decide whether a request has been waiting too long to be
+ *	worth processing.  Called with the queue mutex held.
+ *
+ *	When the queue is overloaded, requests which have waited
+ *	longer than the target are thrown away, as the NAS has
+ *	probably given up on them, or is about to.  Newer requests
+ *	are also served first (see request_dequeue()), so that the
+ *	ones we do answer are answered in time.
+ */
+static bool request_shed(REQUEST *request, struct timeval const *now)
+{
+	fr_codel_t *codel;
+
+	codel = request_codel(request);
+	if (!codel || !codel->target || !codel->overloaded) return false;
+
+	if (request_delay(request, now) <= codel->target) return false;
+
+	thread_pool.shed[(codel == &thread_pool.codel_auth) ?
+			 QUEUE_SHED_AUTH_DELAY : QUEUE_SHED_ACCT_DELAY]++;
+
+	request->module = "<shed>";
+	request->child_state = REQUEST_DONE;
+
+	return true;
+}
+
 /*
  *	Remove a request from the queue.
  */
@@ -477,19 +660,18 @@ static int request_dequeue(REQUEST **prequest)
 	int num_blocked = 0;
 	RAD_LISTEN_TYPE i, start;
 	REQUEST *request = NULL;
+	struct timeval now;
+	bool shed = false;
 	reap_children();
 
 	rad_assert(pool_initialized == true);
 
 	pthread_mutex_lock(&thread_pool.queue_mutex);
+	gettimeofday(&now, NULL);
 
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
 	if (thread_pool.auto_limit_acct) {
-		struct timeval now;
-
-		gettimeofday(&now, NULL);
-
 		/*
 		 *	Calculate the instantaneous departure rate
 		 *	from the queue.
@@ -504,40 +686,67 @@ static int request_dequeue(REQUEST **prequest)
 #endif
 
 	/*
-	 *	Clear old requests from all queues.
-	 *
-	 *	We only do one pass over the queue, in order to
-	 *	amortize the work across the child threads.  Since we
-	 *	do N checks for one request de-queued, the old
-	 *	requests will be quickly cleared.
+	 *	Clear old requests from the head of all queues.
 	 */
 	for (i = 0; i < RAD_LISTEN_MAX; i++) {
-		request = fr_fifo_peek(thread_pool.fifo[i]);
-		if (!request) continue;
+		bool measured = false;
 
-		VERIFY_REQUEST(request);
+		while ((request = fr_fifo_peek(thread_pool.fifo[i])) != NULL) {
+			VERIFY_REQUEST(request);
 
-		if (request->master_state != REQUEST_STOP_PROCESSING) {
-			continue;
-		}
+			if (request->master_state != REQUEST_STOP_PROCESSING) {
+				/*
+				 *	The oldest request shows whether
+				 *	there's a standing queue.  The one
+				 *	we pop below may be the newest.
+				 */
+				if (!measured) {
+					fr_codel_t *codel;
 
-		/*
-		 *	This entry was marked to be stopped.  Acknowledge it.
-		 */
-		request = fr_fifo_pop(thread_pool.fifo[i]);
-		rad_assert(request != NULL);
-		VERIFY_REQUEST(request);
-		request->child_state = REQUEST_DONE;
-		thread_pool.num_queued--;
+					codel = request_codel(request);
+					if (codel && codel->target) {
+						codel_update(codel, request_delay(request, &now), &now);
+					}
+					measured = true;
+				}
+
+				/*
+				 *	Newer requests are being served
+				 *	first, so the oldest ones have to
+				 *	be shed from here.
+				 */
+				if (!request_shed(request, &now)) break;
+			}
+
+			/*
+			 *	This entry was marked to be stopped.  Acknowledge it.
+			 */
+			request = fr_fifo_pop(thread_pool.fifo[i]);
+			rad_assert(request != NULL);
+			VERIFY_REQUEST(request);
+			if (request->child_state == REQUEST_DONE) shed = true;
+			request->child_state = REQUEST_DONE;
+			thread_pool.num_queued--;
+		}
 	}
 
 	start = 0;
  retry:
 	/*
-	 *	Pop results from the top of the queue
+	 *	Pop results from the top of the queue.  If there's a
+	 *	standing queue of authentication or accounting
+	 *	requests, take the newest first.
 	 */
 	for (i = start; i < RAD_LISTEN_MAX; i++) {
-		request = fr_fifo_pop(thread_pool.fifo[i]);
+		if (((i == RAD_LISTEN_AUTH) && thread_pool.codel_auth.overloaded)
+#ifdef WITH_ACCOUNTING
+		    || ((i == RAD_LISTEN_ACCT) && thread_pool.codel_acct.overloaded)
+#endif
+			) {
+			request = fr_fifo_pop_tail(thread_pool.fifo[i]);
+		} else {
+			request = fr_fifo_pop(thread_pool.fifo[i]);
+		}
 		if (request) {
 			VERIFY_REQUEST(request);
 			start = i;
@@ -546,8 +755,17 @@ static int request_dequeue(REQUEST **prequest)
 	}
 
 	if (!request) {
+		/*
+		 *	The queue drained, so whatever delay there
+		 *	was, it isn't a standing queue.
+		 */
+		thread_pool.codel_auth.min_delay = 0;
+		thread_pool.codel_acct.min_delay = 0;
+
 		pthread_mutex_unlock(&thread_pool.queue_mutex);
 		*prequest = NULL;
+
+		if (shed) RATE_LIMIT(WARN("Discarding requests which have been queued for too long"));
 		return 0;
 	}
 
@@ -576,11 +794,29 @@ static int request_dequeue(REQUEST **prequest)
 		goto retry;
 	}
 
+	if (request_shed(request, &now)) {
+		shed = true;
+		goto retry;
+	}
+
 	/*
 	 *	The thread is currently processing a request.
 	 */
 	thread_pool.active_threads++;
 
+	if (request->trace) request_trace_end(request, REQUEST_TRACE_QUEUE);
+
+	if (thread_pool.auto_size && !request->proxy) {
+		int64_t wait;
+
+		wait = ((int64_t) (now.tv_sec - request->packet->timestamp.tv_sec) * USEC) +
+		       (now.tv_usec - request->packet->timestamp.tv_usec);
+		if (wait > 0) {
+			thread_pool.wait_usec += wait;
+			thread_pool.wait_count++;
+		}
+	}
+
 	blocked = time(NULL);
 	if (!request->proxy && (blocked - request->timestamp) > 5) {
 		total_blocked++;
@@ -598,6 +834,8 @@ static int request_dequeue(REQUEST **prequest)
 
 	pthread_mutex_unlock(&thread_pool.queue_mutex);
 
+	if (shed) RATE_LIMIT(WARN("Discarding requests which have been queued for too long"));
+
 	if (blocked) {
 		ERROR("%d requests have been waiting in the processing queue for %d seconds.  Check that all databases are running properly!",
 		      num_blocked, (int) blocked);
@@ -615,6 +853,29 @@ static int request_dequeue(REQUEST **prequest)
 static void *request_handler_thread(void *arg)
 {
 	THREAD_HANDLE *self = (THREAD_HANDLE *) arg;
+	bool		timed;
+	struct timeval	start, end;
+	uint64_t	busy_usec, cpu_usec;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec	cpu_start, cpu_end;
+#endif
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	/*
+	 *	Bind ourselves before touching any memory, so that
+	 *	everything we allocate comes from the local node.
+	 */
+	if (thread_pool.worker_cpus_set) {
+		int rcode;
+
+		rcode = pthread_setaffinity_np(pthread_self(), sizeof(thread_pool.worker_cpus),
+					       &thread_pool.worker_cpus);
+		if (rcode != 0) {
+			WARN("Thread %d failed setting CPU affinity: %s",
+			     self->thread_num, fr_syserror(rcode));
+		}
+	}
+#endif
 
 	/*
 	 *	Loop forever, until told to exit.
@@ -695,15 +956,46 @@ static void *request_handler_thread(void *arg)
 		}
 #endif
 
+		/*
+		 *	Time how long the request takes, and how much
+		 *	of that is spent on the CPU.  The rest is spent
+		 *	waiting for databases, home servers, etc.
+		 */
+		timed = thread_pool.auto_size;
+		if (timed) {
+			gettimeofday(&start, NULL);
+#ifdef CLOCK_THREAD_CPUTIME_ID
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+#endif
+		}
+
 		self->request->process(self->request, FR_ACTION_RUN);
 		self->request = NULL;
 
+		busy_usec = cpu_usec = 0;
+		if (timed) {
+			gettimeofday(&end, NULL);
+			if (timercmp(&end, &start, >)) {
+				busy_usec = ((uint64_t) (end.tv_sec - start.tv_sec) * USEC) +
+					    end.tv_usec - start.tv_usec;
+			}
+
+#ifdef CLOCK_THREAD_CPUTIME_ID
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+			cpu_usec = (((int64_t) (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000) +
+				    (cpu_end.tv_nsec - cpu_start.tv_nsec)) / 1000;
+			if (cpu_usec > busy_usec) cpu_usec = busy_usec;
+#endif
+		}
+
 		/*
 		 *	Update the active threads.
 		 */
 		pthread_mutex_lock(&thread_pool.queue_mutex);
 		rad_assert(thread_pool.active_threads > 0);
 		thread_pool.active_threads--;
+		thread_pool.busy_usec += busy_usec;
+		thread_pool.cpu_usec += cpu_usec;
 		pthread_mutex_unlock(&thread_pool.queue_mutex);
 
 		/*
@@ -894,6 +1186,57 @@ static int pid_cmp(void const *one, void const *two)
 }
 #endif
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/** Parse a list of CPUs such as "0-7,16-23" into a cpu_set_t
+ *
+ * @param[out] set to fill in.
+ * @param[in] name of the configuration item, for error messages.
+ * @param[in] str to parse.
+ * @return 0 on success, -1 on error.
+ */
+static int cpu_list_parse(cpu_set_t *set, char const *name, char const *str)
+{
+	char const	*p = str;
+	char		*q;
+	unsigned long	lo, hi, cpu;
+
+	CPU_ZERO(set);
+
+	while (*p) {
+		while (isspace((int) *p)) p++;
+		if (!isdigit((int) *p)) goto error;
+
+		lo = hi = strtoul(p, &q, 10);
+		p = q;
+
+		if (*p == '-') {
+			p++;
+			if (!isdigit((int) *p)) goto error;
+			hi = strtoul(p, &q, 10);
+			p = q;
+		}
+
+		if ((hi < lo) || (hi >= CPU_SETSIZE)) goto error;
+
+		for (cpu = lo; cpu <= hi; cpu++) CPU_SET(cpu, set);
+
+		while (isspace((int) *p)) p++;
+		if (!*p) break;
+		if (*p != ',') goto error;
+		p++;
+	}
+
+	if (CPU_COUNT(set) == 0) {
+	error:
+		ERROR("FATAL: Invalid %s \"%s\".  Expected a list of CPUs such as \"0-7,16-23\"",
+		      name, str);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 /*
  *	Allocate the thread pool, and seed it with an initial number
  *	of threads.
@@ -987,6 +1330,16 @@ int thread_pool_init(CONF_SECTION *cs, bool *spawn_flag)
 		      thread_pool.start_threads, thread_pool.max_threads);
 		return -1;
 	}
+
+	if (thread_pool.hash_threads && (thread_pool.hash_queue_size < 1)) {
+		ERROR("FATAL: hash_queue_size must be at least 1");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("queue_interval", thread_pool.queue_interval, >=, 100);
+	FR_INTEGER_BOUND_CHECK("queue_interval", thread_pool.queue_interval, <=, 10000);
+	FR_INTEGER_BOUND_CHECK("spawn_delay", thread_pool.spawn_delay, >=, 1);
+	FR_INTEGER_BOUND_CHECK("spawn_delay", thread_pool.spawn_delay, <=, 1000);
 #endif	/* WITH_GCD */
 
 	/*
@@ -998,6 +1351,77 @@ int thread_pool_init(CONF_SECTION *cs, bool *spawn_flag)
 	}
 
 #ifndef WITH_GCD
+	/*
+	 *	Bind the main thread, and remember where the request
+	 *	threads go.  Each request thread binds itself as it
+	 *	starts.  The threads for password hashes are created by
+	 *	the main thread, and inherit its CPUs.
+	 */
+	if (thread_pool.cpu_affinity || thread_pool.main_cpu_affinity) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+		if (thread_pool.cpu_affinity) {
+			if (cpu_list_parse(&thread_pool.worker_cpus, "cpu_affinity",
+					   thread_pool.cpu_affinity) < 0) return -1;
+			thread_pool.worker_cpus_set = true;
+		}
+
+		if (thread_pool.main_cpu_affinity) {
+			cpu_set_t main_cpus;
+
+			if (cpu_list_parse(&main_cpus, "main_cpu_affinity",
+					   thread_pool.main_cpu_affinity) < 0) return -1;
+
+			/*
+			 *	Threads inherit the CPUs of their
+			 *	creator.  If only the main thread is
+			 *	bound, the request threads go back to
+			 *	the CPUs we started with.
+			 */
+			if (!thread_pool.worker_cpus_set) {
+				rcode = pthread_getaffinity_np(pthread_self(), sizeof(thread_pool.worker_cpus),
+							       &thread_pool.worker_cpus);
+				if (rcode != 0) {
+					ERROR("FATAL: Failed getting CPU affinity: %s", fr_syserror(rcode));
+					return -1;
+				}
+				thread_pool.worker_cpus_set = true;
+			}
+
+			rcode = pthread_setaffinity_np(pthread_self(), sizeof(main_cpus), &main_cpus);
+			if (rcode != 0) {
+				ERROR("FATAL: Failed binding main thread to CPUs \"%s\": %s",
+				      thread_pool.main_cpu_affinity, fr_syserror(rcode));
+				return -1;
+			}
+			DEBUG2("Main thread bound to CPUs %s", thread_pool.main_cpu_affinity);
+		}
+
+		if (thread_pool.cpu_affinity) {
+			DEBUG2("Request threads bound to CPUs %s", thread_pool.cpu_affinity);
+		}
+#else
+		WARN("Ignoring \"cpu_affinity\" and \"main_cpu_affinity\".  "
+		     "Binding threads to CPUs is not supported on this platform");
+#endif
+	}
+
+	/*
+	 *	For working out how many threads can usefully run.
+	 */
+	thread_pool.num_cpus = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	{
+		long num_cpus;
+
+		num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (num_cpus > 0) thread_pool.num_cpus = num_cpus;
+	}
+#endif
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (thread_pool.worker_cpus_set) thread_pool.num_cpus = CPU_COUNT(&thread_pool.worker_cpus);
+#endif
+	thread_pool.idle_min = UINT32_MAX;
+
 	/*
 	 *	Initialize the queue of requests.
 	 */
@@ -1051,6 +1475,15 @@ int thread_pool_init(CONF_SECTION *cs, bool *spawn_flag)
 			return -1;
 		}
 	}
+
+	/*
+	 *	Threads for slow password hashes, so that they
+	 *	can't tie up every request thread.
+	 */
+	if (fr_crypt_pool_init(thread_pool.hash_threads, thread_pool.hash_queue_size) < 0) {
+		ERROR("FATAL: %s", fr_strerror());
+		return -1;
+	}
 #else
 	thread_pool.queue = dispatch_queue_create("org.freeradius.threads", NULL);
 	if (!thread_pool.queue) {
@@ -1100,6 +1533,12 @@ void thread_pool_stop(void)
 		delete_thread(handle);
 	}
 
+	/*
+	 *	No request threads are left waiting on the hash
+	 *	threads, so they can be stopped.
+	 */
+	fr_crypt_pool_free();
+
 	for (i = 0; i < RAD_LISTEN_MAX; i++) {
 		fr_fifo_free(thread_pool.fifo[i]);
 	}
@@ -1143,6 +1582,190 @@ int request_enqueue(REQUEST *request)
 #endif
 
 #ifndef WITH_GCD
+/*
+ *	Tell up to "count" idle threads to exit.
+ */
+static uint32_t thread_retire(uint32_t count)
+{
+	uint32_t	retired = 0;
+	THREAD_HANDLE	*handle;
+
+	/*
+	 *	Walk through the thread pool, deleting the
+	 *	first idle threads we come across.
+	 */
+	for (handle = thread_pool.head; handle && (retired < count); handle = handle->next) {
+		/*
+		 *	If the thread is not handling a
+		 *	request, but still live, then tell it
+		 *	to exit.
+		 *
+		 *	It will eventually wake up, and realize
+		 *	it's been told to commit suicide.
+		 */
+		if ((handle->request == NULL) &&
+		    (handle->status == THREAD_RUNNING)) {
+			handle->status = THREAD_CANCELLED;
+			/*
+			 *	Post an extra semaphore, as a
+			 *	signal to wake up, and exit.
+			 */
+			sem_post(&thread_pool.semaphore);
+			retired++;
+		}
+	}
+
+	return retired;
+}
+
+/*
+ *	Size the pool from how long requests wait for a thread,
+ *	instead of from the number of spare threads.
+ *
+ *	This is called every AUTO_SIZE_INTERVAL while packets are
+ *	arriving.  If more requests are queued than there are idle
+ *	threads, and they have waited for longer than "spawn_delay",
+ *	then threads are added straight away.
+ *
+ *	More threads only help if the existing ones are waiting for
+ *	something, e.g. a database.  The request threads record how
+ *	much of their time is spent on the CPU.  If each request
+ *	uses the CPU for a quarter of the time it takes, then four
+ *	threads per CPU keep the CPUs busy, and any more just add
+ *	contention.  The pool isn't grown past that, no matter how
+ *	long the queue is.
+ *
+ *	Threads which have been idle for the whole of "cleanup_delay"
+ *	aren't needed, and half of them are told to exit.
+ */
+static void thread_pool_auto_size(time_t now)
+{
+	uint32_t		i, idle, queued, wait, limit, cpu_permille, add, retire;
+	uint64_t		max_wait;
+	struct timeval		when;
+	REQUEST			*request;
+	thread_pool_stats_t	*stats = &thread_pool.auto_stats;
+
+	gettimeofday(&when, NULL);
+	thread_pool.auto_next = when;
+	thread_pool.auto_next.tv_usec += AUTO_SIZE_INTERVAL;
+	if (thread_pool.auto_next.tv_usec >= USEC) {
+		thread_pool.auto_next.tv_sec++;
+		thread_pool.auto_next.tv_usec -= USEC;
+	}
+
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+	queued = thread_pool.num_queued;
+	idle = thread_pool.total_threads - thread_pool.active_threads;
+
+	max_wait = thread_pool.wait_count ? (thread_pool.wait_usec / thread_pool.wait_count) : 0;
+	thread_pool.wait_usec = 0;
+	thread_pool.wait_count = 0;
+
+	/*
+	 *	If every thread is stuck, nothing is dequeued, and
+	 *	only the oldest request shows how long the wait is.
+	 */
+	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+		int64_t age;
+
+		request = fr_fifo_peek(thread_pool.fifo[i]);
+		if (!request || request->proxy) continue;
+
+		age = ((int64_t) (when.tv_sec - request->packet->timestamp.tv_sec) * USEC) +
+		      (when.tv_usec - request->packet->timestamp.tv_usec);
+		if ((age > 0) && ((uint64_t) age > max_wait)) max_wait = age;
+	}
+
+	/*
+	 *	Only the last second or so of processing matters.
+	 */
+	while (thread_pool.busy_usec > USEC) {
+		thread_pool.busy_usec /= 2;
+		thread_pool.cpu_usec /= 2;
+	}
+	cpu_permille = thread_pool.busy_usec ? (thread_pool.cpu_usec * 1000) / thread_pool.busy_usec : 0;
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+	wait = (max_wait >= UINT32_MAX) ? UINT32_MAX : max_wait;
+
+	/*
+	 *	The most threads which can be kept busy.
+	 */
+	limit = thread_pool.max_threads;
+	if (cpu_permille > 0) {
+		uint64_t useful;
+
+		useful = ((uint64_t) thread_pool.num_cpus * 1000) / cpu_permille;
+		if (useful < limit) limit = useful;
+	}
+	if (limit < thread_pool.start_threads) limit = thread_pool.start_threads;
+
+	stats->wait_usec = wait;
+	stats->cpu_percent = cpu_permille / 10;
+	stats->useful_threads = limit;
+
+	if (idle < thread_pool.idle_min) thread_pool.idle_min = idle;
+
+	/*
+	 *	Requests are waiting for threads.  Add enough for all
+	 *	of them, but at most half as many again as we have,
+	 *	and no more than can be kept busy.
+	 */
+	if ((queued > idle) && (wait >= (thread_pool.spawn_delay * 1000))) {
+		if (thread_pool.total_threads >= limit) {
+			if (thread_pool.total_threads < thread_pool.max_threads) stats->cpu_bound++;
+			return;
+		}
+
+		add = queued - idle;
+		if (add > ((thread_pool.total_threads / 2) + 1)) add = (thread_pool.total_threads / 2) + 1;
+		if (add > (limit - thread_pool.total_threads)) add = limit - thread_pool.total_threads;
+
+		DEBUG2("Threads: %u requests waiting up to %u.%03u ms, spawning %u threads (%u%% CPU)",
+		       queued, wait / 1000, wait % 1000, add, cpu_permille / 10);
+
+		for (i = 0; i < add; i++) {
+			if (!spawn_thread(now, 1)) break;
+		}
+
+		if (i > 0) {
+			stats->spawned += i;
+			stats->last_action = "spawned";
+			stats->last_action_time = now;
+		}
+
+		thread_pool.idle_min = UINT32_MAX;
+		return;
+	}
+
+	/*
+	 *	Retire half of the threads which have been idle
+	 *	since we last looked, leaving one spare.
+	 */
+	if ((now - thread_pool.time_last_spawned) < (int) thread_pool.cleanup_delay) return;
+	if ((now - thread_pool.time_last_retired) < (int) thread_pool.cleanup_delay) return;
+	thread_pool.time_last_retired = now;
+
+	retire = (thread_pool.idle_min > 1) ? (thread_pool.idle_min / 2) : 0;
+	thread_pool.idle_min = UINT32_MAX;
+
+	if (thread_pool.total_threads < (thread_pool.start_threads + retire)) {
+		retire = (thread_pool.total_threads > thread_pool.start_threads) ?
+			 thread_pool.total_threads - thread_pool.start_threads : 0;
+	}
+	if (!retire) return;
+
+	DEBUG2("Threads: retiring %u idle threads out of %u", retire, thread_pool.total_threads);
+
+	retire = thread_retire(retire);
+	if (retire > 0) {
+		stats->retired += retire;
+		stats->last_action = "retired";
+		stats->last_action_time = now;
+	}
+}
+
 /*
  *	Check the min_spare_threads and max_spare_threads.
  *
@@ -1195,6 +1818,11 @@ static void thread_pool_manage(time_t now)
 		}
 	}
 
+	if (thread_pool.auto_size) {
+		thread_pool_auto_size(now);
+		return;
+	}
+
 	/*
 	 *	If there are too few spare threads.  Go create some more.
 	 */
@@ -1252,33 +1880,7 @@ static void thread_pool_manage(time_t now)
 
 		DEBUG2("Threads: deleting 1 spare out of %d spares", spare);
 
-		/*
-		 *	Walk through the thread pool, deleting the
-		 *	first idle thread we come across.
-		 */
-		for (handle = thread_pool.head; (handle != NULL) && (spare > 0) ; handle = next) {
-			next = handle->next;
-
-			/*
-			 *	If the thread is not handling a
-			 *	request, but still live, then tell it
-			 *	to exit.
-			 *
-			 *	It will eventually wake up, and realize
-			 *	it's been told to commit suicide.
-			 */
-			if ((handle->request == NULL) &&
-			    (handle->status == THREAD_RUNNING)) {
-				handle->status = THREAD_CANCELLED;
-				/*
-				 *	Post an extra semaphore, as a
-				 *	signal to wake up, and exit.
-				 */
-				sem_post(&thread_pool.semaphore);
-				spare--;
-				break;
-			}
-		}
+		thread_retire(1);
 	}
 
 	/*
@@ -1379,6 +1981,58 @@ pid_t rad_waitpid(pid_t pid, int *status)
 
 	return 0;
 }
+
+/** Wait a short time for a child to exit
+ *
+ * Unlike rad_waitpid(), a child which doesn't exit in time is still
+ * remembered, so the caller can signal it, and wait for it again.
+ *
+ * @param pid of the child.
+ * @param status where to write the exit status.
+ * @param timeout in milliseconds.
+ * @return pid if the child exited, 0 if it didn't exit in time, -1 on error.
+ */
+pid_t rad_waitpid_timeout(pid_t pid, int *status, int timeout)
+{
+	int i;
+	thread_fork_t mytf, *tf;
+
+	if (pid <= 0) return -1;
+
+	if (!pool_initialized) {
+		pid_t child_pid;
+
+		for (i = 0; ; i += 10) {
+			child_pid = waitpid(pid, status, WNOHANG);
+			if ((child_pid != 0) || (i >= timeout)) return child_pid;
+			usleep(10000);
+		}
+	}
+
+	mytf.pid = pid;
+
+	pthread_mutex_lock(&thread_pool.wait_mutex);
+	tf = fr_hash_table_finddata(thread_pool.waiters, &mytf);
+	pthread_mutex_unlock(&thread_pool.wait_mutex);
+
+	if (!tf) return -1;
+
+	for (i = 0; ; i += 10) {
+		reap_children();
+
+		if (tf->exited) {
+			*status = tf->status;
+
+			pthread_mutex_lock(&thread_pool.wait_mutex);
+			fr_hash_table_delete(thread_pool.waiters, &mytf);
+			pthread_mutex_unlock(&thread_pool.wait_mutex);
+			return pid;
+		}
+
+		if (i >= timeout) return 0;
+		usleep(10000);	/* sleep for 1/100 of a second */
+	}
+}
 #else
 /*
  *	No rad_fork or rad_waitpid
@@ -1418,6 +2072,47 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 		pps[0] = pps[1] = 0;
 	}
 }
+
+void thread_pool_shed_stats(uint64_t shed[QUEUE_SHED_MAX])
+{
+	int i;
+
+#ifndef WITH_GCD
+	if (pool_initialized) {
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		for (i = 0; i < QUEUE_SHED_MAX; i++) {
+			shed[i] = thread_pool.shed[i];
+		}
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	} else
+#endif	/* WITH_GCD */
+	{
+		for (i = 0; i < QUEUE_SHED_MAX; i++) {
+			shed[i] = 0;
+		}
+	}
+}
+
+void thread_pool_stats(thread_pool_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+#ifndef WITH_GCD
+	if (pool_initialized) {
+		*stats = thread_pool.auto_stats;
+
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		stats->active_threads = thread_pool.active_threads;
+		stats->queued = thread_pool.num_queued;
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+		stats->auto_size = thread_pool.auto_size;
+		stats->total_threads = thread_pool.total_threads;
+		stats->min_threads = thread_pool.start_threads;
+		stats->max_threads = thread_pool.max_threads;
+	}
+#endif	/* WITH_GCD */
+}
 #endif /* HAVE_PTHREAD_H */
 
 static void time_free(void *data)
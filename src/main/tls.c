@@ -3737,7 +3737,8 @@ fr_tls_status_t tls_ack_handler(tls_session_t *ssn, REQUEST *request)
 		return FR_TLS_FAIL;
 
 	case handshake:
-		if ((ssn->info.handshake_type == handshake_finished) && (ssn->dirty_out.used == 0)) {
+		if ((ssn->info.handshake_type == handshake_finished) && (ssn->dirty_out.used == 0) &&
+		    (BIO_ctrl_pending(ssn->from_ssl) == 0)) {
 			RDEBUG2("Peer ACKed our handshake fragment.  handshake is finished");
 
 			/*
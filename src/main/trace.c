@@ -0,0 +1,340 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Sampled request tracing.
+ * @file main/trace.c
+ *
+ * One in every trace.sample_rate requests gets a #fr_trace_t.  The
+ * server core and modcall record spans against it (time in the queue,
+ * in each module and section, waiting for a home server), and when the
+ * request is finished they are appended to a file in the Chrome trace
+ * event format, which can be loaded into chrome://tracing or Perfetto.
+ *
+ * Requests which aren't sampled have a NULL request->trace, so the
+ * cost of tracing being disabled is one pointer check at each hook.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+/*
+ *	A request going through a deep policy can create a lot of
+ *	spans.  Past this, we just count them.
+ */
+#define TRACE_MAX_SPANS		(256)
+
+typedef struct fr_trace_span_t {
+	char const		*cat;		//!< Category, "module", "section", etc.
+	char const		*name;
+	uint64_t		start;
+	uint64_t		end;
+} fr_trace_span_t;
+
+struct fr_trace_t {
+	uint64_t		start;		//!< When the request was received.
+	uint64_t		begin[REQUEST_TRACE_MAX]; //!< Start of open core spans.
+	uint32_t		dropped;	//!< Spans we didn't have room for.
+	uint32_t		num_spans;
+	fr_trace_span_t		span[TRACE_MAX_SPANS];
+};
+
+static char const *trace_names[REQUEST_TRACE_MAX] = {
+	"queue",
+	"proxy"
+};
+
+static uint32_t		trace_count;	//!< Only touched by the thread calling request_receive().
+
+static FILE		*trace_fp;
+static off_t		trace_size;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define TRACE_LOCK	pthread_mutex_lock(&trace_mutex)
+#  define TRACE_UNLOCK	pthread_mutex_unlock(&trace_mutex)
+#else
+#  define TRACE_LOCK
+#  define TRACE_UNLOCK
+#endif
+
+/** Get the current time for a trace span
+ *
+ * @return microseconds from an arbitrary (but fixed) point.
+ */
+uint64_t request_trace_now(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+	}
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return ((uint64_t) tv.tv_sec * 1000000) + tv.tv_usec;
+	}
+}
+
+/** Decide whether or not to trace a new request
+ *
+ * Should only be called for requests received from the network, and
+ * only from the thread which receives them.
+ *
+ * @param request which has just been received.
+ */
+void request_trace_start(REQUEST *request)
+{
+	fr_trace_t *trace;
+
+	if (!main_config.trace_sample_rate) return;
+
+	if (++trace_count < main_config.trace_sample_rate) return;
+	trace_count = 0;
+
+	trace = talloc_zero(request, fr_trace_t);
+	if (!trace) return;
+
+	trace->start = request_trace_now();
+	request->trace = trace;
+}
+
+/** Record a span which started at "start", and ends now
+ *
+ * @param request being traced.
+ * @param cat category of the span, e.g. "module".
+ * @param name of the span.  Must live at least as long as the request.
+ * @param start of the span, from request_trace_now().
+ */
+void request_trace_span(REQUEST *request, char const *cat, char const *name, uint64_t start)
+{
+	fr_trace_t	*trace = request->trace;
+	fr_trace_span_t	*span;
+
+	if (!trace) return;
+
+	if (trace->num_spans >= TRACE_MAX_SPANS) {
+		trace->dropped++;
+		return;
+	}
+
+	span = &trace->span[trace->num_spans++];
+	span->cat = cat;
+	span->name = name;
+	span->start = start;
+	span->end = request_trace_now();
+}
+
+/** Open a span for something the server core does
+ *
+ * If the span is already open (e.g. we're failing over to another
+ * home server), it keeps its original start time.
+ *
+ * @param request being traced.
+ * @param which span to open.
+ */
+void request_trace_begin(REQUEST *request, request_trace_t which)
+{
+	if (!request->trace || request->trace->begin[which]) return;
+
+	request->trace->begin[which] = request_trace_now();
+}
+
+/** Close a span opened by request_trace_begin()
+ *
+ * @param request being traced.
+ * @param which span to close.
+ */
+void request_trace_end(REQUEST *request, request_trace_t which)
+{
+	fr_trace_t *trace = request->trace;
+
+	if (!trace || !trace->begin[which]) return;
+
+	request_trace_span(request, "core", trace_names[which], trace->begin[which]);
+	trace->begin[which] = 0;
+}
+
+/*
+ *	Names are module and section names, which people can set to
+ *	pretty much anything.
+ */
+static void trace_json_string(FILE *fp, char const *in)
+{
+	char const *p;
+
+	fputc('"', fp);
+	for (p = in; *p; p++) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			fputc('\\', fp);
+			fputc(*p, fp);
+			break;
+
+		default:
+			if ((uint8_t) *p < ' ') {
+				fprintf(fp, "\\u%04x", (uint8_t) *p);
+				break;
+			}
+			fputc(*p, fp);
+			break;
+		}
+	}
+	fputc('"', fp);
+}
+
+/*
+ *	Move trace.json to trace.json.1, trace.json.1 to trace.json.2,
+ *	and so on, dropping the oldest.
+ */
+static void trace_rotate(char const *filename)
+{
+	uint32_t	i;
+	char		from[PATH_MAX], to[PATH_MAX];
+
+	if (!main_config.trace_max_files) {
+		(void) unlink(filename);
+		return;
+	}
+
+	for (i = main_config.trace_max_files; i > 1; i--) {
+		snprintf(from, sizeof(from), "%s.%u", filename, i - 1);
+		snprintf(to, sizeof(to), "%s.%u", filename, i);
+		(void) rename(from, to);
+	}
+
+	snprintf(to, sizeof(to), "%s.1", filename);
+	if (rename(filename, to) < 0) {
+		ERROR("Failed renaming trace file %s: %s", filename, fr_syserror(errno));
+	}
+}
+
+/*
+ *	Must be called with the mutex held.
+ */
+static FILE *trace_open(void)
+{
+	char const *filename = main_config.trace_file;
+
+	if (trace_fp && (trace_size < (off_t) main_config.trace_max_size)) return trace_fp;
+
+	if (trace_fp) {
+		fclose(trace_fp);
+		trace_fp = NULL;
+		trace_rotate(filename);
+	}
+
+	trace_fp = fopen(filename, "a");
+	if (!trace_fp) {
+		RATE_LIMIT(ERROR("Failed opening trace file %s: %s", filename, fr_syserror(errno)));
+		return NULL;
+	}
+
+	(void) fseeko(trace_fp, 0, SEEK_END);
+	trace_size = ftello(trace_fp);
+	if (trace_size < 0) trace_size = 0;
+
+	/*
+	 *	The JSON array format doesn't need the closing
+	 *	bracket, which is just as well, as we never know
+	 *	when we're writing the last event.
+	 */
+	if (trace_size == 0) {
+		fputs("[\n", trace_fp);
+	}
+
+	return trace_fp;
+}
+
+static void trace_event(FILE *fp, REQUEST *request, char const *cat, char const *name,
+			uint64_t start, uint64_t end)
+{
+	fputs("{\"name\":", fp);
+	trace_json_string(fp, name);
+	fputs(",\"cat\":", fp);
+	trace_json_string(fp, cat);
+	fprintf(fp, ",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%u,\"tid\":%u},\n",
+		start, (end > start) ? (end - start) : 0, (unsigned int) getpid(), request->number);
+}
+
+/** Write out the spans for a request, and stop tracing it
+ *
+ * Each request is written as its own "thread", so that the timeline
+ * for one request is one row in the trace viewer, with modules nested
+ * inside the sections which called them.
+ *
+ * @param request which has finished.
+ */
+void request_trace_finish(REQUEST *request)
+{
+	fr_trace_t	*trace = request->trace;
+	FILE		*fp;
+	uint32_t	i;
+	uint64_t	end;
+	char const	*name;
+
+	/*
+	 *	Child requests share the parent's spans.
+	 */
+	if (!trace || request->parent) return;
+
+	end = request_trace_now();
+	request->trace = NULL;
+
+	if (is_radius_code(request->packet->code)) {
+		name = fr_packet_codes[request->packet->code];
+	} else {
+		name = "request";
+	}
+
+	TRACE_LOCK;
+	fp = trace_open();
+	if (!fp) {
+		TRACE_UNLOCK;
+		talloc_free(trace);
+		return;
+	}
+
+	fputs("{\"name\":", fp);
+	trace_json_string(fp, name);
+	fprintf(fp, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"pid\":%u,\"tid\":%u,\"args\":{",
+		trace->start, end - trace->start, (unsigned int) getpid(), request->number);
+	fputs("\"server\":", fp);
+	trace_json_string(fp, request->server ? request->server : "default");
+	fputs(",\"client\":", fp);
+	trace_json_string(fp, (request->client && request->client->shortname) ? request->client->shortname : "");
+	fprintf(fp, ",\"reply\":%u,\"dropped\":%u}},\n", request->reply ? request->reply->code : 0, trace->dropped);
+
+	for (i = 0; i < trace->num_spans; i++) {
+		trace_event(fp, request, trace->span[i].cat, trace->span[i].name,
+			    trace->span[i].start, trace->span[i].end);
+	}
+
+	fflush(fp);
+	trace_size = ftello(fp);
+	TRACE_UNLOCK;
+
+	talloc_free(trace);
+}
@@ -3,7 +3,7 @@ SOURCES := acct.c auth.c client.c crypt.c files.c \
 		  mainconfig.c modules.c modcall.c \
 		  unittest.c soh.c state.c connection.c \
 		  session.c threads.c version.c  \
-		  realms.c
+		  realms.c trace.c
 
 ifneq ($(OPENSSL_LIBS),)
 SOURCES		+= cb.c tls.c
@@ -646,6 +646,7 @@ REQUEST *request_alloc_fake(REQUEST *request)
 #endif
 	fake->parent = request;
 	fake->root = request->root;
+	fake->trace = request->trace;
 	fake->client = request->client;
 
 	/*
@@ -657,6 +658,13 @@ REQUEST *request_alloc_fake(REQUEST *request)
 	 */
 	fake->server = request->server;
 
+	/*
+	 *	It's freed with the parent, so it shares the parent's
+	 *	pin on the configuration.  A CoA request which
+	 *	outlives its parent takes its own, in coa_separate().
+	 */
+	fake->generation = request->generation;
+
 	fake->packet = rad_alloc(fake, true);
 	if (!fake->packet) {
 		talloc_free(fake);
@@ -733,6 +741,12 @@ REQUEST *request_alloc_coa(REQUEST *request)
 	request->coa->options = RAD_REQUEST_OPTION_COA;	/* is a CoA packet */
 	request->coa->packet->code = 0; /* unknown, as of yet */
 	request->coa->child_state = REQUEST_RUNNING;
+
+	/*
+	 *	The CoA is sent after the parent has finished, and
+	 *	may outlive it, so it can't share the parent's spans.
+	 */
+	request->coa->trace = NULL;
 	request->coa->proxy = rad_alloc(request->coa, false);
 	if (!request->coa->proxy) {
 		TALLOC_FREE(request->coa);
@@ -336,6 +336,14 @@ void version_init_features(CONF_SECTION *cs)
 #endif
 				);
 
+	version_add_feature(cs, "metrics",
+#ifdef WITH_METRICS
+				true
+#else
+				false
+#endif
+				);
+
 
 	version_add_feature(cs, "detail",
 #ifdef WITH_DETAIL
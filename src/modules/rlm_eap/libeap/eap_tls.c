@@ -183,6 +183,26 @@ int eaptls_fail(eap_handler_t *handler, int peap_flag)
    may in principle be as long as 16MB.
 */
 
+/*
+ *	OpenSSL may have written more than one record buffer's worth
+ *	of data (e.g. a long certificate chain).  Move as much of the
+ *	rest as will fit into dirty_out, so that the whole flight goes
+ *	out as one fragment series.
+ */
+static void eaptls_refill(tls_session_t *ssn)
+{
+	size_t	room;
+	int	len;
+
+	if (!ssn->from_ssl || (BIO_ctrl_pending(ssn->from_ssl) == 0)) return;
+
+	room = sizeof(ssn->dirty_out.data) - ssn->dirty_out.used;
+	if (!room) return;
+
+	len = BIO_read(ssn->from_ssl, ssn->dirty_out.data + ssn->dirty_out.used, room);
+	if (len > 0) ssn->dirty_out.used += len;
+}
+
 /*
  *	Frame the Dirty data that needs to be send to the client in an
  *	EAP-Request.  We always embed the TLS-length in all EAP-TLS
@@ -195,6 +215,8 @@ int eaptls_request(EAP_DS *eap_ds, tls_session_t *ssn)
 	unsigned int	size;
 	unsigned int 	nlen;
 	unsigned int 	lbit = 0;
+	size_t		pending;
+	uint8_t		*p;
 
 	/* This value determines whether we set (L)ength flag for
 		EVERY packet we send and add corresponding
@@ -215,16 +237,23 @@ int eaptls_request(EAP_DS *eap_ds, tls_session_t *ssn)
 	if (ssn->length_flag) {
 		lbit = 4;
 	}
+
+	eaptls_refill(ssn);
+
+	pending = ssn->dirty_out.used;
+	if (ssn->from_ssl) pending += BIO_ctrl_pending(ssn->from_ssl);
+
 	if (ssn->fragment == 0) {
-		ssn->tls_msg_len = ssn->dirty_out.used;
+		ssn->tls_msg_len = pending;
 	}
 
 	reply.code = FR_TLS_REQUEST;
 	reply.flags = ssn->peap_flag;
 
 	/* Send data, NOT more than the FRAGMENT size */
-	if (ssn->dirty_out.used > ssn->mtu) {
+	if (pending > ssn->mtu) {
 		size = ssn->mtu;
+		if (size > ssn->dirty_out.used) size = ssn->dirty_out.used;
 		reply.flags = SET_MORE_FRAGMENTS(reply.flags);
 		/* Length MUST be included if it is the First Fragment */
 		if (ssn->fragment == 0) {
@@ -236,22 +265,26 @@ int eaptls_request(EAP_DS *eap_ds, tls_session_t *ssn)
 		ssn->fragment = 0;
 	}
 
-	reply.dlen = lbit + size;
-	reply.length = TLS_HEADER_LEN + 1/*flags*/ + reply.dlen;
+	if (lbit) reply.flags = SET_LENGTH_INCLUDED(reply.flags);
 
-	reply.data = talloc_array(eap_ds, uint8_t, reply.length);
-	if (!reply.data) return 0;
+	/*
+	 *	Have eaptls_compose() allocate the EAP packet, and
+	 *	then fill it in directly from the record buffer.
+	 *	This avoids building the fragment in a temporary
+	 *	buffer, and copying it again.
+	 */
+	reply.length = TLS_HEADER_LEN + 1/*flags*/ + lbit + size;
+	reply.data = NULL;
+	reply.dlen = 0;
 
+	if (!eaptls_compose(eap_ds, &reply)) return 0;
+
+	p = eap_ds->request->type.data + 1/*flags*/;
 	if (lbit) {
 		nlen = htonl(ssn->tls_msg_len);
-		memcpy(reply.data, &nlen, lbit);
-		reply.flags = SET_LENGTH_INCLUDED(reply.flags);
+		memcpy(p, &nlen, lbit);
 	}
-	(ssn->record_minus)(&ssn->dirty_out, reply.data + lbit, size);
-
-	eaptls_compose(eap_ds, &reply);
-	talloc_free(reply.data);
-	reply.data = NULL;
+	(ssn->record_minus)(&ssn->dirty_out, p + lbit, size);
 
 	return 1;
 }
@@ -948,8 +948,10 @@ rlm_rcode_t eappeap_process(eap_handler_t *handler, tls_session_t *tls_session,
 
 		if (t->default_method != 0) {
 			RDEBUG2("Setting default EAP type for tunneled EAP session");
-			vp = fr_pair_make(fake, &fake->config, "EAP-Type", "0", T_OP_EQ);
+			vp = fr_pair_afrom_num(fake, PW_EAP_TYPE, 0);
+			rad_assert(vp != NULL);
 			vp->vp_integer = t->default_method;
+			fr_pair_add(&fake->config, vp);
 		}
 		break; }
 
@@ -994,8 +996,10 @@ rlm_rcode_t eappeap_process(eap_handler_t *handler, tls_session_t *tls_session,
 			 */
 			if (t->default_method != 0) {
 				RDEBUG2("Setting default EAP type for tunneled EAP session");
-				vp = fr_pair_make(fake, &fake->config, "EAP-Type", "0", T_OP_EQ);
+				vp = fr_pair_afrom_num(fake, PW_EAP_TYPE, 0);
+				rad_assert(vp != NULL);
 				vp->vp_integer = t->default_method;
+				fr_pair_add(&fake->config, vp);
 			}
 		}
 	} /* else there WAS a t->username */
@@ -1214,7 +1218,11 @@ static int CC_HINT(nonnull) setup_fake_request(REQUEST *request, REQUEST *fake,
 	/*
 	 *	Tell the request that it's a fake one.
 	 */
-	fr_pair_make(fake->packet, &fake->packet->vps, "Freeradius-Proxied-To", "127.0.0.1", T_OP_EQ);
+	vp = fr_pair_afrom_num(fake->packet, PW_FREERADIUS_PROXIED_TO, VENDORPEC_FREERADIUS);
+	if (vp) {
+		vp->vp_ipaddr = htonl(INADDR_LOOPBACK);
+		fr_pair_add(&fake->packet->vps, vp);
+	}
 
 	if (t->username) {
 		vp = fr_pair_list_copy(fake->packet, t->username);
@@ -1244,8 +1252,10 @@ static int CC_HINT(nonnull) setup_fake_request(REQUEST *request, REQUEST *fake,
 	 *	This code is copied from ../rlm_eap_ttls/ttls.c
 	 */
 	if (t->copy_request_to_tunnel) {
-		VALUE_PAIR *copy;
-		vp_cursor_t cursor;
+		VALUE_PAIR *copy, *copied = NULL;
+		vp_cursor_t cursor, out;
+
+		fr_cursor_init(&out, &copied);
 
 		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
 		     vp;
@@ -1262,10 +1272,12 @@ static int CC_HINT(nonnull) setup_fake_request(REQUEST *request, REQUEST *fake,
 			 *	The outside attribute is already in the
 			 *	tunnel, don't copy it.
 			 *
-			 *	This works for BOTH attributes which
-			 *	are originally in the tunneled request,
-			 *	AND attributes which are copied there
-			 *	from below.
+			 *	Copies are kept on a separate list
+			 *	until the end, so this only searches
+			 *	the attributes which were originally
+			 *	in the tunneled request.  Multiple
+			 *	outside attributes of the same type
+			 *	are all copied.
 			 */
 			if (fr_pair_find_by_da(fake->packet->vps, vp->da, TAG_ANY)) continue;
 
@@ -1295,13 +1307,11 @@ static int CC_HINT(nonnull) setup_fake_request(REQUEST *request, REQUEST *fake,
 				break;
 			}
 
-			/*
-			 *	Don't copy from the head, we've already
-			 *	checked it.
-			 */
-			copy = fr_pair_list_copy_by_num(fake->packet, vp, vp->da->attr, vp->da->vendor, TAG_ANY);
-			fr_pair_add(&fake->packet->vps, copy);
+			copy = fr_pair_copy(fake->packet, vp);
+			if (copy) fr_cursor_insert(&out, copy);
 		}
+
+		fr_pair_add(&fake->packet->vps, copied);
 	}
 
 	return 0;
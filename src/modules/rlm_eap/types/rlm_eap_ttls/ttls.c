@@ -1006,7 +1006,11 @@ int eapttls_process(eap_handler_t *handler, tls_session_t *tls_session)
 	/*
 	 *	Tell the request that it's a fake one.
 	 */
-	fr_pair_make(fake->packet, &fake->packet->vps, "Freeradius-Proxied-To", "127.0.0.1", T_OP_EQ);
+	vp = fr_pair_afrom_num(fake->packet, PW_FREERADIUS_PROXIED_TO, VENDORPEC_FREERADIUS);
+	if (vp) {
+		vp->vp_ipaddr = htonl(INADDR_LOOPBACK);
+		fr_pair_add(&fake->packet->vps, vp);
+	}
 
 	RDEBUG("Got tunneled request");
 	rdebug_pair_list(L_DBG_LVL_1, request, fake->packet->vps, NULL);
@@ -1088,8 +1092,10 @@ int eapttls_process(eap_handler_t *handler, tls_session_t *tls_session)
 	 *	exist in the tunneled request.
 	 */
 	if (t->copy_request_to_tunnel) {
-		VALUE_PAIR *copy;
-		vp_cursor_t cursor;
+		VALUE_PAIR *copy, *copied = NULL;
+		vp_cursor_t cursor, out;
+
+		fr_cursor_init(&out, &copied);
 
 		for (vp = fr_cursor_init(&cursor, &request->packet->vps); vp; vp = fr_cursor_next(&cursor)) {
 			/*
@@ -1105,10 +1111,12 @@ int eapttls_process(eap_handler_t *handler, tls_session_t *tls_session)
 			 *	The outside attribute is already in the
 			 *	tunnel, don't copy it.
 			 *
-			 *	This works for BOTH attributes which
-			 *	are originally in the tunneled request,
-			 *	AND attributes which are copied there
-			 *	from below.
+			 *	Copies are kept on a separate list
+			 *	until the end, so this only searches
+			 *	the attributes which were originally
+			 *	in the tunneled request.  Multiple
+			 *	outside attributes of the same type
+			 *	are all copied.
 			 */
 			if (fr_pair_find_by_da(fake->packet->vps, vp->da, TAG_ANY)) {
 				continue;
@@ -1140,13 +1148,11 @@ int eapttls_process(eap_handler_t *handler, tls_session_t *tls_session)
 				break;
 			}
 
-			/*
-			 *	Don't copy from the head, we've already
-			 *	checked it.
-			 */
-			copy = fr_pair_list_copy_by_num(fake->packet, vp, vp->da->attr, vp->da->vendor, TAG_ANY);
-			fr_pair_add(&fake->packet->vps, copy);
+			copy = fr_pair_copy(fake->packet, vp);
+			if (copy) fr_cursor_insert(&out, copy);
 		}
+
+		fr_pair_add(&fake->packet->vps, copied);
 	}
 
 	if ((vp = fr_pair_find_by_num(request->config, PW_VIRTUAL_SERVER, 0, TAG_ANY)) != NULL) {
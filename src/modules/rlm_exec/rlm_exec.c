@@ -28,6 +28,8 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <ctype.h>
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -44,6 +46,8 @@ typedef struct rlm_exec_t {
 	unsigned int	packet_code;
 	bool		shell_escape;
 	uint32_t	timeout;
+	bool		persistent;		//!< Send requests to long-running copies of the program.
+	fr_connection_pool_t *pool;		//!< Pool of running helpers, if persistent.
 } rlm_exec_t;
 
 /*
@@ -63,6 +67,7 @@ static const CONF_PARSER module_config[] = {
 	{ "packet_type", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_exec_t, packet_type), NULL },
 	{ "shell_escape", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_exec_t, shell_escape), "yes" },
 	{ "timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_exec_t, timeout), NULL },
+	{ "persistent", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_exec_t, persistent), "no" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -166,6 +171,12 @@ static ssize_t exec_xlat(void *instance, REQUEST *request, char const *fmt, char
 		return -1;
 	}
 
+	if (inst->persistent) {
+		REDEBUG("exec xlat cannot be used with 'persistent = yes'");
+		*out = '\0';
+		return -1;
+	}
+
 	if (inst->input_list) {
 		input_pairs = radius_list(request, inst->input_list);
 		if (!input_pairs) {
@@ -243,6 +254,11 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->persistent && (!inst->wait || !inst->program)) {
+		cf_log_err_cs(conf, "'persistent = yes' requires 'wait = yes' and a 'program'");
+		return -1;
+	}
+
 	/*
 	 *	Get the packet type on which to execute
 	 */
@@ -281,6 +297,122 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+/*
+ *	Start a new copy of the helper program.
+ */
+static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	rlm_exec_t	*inst = instance;
+
+	return radius_helper_start(ctx, inst->program);
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_exec_t	*inst = instance;
+
+	if (!inst->persistent) return 0;
+
+	inst->pool = fr_connection_pool_module_init(conf, inst, mod_conn_create, NULL, NULL);
+	if (!inst->pool) return -1;
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_exec_t	*inst = instance;
+
+	fr_connection_pool_free(inst->pool);
+
+	return 0;
+}
+
+/** Send a request to a persistent helper, and read its response
+ *
+ * The request is the input pairs, one "Attribute = value" per line,
+ * followed by an empty line.
+ *
+ * The response is a status line, containing the same code the program
+ * would exit with, optionally followed by a message.  Then zero or more
+ * "Attribute = value" lines, followed by an empty line.
+ *
+ * Any error or timeout closes the helper, and the pool starts a new one.
+ *
+ * @return the status code, or -1 on error.
+ */
+static int exec_helper(rlm_exec_t *inst, TALLOC_CTX *ctx, char *out, size_t outlen, VALUE_PAIR **output_pairs,
+		       REQUEST *request, VALUE_PAIR *input_pairs)
+{
+	radius_helper_t	*helper;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		*msg, *p;
+	char		line[1024];
+	ssize_t		len;
+	int		status;
+	struct timeval	timeout, deadline;
+
+	*out = '\0';
+
+	helper = fr_connection_get(inst->pool);
+	if (!helper) return -1;
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += inst->timeout;
+	timeout.tv_sec = inst->timeout;
+	timeout.tv_usec = 0;
+
+	msg = talloc_typed_strdup(request, "");
+	for (vp = fr_cursor_init(&cursor, &input_pairs);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		vp_prints(line, sizeof(line), vp);
+		msg = talloc_asprintf_append_buffer(msg, "%s\n", line);
+	}
+	msg = talloc_strdup_append_buffer(msg, "\n");
+
+	RDEBUG2("Sending %zu bytes to helper %s", talloc_array_length(msg) - 1, inst->program);
+
+	if (radius_helper_write(helper, msg, talloc_array_length(msg) - 1, &timeout) < 0) {
+	error:
+		REDEBUG("%s", fr_strerror());
+		talloc_free(msg);
+		fr_connection_close(inst->pool, helper);
+		return -1;
+	}
+	talloc_free(msg);
+
+	len = radius_helper_read_line(helper, line, sizeof(line), &deadline);
+	if (len < 0) goto error;
+
+	status = strtol(line, &p, 10);
+	if ((p == line) || (status < 0)) {
+		fr_strerror_printf("Invalid status line from helper: \"%s\"", line);
+		goto error;
+	}
+	while (isspace((int) *p)) p++;
+	strlcpy(out, p, outlen);
+
+	/*
+	 *	Always read the whole response, so the next request
+	 *	starts at the right place.
+	 */
+	while ((len = radius_helper_read_line(helper, line, sizeof(line), &deadline)) > 0) {
+		if (!output_pairs) continue;
+
+		if (fr_pair_list_afrom_str(ctx, line, output_pairs) == T_INVALID) {
+			RWDEBUG("Failed parsing output from helper: \"%s\": %s", line, fr_strerror());
+		}
+	}
+	if (len < 0) goto error;
+
+	fr_connection_release(inst->pool, helper);
+
+	RDEBUG2("Helper returned code (%d) and output '%s'", status, out);
+
+	return status;
+}
 
 /*
  *  Dispatch an exec method
@@ -342,9 +474,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, REQUEST *r
 	 *	This function does it's own xlat of the input program
 	 *	to execute.
 	 */
-	status = radius_exec_program(ctx, out, sizeof(out), inst->output ? &answer : NULL, request,
-				     inst->program, inst->input ? *input_pairs : NULL,
-				     inst->wait, inst->shell_escape, inst->timeout);
+	if (inst->persistent) {
+		status = exec_helper(inst, ctx, out, sizeof(out), inst->output ? &answer : NULL, request,
+				     inst->input ? *input_pairs : NULL);
+	} else {
+		status = radius_exec_program(ctx, out, sizeof(out), inst->output ? &answer : NULL, request,
+					     inst->program, inst->input ? *input_pairs : NULL,
+					     inst->wait, inst->shell_escape, inst->timeout);
+	}
 	rcode = rlm_exec_status2rcode(request, out, strlen(out), status);
 
 	/*
@@ -471,6 +608,8 @@ module_t rlm_exec = {
 	.inst_size	= sizeof(rlm_exec_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
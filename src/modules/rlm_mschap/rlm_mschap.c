@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/md5.h>
 #include <freeradius-devel/sha1.h>
+#include <freeradius-devel/base64.h>
 
 #include <ctype.h>
 
@@ -536,6 +537,16 @@ static void *mod_conn_create(TALLOC_CTX *ctx, UNUSED void *instance)
 }
 #endif
 
+/*
+ *	Start a long-running ntlm_auth helper
+ */
+static void *mod_helper_create(TALLOC_CTX *ctx, void *instance)
+{
+	rlm_mschap_t *inst = instance;
+
+	return radius_helper_start(ctx, inst->ntlm_helper);
+}
+
 
 static const CONF_PARSER passchange_config[] = {
 	{ "ntlm_auth", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_mschap_t, ntlm_cpw), NULL },
@@ -555,6 +566,9 @@ static const CONF_PARSER module_config[] = {
 	{ "with_ntdomain_hack", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_mschap_t, with_ntdomain_hack), "yes" },
 	{ "ntlm_auth", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_mschap_t, ntlm_auth), NULL },
 	{ "ntlm_auth_timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_mschap_t, ntlm_auth_timeout), NULL },
+	{ "ntlm_auth_helper", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_mschap_t, ntlm_helper), NULL },
+	{ "ntlm_auth_helper_username", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username), NULL },
+	{ "ntlm_auth_helper_domain", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain), NULL },
 	{ "passchange", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) passchange_config },
 	{ "allow_retry", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_mschap_t, allow_retry), "yes" },
 	{ "retry_msg", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_mschap_t, retry_msg), NULL },
@@ -626,6 +640,32 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	/*
+	 *	... except for the persistent helper, which does the
+	 *	same job without a fork per request.
+	 */
+	if (inst->ntlm_helper) {
+		if (!inst->ntlm_helper_username) {
+			cf_log_err_cs(conf, "'ntlm_auth_helper' requires 'ntlm_auth_helper_username'");
+			return -1;
+		}
+
+#ifdef WITH_AUTH_WINBIND
+		if (inst->method == AUTH_WBCLIENT) {
+			cf_log_err_cs(conf, "'ntlm_auth_helper' cannot be used with 'winbind_username'");
+			return -1;
+		}
+#endif
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+
+		inst->ntlm_helper_pool = fr_connection_pool_module_init(conf, inst, mod_helper_create, NULL, NULL);
+		if (!inst->ntlm_helper_pool) {
+			cf_log_err_cs(conf, "Unable to initialise ntlm_auth helper pool");
+			return -1;
+		}
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("rlm_mschap (%s): using internal authentication", inst->xlat_name);
@@ -633,6 +673,9 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("rlm_mschap (%s): authenticating by calling 'ntlm_auth'", inst->xlat_name);
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("rlm_mschap (%s): authenticating via persistent 'ntlm_auth' helpers", inst->xlat_name);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("rlm_mschap (%s): authenticating directly to winbind", inst->xlat_name);
@@ -663,13 +706,14 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 /*
  *	Tidy up instance
  */
-static int mod_detach(UNUSED void *instance)
+static int mod_detach(void *instance)
 {
-#ifdef WITH_AUTH_WINBIND
 	rlm_mschap_t *inst = instance;
 
+#ifdef WITH_AUTH_WINBIND
 	fr_connection_pool_free(inst->wb_pool);
 #endif
+	fr_connection_pool_free(inst->ntlm_helper_pool);
 
 	return 0;
 }
@@ -1095,6 +1139,204 @@ ntlm_auth_err:
 	return -1;
 }
 
+/*
+ *	Map an error message from ntlm_auth to one of the
+ *	do_mschap() return codes.  Returns 0 if it isn't one
+ *	we know about.
+ */
+static int ntlm_auth_error(REQUEST *request, char const *buffer)
+{
+	/*
+	 *	look for "Password expired", or "Must change password".
+	 */
+	if (strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Must change password")) {
+		REDEBUG2("%s", buffer);
+		return -648;
+	}
+
+	if (strcasestr(buffer, "Account locked out") ||
+	    strcasestr(buffer, "0xC0000234")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "Account disabled") ||
+	    strcasestr(buffer, "0xC0000072")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "No logon servers") ||
+	    strcasestr(buffer, "0xC000005E")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	return 0;
+}
+
+/*
+ *	Longest user or domain name we send to the helper.
+ */
+#define NTLM_HELPER_VALUE_MAX (256)
+
+/*
+ *	Append "Key:: base64-value" to an ntlm-server-1 request.
+ *	Using base64 means user supplied data can't break the
+ *	line based protocol.
+ *
+ *	Values which are too long are rejected, rather than truncated,
+ *	so that we never authenticate a different identity.
+ */
+static int ntlm_helper_append(REQUEST *request, char **msg, char const *key, char const *value, size_t len)
+{
+	char buffer[FR_BASE64_ENC_LENGTH(NTLM_HELPER_VALUE_MAX) + 1];
+
+	if (len > NTLM_HELPER_VALUE_MAX) {
+		REDEBUG("%s is too long for ntlm_auth (%zu bytes, maximum is %i)", key, len, NTLM_HELPER_VALUE_MAX);
+		return -1;
+	}
+	fr_base64_encode(buffer, sizeof(buffer), (uint8_t const *) value, len);
+
+	*msg = talloc_asprintf_append_buffer(*msg, "%s:: %s\n", key, buffer);
+
+	return 0;
+}
+
+/*
+ *	Authenticate via a persistent "ntlm_auth --helper-protocol=ntlm-server-1".
+ *
+ *	The request is a set of "Key: value" lines terminated by ".",
+ *	and so is the response.
+ *
+ *	Returns the same codes as do_mschap(), or -3 if the request
+ *	can't be sent to the helper.
+ */
+static int do_auth_ntlm_helper(rlm_mschap_t *inst, REQUEST *request,
+			       uint8_t const *challenge, uint8_t const *response,
+			       uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	radius_helper_t	*helper;
+	char		*msg;
+	char const	*value;
+	char		user_name_buf[500];
+	char		domain_name_buf[500];
+	char		line[1024];
+	char		error[256];
+	char		hex[24 * 2 + 1];
+	ssize_t		len;
+	bool		authenticated = false, have_key = false;
+	struct timeval	timeout, deadline;
+
+	len = tmpl_expand(&value, user_name_buf, sizeof(user_name_buf),
+			  request, inst->ntlm_helper_username, NULL, NULL);
+	if (len < 0) {
+		REDEBUG2("Unable to expand ntlm_auth_helper_username");
+		return -1;
+	}
+
+	msg = talloc_typed_strdup(request, "");
+	if (ntlm_helper_append(request, &msg, "Username", value, len) < 0) {
+		talloc_free(msg);
+		return -3;
+	}
+
+	if (inst->ntlm_helper_domain) {
+		len = tmpl_expand(&value, domain_name_buf, sizeof(domain_name_buf),
+				  request, inst->ntlm_helper_domain, NULL, NULL);
+		if (len < 0) {
+			REDEBUG2("Unable to expand ntlm_auth_helper_domain");
+			talloc_free(msg);
+			return -1;
+		}
+		if (ntlm_helper_append(request, &msg, "NT-Domain", value, len) < 0) {
+			talloc_free(msg);
+			return -3;
+		}
+	}
+
+	fr_bin2hex(hex, challenge, 8);
+	msg = talloc_asprintf_append_buffer(msg, "LANMAN-Challenge: %s\n", hex);
+	fr_bin2hex(hex, response, 24);
+	msg = talloc_asprintf_append_buffer(msg, "NT-Response: %s\n", hex);
+	msg = talloc_strdup_append_buffer(msg, "Request-User-Session-Key: Yes\n.\n");
+
+	helper = fr_connection_get(inst->ntlm_helper_pool);
+	if (!helper) {
+		talloc_free(msg);
+		return -2;
+	}
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += inst->ntlm_auth_timeout;
+	timeout.tv_sec = inst->ntlm_auth_timeout;
+	timeout.tv_usec = 0;
+
+	if (radius_helper_write(helper, msg, talloc_array_length(msg) - 1, &timeout) < 0) {
+	helper_error:
+		REDEBUG("ntlm_auth helper failed: %s", fr_strerror());
+		talloc_free(msg);
+		fr_connection_close(inst->ntlm_helper_pool, helper);
+		return -2;
+	}
+
+	error[0] = '\0';
+
+	/*
+	 *	Read the whole response, so the helper is left
+	 *	ready for the next request.
+	 */
+	while ((len = radius_helper_read_line(helper, line, sizeof(line), &deadline)) >= 0) {
+		if (strcmp(line, ".") == 0) break;
+
+		RDEBUG3("ntlm_auth said: %s", line);
+
+		if (strcmp(line, "Authenticated: Yes") == 0) {
+			authenticated = true;
+
+		} else if ((strncmp(line, "Authentication-Error: ", 22) == 0) ||
+			   (strncmp(line, "Error: ", 7) == 0)) {
+			strlcpy(error, strchr(line, ' ') + 1, sizeof(error));
+
+		} else if (strncmp(line, "User-Session-Key: ", 18) == 0) {
+			if (fr_hex2bin(nthashhash, NT_DIGEST_LENGTH,
+				       line + 18, len - 18) != NT_DIGEST_LENGTH) {
+				fr_strerror_printf("Invalid User-Session-Key");
+				goto helper_error;
+			}
+			have_key = true;
+		}
+	}
+	if (len < 0) goto helper_error;
+
+	talloc_free(msg);
+	fr_connection_release(inst->ntlm_helper_pool, helper);
+
+	if (!authenticated) {
+		int rcode;
+
+		rcode = ntlm_auth_error(request, error);
+		if (rcode < 0) return rcode;
+
+		REDEBUG("ntlm_auth says: %s", error[0] ? error : "Authentication failed");
+		return -1;
+	}
+
+	if (!have_key) {
+		REDEBUG("Invalid output from ntlm_auth: no User-Session-Key");
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1155,38 +1397,8 @@ static int CC_HINT(nonnull (1, 2, 4, 5 ,6)) do_mschap(rlm_mschap_t *inst, REQUES
 		if (result != 0) {
 			char *p;
 
-			/*
-			 *	look for "Password expired", or "Must change password".
-			 */
-			if (strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Must change password")) {
-				REDEBUG2("%s", buffer);
-				return -648;
-			}
-
-			if (strcasestr(buffer, "Account locked out") ||
-			    strcasestr(buffer, "0xC0000234")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "Account disabled") ||
-			    strcasestr(buffer, "0xC0000072")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "No logon servers") ||
-			    strcasestr(buffer, "0xC000005E")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
+			result = ntlm_auth_error(request, buffer);
+			if (result < 0) return result;
 
 			RDEBUG2("External script failed");
 			p = strchr(buffer, '\n');
@@ -1228,6 +1440,12 @@ static int CC_HINT(nonnull (1, 2, 4, 5 ,6)) do_mschap(rlm_mschap_t *inst, REQUES
 		break;
 	}
 
+		/*
+		 *	Send it to a persistent ntlm_auth helper
+		 */
+	case AUTH_NTLMAUTH_HELPER:
+		return do_auth_ntlm_helper(inst, request, challenge, response, nthashhash);
+
 #ifdef WITH_AUTH_WINBIND
 		/*
 		 *	Process auth via the wbclient library
@@ -1417,6 +1635,12 @@ static rlm_rcode_t mschap_error(rlm_mschap_t *inst, REQUEST *request, unsigned c
 	char		new_challenge[33], buffer[128];
 	char		*p;
 
+	/*
+	 *	The request can't be checked at all, so there's
+	 *	nothing to tell the client.
+	 */
+	if (mschap_result == -3) return RLM_MODULE_INVALID;
+
 	if ((mschap_result == -648) ||
 	    ((mschap_result == 0) &&
 	     (smb_ctrl && ((smb_ctrl->vp_integer & ACB_PW_EXPIRED) != 0)))) {
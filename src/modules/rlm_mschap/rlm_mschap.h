@@ -14,7 +14,8 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 3
 #ifdef WITH_AUTH_WINBIND
 	,AUTH_WBCLIENT       	= 2
 #endif
@@ -28,6 +29,10 @@ typedef struct rlm_mschap_t {
 	char const		*xlat_name;
 	char const		*ntlm_auth;
 	uint32_t		ntlm_auth_timeout;
+	char const		*ntlm_helper;
+	vp_tmpl_t		*ntlm_helper_username;
+	vp_tmpl_t		*ntlm_helper_domain;
+	fr_connection_pool_t	*ntlm_helper_pool;
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
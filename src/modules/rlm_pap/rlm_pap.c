@@ -29,6 +29,7 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/base64.h>
+#include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include <ctype.h>
@@ -40,6 +41,26 @@ USES_APPLE_DEPRECATED_API
 #  include <openssl/evp.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	An entry in the verified credential cache.  The key is an HMAC
+ *	of the "known good" password and the password the user sent,
+ *	under a secret which is generated at start-up.  So the cache
+ *	holds no password material, and a wrong password never hits.
+ */
+typedef struct pap_cache_entry {
+	uint8_t		key[SHA1_DIGEST_LENGTH];
+	time_t		expires;
+	size_t		offset;		//!< Offset used for heap.
+} pap_cache_entry_t;
+
 /*
  *      Define a structure for our module configuration.
  *
@@ -51,6 +72,16 @@ typedef struct rlm_pap_t {
 	char const	*name;	/* CONF_SECTION->name, not strdup'd */
 	int		auth_type;
 	bool		normify;
+
+	uint32_t	cache_size;	//!< Maximum number of verified credentials to cache.
+	uint32_t	cache_ttl;	//!< How long a verified credential is cached for.
+
+	rbtree_t	*cache;		//!< Verified credentials, by key.
+	fr_heap_t	*heap;		//!< Verified credentials, by expiry time.
+	uint8_t		secret[32];	//!< Per-instance HMAC key for cache entries.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;		//!< Protect the cache.
+#endif
 } rlm_pap_t;
 
 /*
@@ -64,6 +95,8 @@ typedef struct rlm_pap_t {
  */
 static const CONF_PARSER module_config[] = {
 	{ "normalise", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_pap_t, normify), "yes" },
+	{ "cache_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_pap_t, cache_size), "0" },
+	{ "cache_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_pap_t, cache_ttl), "300" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -108,10 +141,35 @@ static const FR_NAME_NUMBER header_names[] = {
 	{ NULL, 0 }
 };
 
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	pap_cache_entry_t const *a = one;
+	pap_cache_entry_t const *b = two;
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static int cache_heap_cmp(void const *one, void const *two)
+{
+	pap_cache_entry_t const *a = one;
+	pap_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+static void cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_pap_t *inst = instance;
 	DICT_VALUE *dval;
+	size_t i;
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) {
@@ -125,9 +183,161 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->auth_type = 0;
 	}
 
+	if (!inst->cache_size) return 0;
+
+	FR_INTEGER_BOUND_CHECK("cache_ttl", inst->cache_ttl, >=, 1);
+	FR_INTEGER_BOUND_CHECK("cache_ttl", inst->cache_ttl, <=, 86400);
+
+	for (i = 0; i < sizeof(inst->secret); i += sizeof(uint32_t)) {
+		uint32_t r = fr_rand();
+
+		memcpy(inst->secret + i, &r, sizeof(r));
+	}
+
+	inst->cache = rbtree_create(inst, cache_entry_cmp, cache_entry_free, 0);
+	if (!inst->cache) {
+		cf_log_err_cs(conf, "Failed to create cache");
+		return -1;
+	}
+
+	inst->heap = fr_heap_create(cache_heap_cmp, offsetof(pap_cache_entry_t, offset));
+	if (!inst->heap) {
+		cf_log_err_cs(conf, "Failed to create heap for the cache");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->mutex, NULL) < 0) {
+		cf_log_err_cs(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
 	return 0;
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_pap_t *inst = instance;
+
+	if (!inst->cache) return 0;
+
+	if (inst->heap) fr_heap_delete(inst->heap);
+	rbtree_free(inst->cache);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	return 0;
+}
+
+/*
+ *	Calculate the cache key for the "known good" password, and
+ *	the password the user sent.
+ */
+static void cache_key(rlm_pap_t *inst, REQUEST *request, VALUE_PAIR *vp, uint8_t key[SHA1_DIGEST_LENGTH])
+{
+	uint8_t *buffer, *p;
+	size_t len;
+
+	len = 4 + 4 + vp->vp_length + request->password->vp_length;
+	p = buffer = talloc_array(request, uint8_t, len);
+
+	/*
+	 *	Attribute number and length of the "known good"
+	 *	password, so that different schemes or boundaries
+	 *	can't produce the same input.
+	 */
+	p[0] = (vp->da->attr >> 24) & 0xff;
+	p[1] = (vp->da->attr >> 16) & 0xff;
+	p[2] = (vp->da->attr >> 8) & 0xff;
+	p[3] = vp->da->attr & 0xff;
+	p[4] = (vp->vp_length >> 24) & 0xff;
+	p[5] = (vp->vp_length >> 16) & 0xff;
+	p[6] = (vp->vp_length >> 8) & 0xff;
+	p[7] = vp->vp_length & 0xff;
+	p += 8;
+
+	memcpy(p, vp->vp_octets, vp->vp_length);
+	p += vp->vp_length;
+	memcpy(p, request->password->vp_octets, request->password->vp_length);
+
+	fr_hmac_sha1(key, buffer, len, inst->secret, sizeof(inst->secret));
+
+	memset(buffer, 0, len);
+	talloc_free(buffer);
+}
+
+/*
+ *	Remove expired entries, and if the cache is still full, the
+ *	entry which would expire soonest.  Must be called with the
+ *	mutex held.
+ */
+static void cache_expire(rlm_pap_t *inst, time_t now)
+{
+	pap_cache_entry_t *c;
+
+	while ((c = fr_heap_peek(inst->heap)) != NULL) {
+		if ((c->expires > now) &&
+		    (rbtree_num_elements(inst->cache) < inst->cache_size)) break;
+
+		fr_heap_extract(inst->heap, c);
+		rbtree_deletebydata(inst->cache, c);
+	}
+}
+
+static bool cache_find(rlm_pap_t *inst, uint8_t const key[SHA1_DIGEST_LENGTH], time_t now)
+{
+	pap_cache_entry_t my_c, *c;
+	bool found = false;
+
+	memcpy(my_c.key, key, sizeof(my_c.key));
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	c = rbtree_finddata(inst->cache, &my_c);
+	if (c) {
+		if (c->expires > now) {
+			found = true;
+		} else {
+			fr_heap_extract(inst->heap, c);
+			rbtree_deletebydata(inst->cache, c);
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	return found;
+}
+
+static void cache_insert(rlm_pap_t *inst, uint8_t const key[SHA1_DIGEST_LENGTH], time_t now)
+{
+	pap_cache_entry_t my_c, *c;
+
+	memcpy(my_c.key, key, sizeof(my_c.key));
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	c = rbtree_finddata(inst->cache, &my_c);
+	if (c) {
+		fr_heap_extract(inst->heap, c);
+	} else {
+		cache_expire(inst, now);
+
+		c = talloc_zero(inst->cache, pap_cache_entry_t);
+		memcpy(c->key, key, sizeof(c->key));
+
+		if (!rbtree_insert(inst->cache, c)) {
+			talloc_free(c);
+			goto done;
+		}
+	}
+
+	c->expires = now + inst->cache_ttl;
+	fr_heap_insert(inst->heap, c);
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+}
+
 /** Hex or base64 or bin auto-discovery
  *
  * Here we try and autodiscover what encoding was used for the password/hash, and
@@ -547,14 +757,21 @@ static rlm_rcode_t CC_HINT(nonnull) pap_auth_clear(UNUSED rlm_pap_t *inst, REQUE
 
 static rlm_rcode_t CC_HINT(nonnull) pap_auth_crypt(UNUSED rlm_pap_t *inst, REQUEST *request, VALUE_PAIR *vp)
 {
+	int rcode;
+
 	if (RDEBUG_ENABLED3) {
 		RDEBUG3("Comparing with \"known good\" Crypt-Password \"%s\"", vp->vp_strvalue);
 	} else {
 		RDEBUG("Comparing with \"known-good\" Crypt-password");
 	}
 
-	if (fr_crypt_check(request->password->vp_strvalue,
-			   vp->vp_strvalue) != 0) {
+	rcode = fr_crypt_check(request->password->vp_strvalue, vp->vp_strvalue);
+	if (rcode == -2) {
+		REDEBUG("Too many password checks waiting for a hashing thread");
+		return RLM_MODULE_FAIL;
+	}
+
+	if (rcode != 0) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
 		return RLM_MODULE_REJECT;
 	}
@@ -954,6 +1171,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 	rlm_rcode_t rc = RLM_MODULE_INVALID;
 	vp_cursor_t cursor;
 	rlm_rcode_t (*auth_func)(rlm_pap_t *, REQUEST *, VALUE_PAIR *) = NULL;
+	bool cacheable = false;
+	uint8_t key[SHA1_DIGEST_LENGTH];
 
 	if (!request->password ||
 	    (request->password->da->vendor != 0) ||
@@ -991,6 +1210,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 
 		case PW_CRYPT_PASSWORD:
 			auth_func = &pap_auth_crypt;
+			cacheable = true;
 			break;
 
 		case PW_MD5_PASSWORD:
@@ -1011,6 +1231,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 		case PW_SSHA2_384_PASSWORD:
 		case PW_SSHA2_512_PASSWORD:
 			auth_func = &pap_auth_ssha2;
+			cacheable = true;
 			break;
 #endif
 
@@ -1049,6 +1270,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 		return RLM_MODULE_FAIL;
 	}
 
+	/*
+	 *	Slow hashes may have been verified recently with
+	 *	the same password.  The key is calculated before
+	 *	auth_func() normalises the "known good" password.
+	 */
+	if (!inst->cache) cacheable = false;
+	if (cacheable) {
+		cache_key(inst, request, vp, key);
+
+		if (cache_find(inst, key, request->timestamp)) {
+			RDEBUG("Password was verified recently, skipping hash");
+			RDEBUG("User authenticated successfully");
+			return RLM_MODULE_OK;
+		}
+	}
+
 	/*
 	 *	Authenticate, and return.
 	 */
@@ -1060,6 +1297,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 
 	if (rc == RLM_MODULE_OK) {
 		RDEBUG("User authenticated successfully");
+
+		if (cacheable) cache_insert(inst, key, request->timestamp);
 	}
 
 	return rc;
@@ -1083,6 +1322,7 @@ module_t rlm_pap = {
 	.inst_size	= sizeof(rlm_pap_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -41,6 +41,26 @@ RCSID("$Id$")
 extern char **environ;
 #endif
 
+#define USEC 1000000
+
+#ifdef USE_ITHREADS
+typedef struct rlm_perl_t rlm_perl_t;
+typedef struct rlm_perl_interp rlm_perl_interp_t;
+
+/*
+ *	An interpreter in the shared pool.
+ */
+struct rlm_perl_interp {
+	rlm_perl_t		*inst;		//!< Instance this interpreter was cloned for.
+	PerlInterpreter		*perl;
+	rlm_perl_interp_t	*next;		//!< Next free interpreter.
+	rlm_perl_interp_t	*prev_held;	//!< Interpreter this thread held before checking out this one.
+	int			depth;		//!< Nested checkouts by the same thread (xlat calls from perl).
+};
+#else
+typedef struct rlm_perl_t rlm_perl_t;
+#endif
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -48,7 +68,7 @@ extern char **environ;
  *	a lot cleaner to do so, and a pointer to the structure can
  *	be used as the instance handle.
  */
-typedef struct rlm_perl_t {
+struct rlm_perl_t {
 	/* Name of the perl module */
 	char const	*module;
 
@@ -79,11 +99,21 @@ typedef struct rlm_perl_t {
 
 #ifdef USE_ITHREADS
 	pthread_mutex_t	clone_mutex;
+
+	uint32_t	interpreters;		//!< Size of the interpreter pool.  0 means one per thread.
+	rlm_perl_interp_t *interp_pool;		//!< All interpreters in the pool.
+	rlm_perl_interp_t *interp_free;		//!< Interpreters not currently checked out.
+	pthread_cond_t	interp_cond;		//!< Signalled when an interpreter is returned.
+
+	uint64_t	interp_checkouts;	//!< How many times an interpreter was taken from the pool.
+	uint64_t	interp_waits;		//!< How many of those had to wait for one.
+	uint64_t	interp_wait_total;	//!< Total time spent waiting (microseconds).
+	uint64_t	interp_wait_max;	//!< Longest single wait (microseconds).
 #endif
 
 	HV		*rad_perlconf_hv;	//!< holds "config" items (perl %RAD_PERLCONF hash).
 
-} rlm_perl_t;
+};
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -112,6 +142,9 @@ static const CONF_PARSER module_config[] = {
 	RLM_PERL_CONF(send_coa),
 #endif
 	{ "perl_flags", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_perl_t, perl_flags), NULL },
+#ifdef USE_ITHREADS
+	{ "interpreters", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_perl_t, interpreters), "0" },
+#endif
 
 	{ "func_start_accounting", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_perl_t, func_start_accounting), NULL },
 
@@ -234,18 +267,13 @@ static void rlm_perl_make_key(pthread_key_t *key)
 	pthread_key_create(key, (void (*)(void *))rlm_destroy_perl);
 }
 
-static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
+static PerlInterpreter *rlm_perl_clone_interp(PerlInterpreter *perl)
 {
-	int ret;
-
 	PerlInterpreter *interp;
 	UV clone_flags = 0;
 
 	PERL_SET_CONTEXT(perl);
 
-	interp = pthread_getspecific(*key);
-	if (interp) return interp;
-
 	interp = perl_clone(perl, clone_flags);
 	{
 		dTHXa(interp);
@@ -259,6 +287,22 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 	PERL_SET_CONTEXT(aTHX);
 	rlm_perl_clear_handles(aTHX);
 
+	return interp;
+}
+
+static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key)
+{
+	int ret;
+
+	PerlInterpreter *interp;
+
+	PERL_SET_CONTEXT(perl);
+
+	interp = pthread_getspecific(*key);
+	if (interp) return interp;
+
+	interp = rlm_perl_clone_interp(perl);
+
 	ret = pthread_setspecific(*key, interp);
 	if (ret != 0) {
 		DEBUG("rlm_perl: Failed associating interpretor with thread %s", fr_syserror(ret));
@@ -269,6 +313,156 @@ static PerlInterpreter *rlm_perl_clone(PerlInterpreter *perl, pthread_key_t *key
 
 	return interp;
 }
+
+/*
+ *	The interpreter (if any) each thread currently has checked out.
+ *	Chained through prev_held, so that nested calls into other
+ *	instances can be unwound.
+ */
+fr_thread_local_setup(rlm_perl_interp_t *, rlm_perl_held)	/* macro */
+
+/*
+ *	Clone the pool of interpreters up front, so that threads
+ *	never pay for a clone when they first call into perl.
+ */
+static int rlm_perl_pool_init(rlm_perl_t *inst)
+{
+	uint32_t i;
+
+	pthread_cond_init(&inst->interp_cond, NULL);
+
+	MEM(inst->interp_pool = talloc_zero_array(inst, rlm_perl_interp_t, inst->interpreters));
+
+	for (i = 0; i < inst->interpreters; i++) {
+		rlm_perl_interp_t *interp = &inst->interp_pool[i];
+
+		interp->inst = inst;
+		interp->perl = rlm_perl_clone_interp(inst->perl);
+		if (!interp->perl) {
+			ERROR("rlm_perl: Failed cloning interpreter %u of %u", i + 1, inst->interpreters);
+			return -1;
+		}
+
+		interp->next = inst->interp_free;
+		inst->interp_free = interp;
+	}
+
+	PERL_SET_CONTEXT(inst->perl);
+
+	DEBUG("rlm_perl: Created pool of %u interpreters", inst->interpreters);
+
+	return 0;
+}
+
+static void rlm_perl_pool_free(rlm_perl_t *inst)
+{
+	uint32_t i;
+
+	if (!inst->interp_pool) return;
+
+	for (i = 0; i < inst->interpreters; i++) {
+		if (inst->interp_pool[i].perl) rlm_destroy_perl(inst->interp_pool[i].perl);
+	}
+	TALLOC_FREE(inst->interp_pool);
+	inst->interp_free = NULL;
+
+	pthread_cond_destroy(&inst->interp_cond);
+
+	INFO("rlm_perl: Interpreter pool: %" PRIu64 " checkouts, %" PRIu64 " waits, "
+	     "%" PRIu64 "us total wait, %" PRIu64 "us max wait",
+	     inst->interp_checkouts, inst->interp_waits, inst->interp_wait_total, inst->interp_wait_max);
+}
+
+/*
+ *	Get an interpreter for the current thread.
+ *
+ *	Without a pool, this is the thread's own clone.  With a pool,
+ *	we take a free interpreter, waiting if they're all in use.
+ */
+static PerlInterpreter *rlm_perl_interp_get(rlm_perl_t *inst, REQUEST *request, rlm_perl_interp_t **interp_p)
+{
+	PerlInterpreter		*perl;
+	rlm_perl_interp_t	*interp;
+	struct timeval		start, now;
+	uint64_t		waited;
+
+	*interp_p = NULL;
+
+	if (!inst->interpreters) {
+		pthread_mutex_lock(&inst->clone_mutex);
+		perl = rlm_perl_clone(inst->perl, inst->thread_key);
+		pthread_mutex_unlock(&inst->clone_mutex);
+
+		return perl;
+	}
+
+	/*
+	 *	Perl called radiusd::xlat(), which called back into
+	 *	this instance.  Re-use the interpreter we already have,
+	 *	otherwise a full pool would deadlock.
+	 */
+	for (interp = fr_thread_local_get(rlm_perl_held); interp; interp = interp->prev_held) {
+		if (interp->inst != inst) continue;
+
+		interp->depth++;
+		*interp_p = interp;
+		return interp->perl;
+	}
+
+	pthread_mutex_lock(&inst->clone_mutex);
+	inst->interp_checkouts++;
+	if (!inst->interp_free) {
+		gettimeofday(&start, NULL);
+		inst->interp_waits++;
+
+		while (!inst->interp_free) pthread_cond_wait(&inst->interp_cond, &inst->clone_mutex);
+
+		gettimeofday(&now, NULL);
+		waited = ((uint64_t)(now.tv_sec - start.tv_sec) * USEC) + (now.tv_usec - start.tv_usec);
+		inst->interp_wait_total += waited;
+		if (waited > inst->interp_wait_max) inst->interp_wait_max = waited;
+
+		RDEBUG2("Waited %" PRIu64 "us for a free perl interpreter", waited);
+	}
+	interp = inst->interp_free;
+	inst->interp_free = interp->next;
+	pthread_mutex_unlock(&inst->clone_mutex);
+
+	interp->next = NULL;
+	interp->depth = 0;
+	interp->prev_held = fr_thread_local_get(rlm_perl_held);
+	(void) fr_thread_local_set(rlm_perl_held, interp);
+
+	*interp_p = interp;
+	return interp->perl;
+}
+
+/*
+ *	Give a pooled interpreter back.
+ */
+static void rlm_perl_interp_release(rlm_perl_t *inst, rlm_perl_interp_t *interp)
+{
+	if (!interp) return;
+
+	if (interp->depth > 0) {
+		interp->depth--;
+		return;
+	}
+
+	/*
+	 *	Put the caller's interpreter back in context, in case
+	 *	we were called from inside another perl instance.
+	 */
+	(void) fr_thread_local_set(rlm_perl_held, interp->prev_held);
+	if (interp->prev_held) PERL_SET_CONTEXT(interp->prev_held->perl);
+	interp->prev_held = NULL;
+
+	pthread_mutex_lock(&inst->clone_mutex);
+	interp->next = inst->interp_free;
+	inst->interp_free = interp;
+	pthread_cond_signal(&inst->interp_cond);
+	pthread_mutex_unlock(&inst->clone_mutex);
+}
 #endif
 
 /*
@@ -361,14 +555,13 @@ static ssize_t perl_xlat(void *instance, REQUEST *request, char const *fmt, char
 
 #ifdef USE_ITHREADS
 	PerlInterpreter *interp;
+	rlm_perl_interp_t *pooled;
 
-	pthread_mutex_lock(&inst->clone_mutex);
-	interp = rlm_perl_clone(inst->perl, inst->thread_key);
+	interp = rlm_perl_interp_get(inst, request, &pooled);
 	{
 		dTHXa(interp);
 		PERL_SET_CONTEXT(interp);
 	}
-	pthread_mutex_unlock(&inst->clone_mutex);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -426,6 +619,10 @@ static ssize_t perl_xlat(void *instance, REQUEST *request, char const *fmt, char
 
 	}
 
+#ifdef USE_ITHREADS
+	rlm_perl_interp_release(inst, pooled);
+#endif
+
 	return ret;
 }
 
@@ -617,6 +814,10 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	PL_endav = end_AV;
 
+#ifdef USE_ITHREADS
+	if (inst->interpreters && (rlm_perl_pool_init(inst) < 0)) return -1;
+#endif
+
 	return 0;
 }
 
@@ -843,17 +1044,14 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 	if (!function_name) return RLM_MODULE_FAIL;
 
 #ifdef USE_ITHREADS
-	pthread_mutex_lock(&inst->clone_mutex);
-
 	PerlInterpreter *interp;
+	rlm_perl_interp_t *pooled;
 
-	interp = rlm_perl_clone(inst->perl,inst->thread_key);
+	interp = rlm_perl_interp_get(inst, request, &pooled);
 	{
 		dTHXa(interp);
 		PERL_SET_CONTEXT(interp);
 	}
-
-	pthread_mutex_unlock(&inst->clone_mutex);
 #else
 	PERL_SET_CONTEXT(inst->perl);
 #endif
@@ -998,6 +1196,11 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 #endif
 
 	}
+
+#ifdef USE_ITHREADS
+	rlm_perl_interp_release(inst, pooled);
+#endif
+
 	return exitstatus;
 }
 
@@ -1101,6 +1304,7 @@ static int mod_detach(void *instance)
 	}
 
 #ifdef USE_ITHREADS
+	rlm_perl_pool_free(inst);
 	rlm_perl_destruct(inst->perl);
 	pthread_mutex_destroy(&inst->clone_mutex);
 #else
@@ -96,8 +96,21 @@ typedef struct rlm_python_t {
 	PyObject	*pythonconf_dict;	//!< Configuration parameters defined in the module
 						//!< made available to the python script.
 	bool 		pass_all_vps;		//!< Pass all VPS lists (request, reply, config, state, proxy_req, proxy_reply)
+	bool		native_types;		//!< Pass integer attributes as python ints, not strings.
+
+	fr_hash_table_t	*attr_names;		//!< Python strings for attribute names, so we don't
+						//!< create them on every call.  Protected by the GIL.
 } rlm_python_t;
 
+/** A cached python string for an attribute name
+ *
+ */
+typedef struct python_attr_name {
+	DICT_ATTR const	*da;			//!< Attribute the name is for.
+	int8_t		tag;			//!< Tag, which is part of the name.
+	PyObject	*name;			//!< Python string, "name" or "name:tag".
+} python_attr_name_t;
+
 /** Tracks a python module inst/thread state pair
  *
  * Multiple instances of python create multiple interpreters and each
@@ -136,6 +149,7 @@ static CONF_PARSER module_config[] = {
 	{ "python_path", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_python_t, python_path), NULL },
 	{ "cext_compat", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_python_t, cext_compat), "yes" },
 	{ "pass_all_vps", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_python_t, pass_all_vps), "no" },
+	{ "native_types", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_python_t, native_types), "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -284,7 +298,29 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
 		pStr1 = PyTuple_GET_ITEM(pTupleElement, 0);
 		pStr2 = PyTuple_GET_ITEM(pTupleElement, pairsize-1);
 
-		if ((!PyString_CheckExact(pStr1)) || (!PyString_CheckExact(pStr2))) {
+		if (!PyString_CheckExact(pStr1)) {
+			ERROR("%s - Tuple element %d of %s must be as (str, str)",
+			      funcname, i, list_name);
+			continue;
+		}
+
+		/*
+		 *	Integers are allowed as values, to match what we
+		 *	pass in when native_types is set.  PyObject_Str()
+		 *	gives us a new reference, which is dropped at the
+		 *	end of the loop.
+		 */
+		if (PyInt_CheckExact(pStr2) || PyLong_CheckExact(pStr2)) {
+			pStr2 = PyObject_Str(pStr2);
+			if (!pStr2) {
+				ERROR("%s - Failed converting value of tuple element %d of %s",
+				      funcname, i, list_name);
+				PyErr_Clear();
+				continue;
+			}
+		} else if (PyString_CheckExact(pStr2)) {
+			Py_INCREF(pStr2);
+		} else {
 			ERROR("%s - Tuple element %d of %s must be as (str, str)",
 			      funcname, i, list_name);
 			continue;
@@ -315,18 +351,18 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
 
 		if (tmpl_from_attr_str(&dst, s1, REQUEST_CURRENT, PAIR_LIST_REPLY, false, false) <= 0) {
 			ERROR("%s - Failed to find attribute %s:%s", funcname, list_name, s1);
-			continue;
+			goto next;
 		}
 
 		if (radius_request(&current, dst.tmpl_request) < 0) {
 			ERROR("%s - Attribute name %s:%s refers to outer request but not in a tunnel, skipping...",
 			      funcname, list_name, s1);
-			continue;
+			goto next;
 		}
 
 		if (!(vp = fr_pair_afrom_da(ctx, dst.tmpl_da))) {
 			ERROR("%s - Failed to create attribute %s:%s", funcname, list_name, s1);
-			continue;
+			goto next;
 		}
 
 		vp->op = op;
@@ -339,10 +375,116 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
 		}
 
 		radius_pairmove(current, vps, vp, false);
+
+	next:
+		Py_DECREF(pStr2);
 	}
 }
 
 
+static uint32_t python_attr_name_hash(void const *data)
+{
+	python_attr_name_t const *a = data;
+	uint32_t hash;
+
+	hash = fr_hash(&a->da, sizeof(a->da));
+	return fr_hash_update(&a->tag, sizeof(a->tag), hash);
+}
+
+static int python_attr_name_cmp(void const *one, void const *two)
+{
+	python_attr_name_t const *a = one, *b = two;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+
+	return a->tag - b->tag;
+}
+
+/*
+ *	Called with the GIL held, from mod_detach.
+ */
+static void python_attr_name_free(void *data)
+{
+	python_attr_name_t *a = data;
+
+	Py_XDECREF(a->name);
+	talloc_free(a);
+}
+
+/** Get the python string for an attribute's name
+ *
+ * Must be called with the GIL held.
+ *
+ * @return a new reference to the name, or NULL on error.
+ */
+static PyObject *python_attr_name(rlm_python_t *inst, VALUE_PAIR const *vp)
+{
+	python_attr_name_t find, *found;
+
+	find.da = vp->da;
+	find.tag = vp->da->flags.has_tag ? vp->tag : 0;
+
+	found = inst->attr_names ? fr_hash_table_finddata(inst->attr_names, &find) : NULL;
+	if (!found) {
+		PyObject *name;
+
+		if (vp->da->flags.has_tag) {
+			name = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
+		} else {
+			name = PyString_FromString(vp->da->name);
+		}
+		if (!name) return NULL;
+
+		/*
+		 *	Unknown attributes are allocated per-packet, so
+		 *	there's no point in caching their names.
+		 */
+		if (!inst->attr_names || vp->da->flags.is_unknown) return name;
+
+		found = talloc(NULL, python_attr_name_t);
+		found->da = find.da;
+		found->tag = find.tag;
+		found->name = name;
+
+		if (!fr_hash_table_insert(inst->attr_names, found)) {
+			talloc_free(found);
+			return name;
+		}
+	}
+
+	Py_INCREF(found->name);
+	return found->name;
+}
+
+/*
+ *	Convert integer types to python ints.
+ *
+ *	@return the new object, or NULL if the type isn't an integer.
+ */
+static PyObject *mod_populate_native(VALUE_PAIR const *vp)
+{
+	switch (vp->da->type) {
+	case PW_TYPE_BYTE:
+		return PyInt_FromLong(vp->vp_byte);
+
+	case PW_TYPE_SHORT:
+		return PyInt_FromLong(vp->vp_short);
+
+	case PW_TYPE_INTEGER:
+		return PyInt_FromSize_t(vp->vp_integer);
+
+	case PW_TYPE_SIGNED:
+		return PyInt_FromLong(vp->vp_signed);
+
+	case PW_TYPE_INTEGER64:
+		return PyLong_FromUnsignedLongLong(vp->vp_integer64);
+
+	default:
+		return NULL;
+	}
+}
+
 /*
  *	This is the core Python function that the others wrap around.
  *	Pass the value-pair print strings in a tuple.
@@ -350,23 +492,24 @@ static void mod_vptuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, PyO
  *	FIXME: We're not checking the errors. If we have errors, what
  *	do we do?
  */
-static int mod_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp)
+static int mod_populate_vptuple(rlm_python_t *inst, PyObject *pPair, VALUE_PAIR *vp)
 {
 	PyObject *pStr = NULL;
 	char buf[1024];
 
-	/* Look at the fr_pair_fprint_name? */
-
-	if (vp->da->flags.has_tag) {
-		pStr = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
-	} else {
-		pStr = PyString_FromString(vp->da->name);
-	}
-
+	pStr = python_attr_name(inst, vp);
 	if (!pStr) return -1;
 
 	PyTuple_SET_ITEM(pPair, 0, pStr);
 
+	if (inst->native_types) {
+		pStr = mod_populate_native(vp);
+		if (pStr) {
+			PyTuple_SET_ITEM(pPair, 1, pStr);
+			return 0;
+		}
+	}
+
 	vp_prints_value(buf, sizeof(buf), vp, '\0');	/* Python doesn't need any escaping */
 
 	pStr = PyString_FromString(buf);
@@ -382,7 +525,7 @@ static int mod_populate_vptuple(PyObject *pPair, VALUE_PAIR *vp)
  * the indicated position in the tuple pArgs.
  * Returns false on error.
  */
-static bool mod_populate_vps(PyObject* pArgs, const int pos, VALUE_PAIR *vps)
+static bool mod_populate_vps(rlm_python_t *inst, PyObject* pArgs, const int pos, VALUE_PAIR *vps)
 {
 	PyObject *vps_tuple = NULL;
 	int tuplelen = 0;
@@ -415,7 +558,7 @@ static bool mod_populate_vps(PyObject* pArgs, const int pos, VALUE_PAIR *vps)
 		/* The inside tuple has two only: */
 		if ((pPair = PyTuple_New(2)) == NULL) goto error;
 
-		if (mod_populate_vptuple(pPair, vp) == 0) {
+		if (mod_populate_vptuple(inst, pPair, vp) == 0) {
 			/* Put the tuple inside the container */
 			PyTuple_SET_ITEM(vps_tuple, i, pPair);
 		} else {
@@ -432,7 +575,7 @@ error:
 	return false;
 }
 
-static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char const *funcname, bool pass_all_vps)
+static rlm_rcode_t do_python_single(rlm_python_t *inst, REQUEST *request, PyObject *pFunc, char const *funcname)
 {
 	PyObject	*pRet = NULL;
 	PyObject	*pArgs = NULL;
@@ -453,31 +596,31 @@ static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char cons
 
 	/* If there is a request, fill in the first 4 attribute lists */
 	if (request != NULL) {
-		if (!mod_populate_vps(pArgs, 0, request->packet->vps) ||
-		    !mod_populate_vps(pArgs, 1, request->reply->vps) ||
-		    !mod_populate_vps(pArgs, 2, request->config) ||
-		    !mod_populate_vps(pArgs, 3, request->state)) {
+		if (!mod_populate_vps(inst, pArgs, 0, request->packet->vps) ||
+		    !mod_populate_vps(inst, pArgs, 1, request->reply->vps) ||
+		    !mod_populate_vps(inst, pArgs, 2, request->config) ||
+		    !mod_populate_vps(inst, pArgs, 3, request->state)) {
 			ret = RLM_MODULE_FAIL;
 			goto finish;
 		}
 
 		/* fill proxy vps */
 		if (request->proxy) {
-			if (!mod_populate_vps(pArgs, 4, request->proxy->vps) ||
-			    !mod_populate_vps(pArgs, 5, request->proxy_reply->vps)) {
+			if (!mod_populate_vps(inst, pArgs, 4, request->proxy->vps) ||
+			    !mod_populate_vps(inst, pArgs, 5, request->proxy_reply->vps)) {
 				ret = RLM_MODULE_FAIL;
 				goto finish;
 			}
 		}
 		/* If there are no proxy lists */
 		else {
-			mod_populate_vps(pArgs, 4, NULL);
-			mod_populate_vps(pArgs, 5, NULL);
+			mod_populate_vps(inst, pArgs, 4, NULL);
+			mod_populate_vps(inst, pArgs, 5, NULL);
 		}
 
 	}
 	/* If there is no request, set all the elements to None */
-	else for (i = 0; i < 6; i++) mod_populate_vps(pArgs, i, NULL);
+	else for (i = 0; i < 6; i++) mod_populate_vps(inst, pArgs, i, NULL);
 
 	/*
 	 * Call Python function. If pass_all_vps is true, a 6-tuple representing
@@ -485,7 +628,7 @@ static rlm_rcode_t do_python_single(REQUEST *request, PyObject *pFunc, char cons
 	 * as argument to the module callback.
 	 * Otherwise, a tuple representing just the request is passed.
 	 */
-	if (pass_all_vps)
+	if (inst->pass_all_vps)
 		pRet = PyObject_CallFunctionObjArgs(pFunc, pArgs, NULL);
 	else
 		pRet = PyObject_CallFunctionObjArgs(pFunc, PyTuple_GET_ITEM(pArgs, 0), NULL);
@@ -685,7 +828,7 @@ static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFu
 	RDEBUG3("Using thread state %p", this_thread->state);
 
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	ret = do_python_single(request, pFunc, funcname, inst->pass_all_vps);
+	ret = do_python_single(inst, request, pFunc, funcname);
 	PyEval_SaveThread();
 
 	return ret;
@@ -1058,6 +1201,13 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	if (python_interpreter_init(inst, conf) < 0) return -1;
 
+	inst->attr_names = fr_hash_table_create(python_attr_name_hash, python_attr_name_cmp,
+						python_attr_name_free);
+	if (!inst->attr_names) {
+		ERROR("Failed creating attribute name cache");
+		return -1;
+	}
+
 	/*
 	 *	Switch to our module specific main thread
 	 */
@@ -1085,7 +1235,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	/*
 	 *	Call the instantiate function.
 	 */
-	code = do_python_single(NULL, inst->instantiate.function, "instantiate", inst->pass_all_vps);
+	code = do_python_single(inst, NULL, inst->instantiate.function, "instantiate");
 	if (code < 0) {
 	error:
 		python_error_log();	/* Needs valid thread with GIL */
@@ -1107,7 +1257,7 @@ static int mod_detach(void *instance)
 	 */
 	PyEval_RestoreThread(inst->sub_interpreter);
 
-	ret = do_python_single(NULL, inst->detach.function, "detach", inst->pass_all_vps);
+	ret = do_python_single(inst, NULL, inst->detach.function, "detach");
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
 	PYTHON_FUNC_DESTROY(instantiate);
@@ -1121,6 +1271,15 @@ static int mod_detach(void *instance)
 	Py_DecRef(inst->pythonconf_dict);
 	Py_DecRef(inst->module);
 
+	/*
+	 *	The cached names are python objects, so they have
+	 *	to be released while we hold the GIL.
+	 */
+	if (inst->attr_names) {
+		fr_hash_table_free(inst->attr_names);
+		inst->attr_names = NULL;
+	}
+
 	PyEval_SaveThread();
 
 	/*
@@ -46,10 +46,7 @@ static int _mod_conn_free(REDISSOCK *dissocket)
 		dissocket->conn = NULL;
 	}
 
-	if (dissocket->reply) {
-		freeReplyObject(dissocket->reply);
-		dissocket->reply = NULL;
-	}
+	rlm_redis_finish_query(dissocket);
 
 	return 0;
 }
@@ -258,16 +255,139 @@ int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
 }
 
 /*
- *	Clear the redis reply object if any
+ *	Write all of the commands, and then read all of the replies.
+ *
+ *	Returns -1 on connection error, -2 if a query could not be
+ *	expanded, otherwise the number of replies which were errors.
+ */
+static int redis_pipeline_send(REDISSOCK *dissocket, REDIS_INST *inst, char const **queries, int num_queries,
+			       REQUEST *request)
+{
+	int i, argc, errors = 0;
+	char const *argv[MAX_REDIS_ARGS];
+	char argv_buf[MAX_QUERY_LEN];
+	redisReply *reply;
+
+	/*
+	 *	redisAppendCommandArgv() formats the command into the
+	 *	output buffer, so argv_buf can be re-used for the next
+	 *	command.  Nothing is written until we ask for a reply.
+	 */
+	for (i = 0; i < num_queries; i++) {
+		argc = rad_expand_xlat(request, queries[i], MAX_REDIS_ARGS, argv, false,
+				       sizeof(argv_buf), argv_buf);
+		if (argc <= 0) {
+			RERROR("rlm_redis (%s): Failed expanding query: \"%s\"", inst->xlat_name, queries[i]);
+			return -2;
+		}
+
+		DEBUG2("rlm_redis (%s): pipelining the query: \"%s\"", inst->xlat_name, queries[i]);
+		if (redisAppendCommandArgv(dissocket->conn, argc, argv, NULL) != REDIS_OK) return -1;
+	}
+
+	for (i = 0; i < num_queries; i++) {
+		if (redisGetReply(dissocket->conn, (void **) &reply) != REDIS_OK) return -1;
+
+		dissocket->replies[dissocket->num_replies++] = reply;
+
+		if (reply->type == REDIS_REPLY_ERROR) {
+			RERROR("rlm_redis (%s): Query failed, %s: %s", inst->xlat_name, queries[i], reply->str);
+			errors++;
+		}
+	}
+
+	return errors;
+}
+
+/*
+ *	Send several queries in one write, and read all of their
+ *	replies.  The replies are left in dissocket->replies until
+ *	rlm_redis_finish_query() is called.
+ */
+int rlm_redis_pipeline(REDISSOCK **dissocket_p, REDIS_INST *inst,
+		       char const **queries, int num_queries, REQUEST *request)
+{
+	REDISSOCK *dissocket;
+	int ret;
+
+	if (!queries || !inst || !dissocket_p || (num_queries <= 0) || (num_queries > MAX_REDIS_PIPELINE)) {
+		return -1;
+	}
+
+	dissocket = *dissocket_p;
+
+	ret = redis_pipeline_send(dissocket, inst, queries, num_queries, request);
+
+	/*
+	 *	Earlier commands may already be sitting in the output
+	 *	buffer, so the connection can't be handed to anyone else.
+	 */
+	if (ret == -2) {
+		fr_connection_close(inst->pool, dissocket);
+		*dissocket_p = NULL;
+		return -1;
+	}
+
+	if (ret < 0) {
+		RERROR("%s", dissocket->conn->errstr);
+
+		/*
+		 *	If any command got a reply then the server has
+		 *	seen it, and replaying the pipeline could apply
+		 *	it twice.
+		 */
+		if (dissocket->num_replies > 0) {
+			rlm_redis_finish_query(dissocket);
+			fr_connection_close(inst->pool, dissocket);
+			*dissocket_p = NULL;
+			return -1;
+		}
+
+		dissocket = fr_connection_reconnect(inst->pool, dissocket);
+		if (!dissocket) {
+		error:
+			*dissocket_p = NULL;
+			return -1;
+		}
+
+		ret = redis_pipeline_send(dissocket, inst, queries, num_queries, request);
+		if (ret < 0) {
+			RERROR("Failed after re-connect");
+			rlm_redis_finish_query(dissocket);
+			fr_connection_close(inst->pool, dissocket);
+			goto error;
+		}
+
+		*dissocket_p = dissocket;
+	}
+
+	if (ret > 0) return -1;
+
+	return 0;
+}
+
+/*
+ *	Clear the redis reply objects if any
  */
 int rlm_redis_finish_query(REDISSOCK *dissocket)
 {
-	if (!dissocket || !dissocket->reply) {
+	int i;
+
+	if (!dissocket || (!dissocket->reply && !dissocket->num_replies)) {
 		return -1;
 	}
 
-	freeReplyObject(dissocket->reply);
-	dissocket->reply = NULL;
+	if (dissocket->reply) {
+		freeReplyObject(dissocket->reply);
+		dissocket->reply = NULL;
+	}
+
+	for (i = 0; i < dissocket->num_replies; i++) {
+		freeReplyObject(dissocket->replies[i]);
+		dissocket->replies[i] = NULL;
+	}
+	dissocket->num_replies = 0;
+
 	return 0;
 }
 
@@ -295,6 +415,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 
 	inst->redis_query = rlm_redis_query;
+	inst->redis_pipeline = rlm_redis_pipeline;
 	inst->redis_finish_query = rlm_redis_finish_query;
 
 	return 0;
@@ -33,9 +33,20 @@ RCSIDH(rlm_redis_h, "$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <hiredis/hiredis.h>
 
+#define MAX_QUERY_LEN			4096
+#define MAX_REDIS_ARGS			16
+#define MAX_REDIS_PIPELINE		16
+
 typedef struct redis_socket_t {
 	redisContext	*conn;
 	redisReply      *reply;
+
+	/*
+	 *	Replies to a pipelined set of commands, in the
+	 *	order in which the commands were sent.
+	 */
+	redisReply	*replies[MAX_REDIS_PIPELINE];
+	int		num_replies;
 } REDISSOCK;
 
 typedef struct rlm_redis_t REDIS_INST;
@@ -50,14 +61,15 @@ typedef struct rlm_redis_t {
 	fr_connection_pool_t	*pool;
 
 	int (*redis_query)(REDISSOCK **dissocket_p, REDIS_INST *inst, char const *query, REQUEST *request);
+	int (*redis_pipeline)(REDISSOCK **dissocket_p, REDIS_INST *inst, char const **queries, int num_queries,
+			      REQUEST *request);
 	int (*redis_finish_query)(REDISSOCK *dissocket);
 } rlm_redis_t;
 
-#define MAX_QUERY_LEN			4096
-#define MAX_REDIS_ARGS			16
-
 int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
 		    char const *query, REQUEST *request);
+int rlm_redis_pipeline(REDISSOCK **dissocket_p, REDIS_INST *inst,
+		       char const **queries, int num_queries, REQUEST *request);
 int rlm_redis_finish_query(REDISSOCK *dissocket);
 
 #endif	/* RLM_REDIS_H */
@@ -83,51 +83,6 @@ static CONF_PARSER module_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
-/*
- *	Query the database executing a command with no result rows
- */
-static int rediswho_command(char const *fmt, REDISSOCK **dissocket_p,
-			    rlm_rediswho_t *inst, REQUEST *request)
-{
-	REDISSOCK *dissocket;
-	int result = 0;
-
-	if (!fmt) {
-		return 0;
-	}
-
-	if (inst->redis_inst->redis_query(dissocket_p, inst->redis_inst,
-					  fmt, request) < 0) {
-
-		ERROR("rediswho_command: database query error in: '%s'", fmt);
-		return -1;
-
-	}
-	dissocket = *dissocket_p;
-
-	switch (dissocket->reply->type) {
-	case REDIS_REPLY_INTEGER:
-		DEBUG("rediswho_command: query response %lld\n",
-		      dissocket->reply->integer);
-		if (dissocket->reply->integer > 0)
-			result = dissocket->reply->integer;
-		break;
-
-	case REDIS_REPLY_STATUS:
-	case REDIS_REPLY_STRING:
-		DEBUG("rediswho_command: query response %s\n",
-		      dissocket->reply->str);
-		break;
-
-	default:
-		break;
-	}
-
-	(inst->redis_inst->redis_finish_query)(dissocket);
-
-	return result;
-}
-
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	module_instance_t *modinst;
@@ -166,24 +121,53 @@ static int mod_accounting_all(REDISSOCK **dissocket_p,
 				   char const *trim,
 				   char const *expire)
 {
-	int result;
+	char const *queries[3];
+	int num_queries = 0;
+	int i;
+	redisReply *reply;
 
-	result = rediswho_command(insert, dissocket_p, inst, request);
-	if (result < 0) {
+	/*
+	 *	All of the commands are sent in one write, so we can't
+	 *	look at the result of the insert before deciding whether
+	 *	or not to trim.  LTRIM on a list which is already short
+	 *	enough does nothing, so just always send it.
+	 */
+	if (insert) queries[num_queries++] = insert;
+	if (trim && (inst->trim_count >= 0)) queries[num_queries++] = trim;
+	if (expire) queries[num_queries++] = expire;
+
+	if (!num_queries) return RLM_MODULE_NOOP;
+
+	if (inst->redis_inst->redis_pipeline(dissocket_p, inst->redis_inst,
+					     queries, num_queries, request) < 0) {
+		RERROR("Failed sending %i command(s) to redis", num_queries);
+		if (*dissocket_p) (inst->redis_inst->redis_finish_query)(*dissocket_p);
 		return RLM_MODULE_FAIL;
 	}
 
-	/* Only trim if necessary */
-	if (inst->trim_count >= 0 && result > inst->trim_count) {
-		if (rediswho_command(trim, dissocket_p,
-				     inst, request) < 0) {
-			return RLM_MODULE_FAIL;
+	/*
+	 *	Error replies fail the whole pipeline, and have
+	 *	already been logged by rlm_redis.
+	 */
+	for (i = 0; i < (*dissocket_p)->num_replies; i++) {
+		reply = (*dissocket_p)->replies[i];
+
+		switch (reply->type) {
+		case REDIS_REPLY_INTEGER:
+			RDEBUG("Command %i response %lld", i + 1, reply->integer);
+			break;
+
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_STRING:
+			RDEBUG("Command %i response %s", i + 1, reply->str);
+			break;
+
+		default:
+			break;
 		}
 	}
 
-	if (rediswho_command(expire, dissocket_p, inst, request) < 0) {
-		return RLM_MODULE_FAIL;
-	}
+	(inst->redis_inst->redis_finish_query)(*dissocket_p);
 
 	return RLM_MODULE_OK;
 }
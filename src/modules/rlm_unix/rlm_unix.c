@@ -58,20 +58,432 @@ USES_APPLE_DEPRECATED_API
 static char trans[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 #define ENC(c) trans[c]
 
+#ifdef HAVE_PTHREAD_H
+#  define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	The snapshot cache needs a "struct passwd" for every user,
+ *	which OSF/1 C2 security doesn't give us.
+ */
+#ifndef OSFC2
+#  define WITH_UNIX_CACHE
+#endif
+
+typedef struct unix_cache unix_cache_t;
+
 typedef struct rlm_unix {
-	char const *name;	//!< Instance name.
-	char const *radwtmp;
+	char const	*name;		//!< Instance name.
+	char const	*radwtmp;
+
+	uint32_t	cache_refresh;	//!< Rebuild the passwd/group snapshot this often.
+	unix_cache_t	*cache;		//!< Current snapshot.  NULL if caching is disabled.
+	bool		refreshing;	//!< A thread is building a new snapshot.
+	time_t		last_check;	//!< When we last looked at the files.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;		//!< Protects the fields above.
+	pthread_t	refresher;	//!< Thread building the new snapshot.
+	bool		have_refresher;	//!< refresher has to be joined.
+#endif
 } rlm_unix_t;
 
 static const CONF_PARSER module_config[] = {
 	{ "radwtmp", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED, rlm_unix_t, radwtmp), "NULL" },
+	{ "cache_refresh", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_unix_t, cache_refresh), "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+#ifdef WITH_UNIX_CACHE
+/*
+ *	A user, with everything mod_authorize() and groupcmp() need
+ *	to know about them.
+ */
+typedef struct unix_cache_user {
+	char const	*name;
+	char const	*password;	//!< From shadow if the passwd entry is a placeholder.
+	char const	*shell;
+	bool		shell_ok;	//!< Shell passed DENY_SHELL and /etc/shells.
+#ifdef HAVE_GETSPNAM
+	bool		shadow;		//!< Have shadow ageing fields.
+	long		sp_lstchg;
+	long		sp_max;
+	long		sp_expire;
+#endif
+#if defined(__FreeBSD__) || defined(bsdi) || defined(_PWF_EXPIRE)
+	time_t		pw_expire;
+#endif
+	gid_t		*gids;		//!< Primary and supplementary groups, sorted.
+	int		num_gids;
+} unix_cache_user_t;
+
+typedef struct unix_cache_group {
+	char const	*name;
+	gid_t		gid;
+} unix_cache_group_t;
+
+/*
+ *	Files we watch for changes.  A change to any of them causes
+ *	the snapshot to be rebuilt.
+ */
+static char const *unix_cache_files[] = {
+	"/etc/passwd",
+	"/etc/group",
+#ifdef HAVE_GETSPNAM
+	"/etc/shadow",
+#endif
+	NULL
+};
+
+struct unix_cache {
+	time_t			created;
+	time_t			mtime[sizeof(unix_cache_files) / sizeof(*unix_cache_files)];
+	fr_hash_table_t		*users;
+	fr_hash_table_t		*groups;
+};
+
+/*
+ *	Users and groups are both looked up by name, which is the
+ *	first field of each.
+ */
+static uint32_t unix_cache_hash(void const *data)
+{
+	char const * const *name = data;
+
+	return fr_hash_string(*name);
+}
+
+static int unix_cache_cmp(void const *one, void const *two)
+{
+	char const * const *a = one;
+	char const * const *b = two;
+
+	return strcmp(*a, *b);
+}
+
+static int gid_cmp(void const *one, void const *two)
+{
+	gid_t a = *(gid_t const *) one;
+	gid_t b = *(gid_t const *) two;
+
+	return (a > b) - (a < b);
+}
+
+static int unix_cache_sort_gids(UNUSED void *ctx, void *data)
+{
+	unix_cache_user_t *user = data;
+
+	qsort(user->gids, user->num_gids, sizeof(*user->gids), gid_cmp);
+
+	return 0;
+}
+
+static int _unix_cache_free(unix_cache_t *cache)
+{
+	fr_hash_table_free(cache->users);
+	fr_hash_table_free(cache->groups);
+
+	return 0;
+}
+
+/*
+ *	Record the modification times of the files we watch.
+ */
+static void unix_cache_mtimes(time_t *mtime)
+{
+	int		i;
+	struct stat	st;
+
+	for (i = 0; unix_cache_files[i]; i++) {
+		mtime[i] = (stat(unix_cache_files[i], &st) == 0) ? st.st_mtime : 0;
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	setpwent() and friends have one cursor per process, so only
+ *	one instance may walk the databases at a time.
+ */
+static pthread_mutex_t unix_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ *	Walk the passwd, shadow and group databases, and build a new
+ *	snapshot.  Must be called with unix_cache_mutex held.
+ */
+static unix_cache_t *unix_cache_enumerate(rlm_unix_t const *inst)
+{
+	unix_cache_t		*cache;
+	unix_cache_user_t	*user;
+	unix_cache_group_t	*group;
+	struct passwd		*pwd;
+	struct group		*grp;
+	char			**member;
+#ifdef HAVE_GETSPNAM
+	fr_hash_table_t		*shadow;
+	TALLOC_CTX		*shadow_ctx;
+	struct spwd		*spwd;
+	unix_cache_user_t	*sp;
+#endif
+#ifdef HAVE_GETUSERSHELL
+	char			**shells = NULL;
+	char			*shell;
+	bool			any_shell = false;
+	int			i;
+#endif
+
+	cache = talloc_zero(NULL, unix_cache_t);
+	if (!cache) return NULL;
+	talloc_set_destructor(cache, _unix_cache_free);
+
+	unix_cache_mtimes(cache->mtime);
+	cache->created = time(NULL);
+
+	cache->users = fr_hash_table_create(unix_cache_hash, unix_cache_cmp, NULL);
+	cache->groups = fr_hash_table_create(unix_cache_hash, unix_cache_cmp, NULL);
+	if (!cache->users || !cache->groups) {
+	error:
+		talloc_free(cache);
+		return NULL;
+	}
+
+#ifdef HAVE_GETUSERSHELL
+	/*
+	 *	Read /etc/shells once, rather than once per user.
+	 */
+	while ((shell = getusershell()) != NULL) {
+		if (strcmp(shell, "/RADIUSD/ANY/SHELL") == 0) any_shell = true;
+
+		shells = talloc_realloc(cache, shells, char *, talloc_array_length(shells) + 1);
+		shells[talloc_array_length(shells) - 1] = talloc_typed_strdup(shells, shell);
+	}
+	endusershell();
+#endif
+
+#ifdef HAVE_GETSPNAM
+	/*
+	 *	Shadow entries go into a temporary table, and are
+	 *	merged into the users below.  If we can't read the
+	 *	shadow file, the table stays empty, and users who
+	 *	need it are looked up the slow way.
+	 */
+	shadow = fr_hash_table_create(unix_cache_hash, unix_cache_cmp, NULL);
+	if (!shadow) goto error;
+	shadow_ctx = talloc_new(cache);
+
+	setspent();
+	while ((spwd = getspent()) != NULL) {
+		sp = talloc_zero(shadow_ctx, unix_cache_user_t);
+		sp->name = talloc_typed_strdup(sp, spwd->sp_namp);
+		sp->password = talloc_typed_strdup(sp, spwd->sp_pwdp);
+		sp->sp_lstchg = spwd->sp_lstchg;
+		sp->sp_max = spwd->sp_max;
+		sp->sp_expire = spwd->sp_expire;
+		if (!fr_hash_table_insert(shadow, sp)) talloc_free(sp);
+	}
+	endspent();
+#endif
+
+	setpwent();
+	while ((pwd = getpwent()) != NULL) {
+		user = talloc_zero(cache, unix_cache_user_t);
+		user->name = talloc_typed_strdup(user, pwd->pw_name);
+		user->password = talloc_typed_strdup(user, pwd->pw_passwd);
+		user->shell = talloc_typed_strdup(user, pwd->pw_shell);
+		user->shell_ok = true;
+
+#ifdef DENY_SHELL
+		if (strcmp(user->shell, DENY_SHELL) == 0) user->shell_ok = false;
+#endif
+#ifdef HAVE_GETUSERSHELL
+		if (user->shell_ok && !any_shell) {
+			for (i = 0; i < (int) talloc_array_length(shells); i++) {
+				if (strcmp(shells[i], user->shell) == 0) break;
+			}
+			if (i == (int) talloc_array_length(shells)) user->shell_ok = false;
+		}
+#endif
+#if defined(__FreeBSD__) || defined(bsdi) || defined(_PWF_EXPIRE)
+		user->pw_expire = pwd->pw_expire;
+#endif
+
+#ifdef HAVE_GETSPNAM
+		/*
+		 *	Same rule as mod_authorize(), a short passwd
+		 *	field means the real one is in shadow.  Users
+		 *	we can't find there are left out of the cache.
+		 */
+		if (strlen(user->password) < 10) {
+			sp = fr_hash_table_finddata(shadow, user);
+			if (!sp) {
+				talloc_free(user);
+				continue;
+			}
+			user->password = talloc_steal(user, sp->password);
+			user->shadow = true;
+			user->sp_lstchg = sp->sp_lstchg;
+			user->sp_max = sp->sp_max;
+			user->sp_expire = sp->sp_expire;
+		}
+#endif
+
+		user->gids = talloc_array(user, gid_t, 1);
+		user->gids[0] = pwd->pw_gid;
+		user->num_gids = 1;
+
+		if (!fr_hash_table_insert(cache->users, user)) talloc_free(user);
+	}
+	endpwent();
+
+#ifdef HAVE_GETSPNAM
+	fr_hash_table_free(shadow);
+	talloc_free(shadow_ctx);
+#endif
+
+	/*
+	 *	Index the groups by name, and add each group to the
+	 *	set of its members.
+	 */
+	setgrent();
+	while ((grp = getgrent()) != NULL) {
+		group = talloc_zero(cache, unix_cache_group_t);
+		group->name = talloc_typed_strdup(group, grp->gr_name);
+		group->gid = grp->gr_gid;
+		if (!fr_hash_table_insert(cache->groups, group)) talloc_free(group);
+
+		for (member = grp->gr_mem; *member; member++) {
+			char const *name = *member;
+
+			user = fr_hash_table_finddata(cache->users, &name);
+			if (!user) continue;
+
+			user->gids = talloc_realloc(user, user->gids, gid_t, user->num_gids + 1);
+			user->gids[user->num_gids++] = grp->gr_gid;
+		}
+	}
+	endgrent();
+
+	fr_hash_table_walk(cache->users, unix_cache_sort_gids, NULL);
+
+#ifdef HAVE_GETUSERSHELL
+	talloc_free(shells);
+#endif
+
+	DEBUG("rlm_unix (%s): Cached %i users and %i groups", inst->name,
+	      fr_hash_table_num_elements(cache->users), fr_hash_table_num_elements(cache->groups));
+
+	return cache;
+}
+
+static unix_cache_t *unix_cache_build(rlm_unix_t const *inst)
+{
+	unix_cache_t *cache;
+
+	PTHREAD_MUTEX_LOCK(&unix_cache_mutex);
+	cache = unix_cache_enumerate(inst);
+	PTHREAD_MUTEX_UNLOCK(&unix_cache_mutex);
+
+	return cache;
+}
+
+/*
+ *	Build a new snapshot, and swap it for the old one.
+ */
+static void unix_cache_refresh(rlm_unix_t *inst)
+{
+	unix_cache_t *cache, *old;
+
+	cache = unix_cache_build(inst);
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	if (cache) {
+		old = inst->cache;
+		inst->cache = cache;
+		talloc_free(old);
+	} else {
+		ERROR("rlm_unix (%s): Failed rebuilding cache, keeping the old one", inst->name);
+	}
+	inst->refreshing = false;
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *unix_cache_refresh_thread(void *arg)
+{
+	unix_cache_refresh(arg);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Rebuild the snapshot if it's older than cache_refresh, or if
+ *	any of the files have changed.  The files are checked at most
+ *	once a second.
+ *
+ *	The new snapshot is built in its own thread, and requests
+ *	carry on using the old one until it's ready.
+ */
+static void unix_cache_check(rlm_unix_t *inst, time_t now)
+{
+	int		i;
+	time_t		mtime[sizeof(unix_cache_files) / sizeof(*unix_cache_files)];
+	bool		rebuild;
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	if (inst->refreshing || (now == inst->last_check)) {
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+		return;
+	}
+	inst->last_check = now;
+
+	rebuild = (now >= (inst->cache->created + (time_t) inst->cache_refresh));
+	if (!rebuild) {
+		unix_cache_mtimes(mtime);
+		for (i = 0; unix_cache_files[i]; i++) {
+			if (mtime[i] != inst->cache->mtime[i]) {
+				rebuild = true;
+				break;
+			}
+		}
+	}
+	if (!rebuild) {
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+		return;
+	}
+	inst->refreshing = true;
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	The previous refresher has finished, as refreshing
+	 *	was false, so this doesn't block.
+	 */
+	if (inst->have_refresher) {
+		pthread_join(inst->refresher, NULL);
+		inst->have_refresher = false;
+	}
+
+	i = pthread_create(&inst->refresher, NULL, unix_cache_refresh_thread, inst);
+	if (i == 0) {
+		inst->have_refresher = true;
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+		return;
+	}
+	ERROR("rlm_unix (%s): Failed starting cache refresh thread: %s", inst->name, fr_syserror(i));
+#endif
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	unix_cache_refresh(inst);
+}
+#endif	/* WITH_UNIX_CACHE */
+
 /*
  *	The Group = handler.
  */
-static int groupcmp(UNUSED void *instance, REQUEST *request, UNUSED VALUE_PAIR *req_vp,
+static int groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req_vp,
 		    VALUE_PAIR *check, UNUSED VALUE_PAIR *check_pairs,
 		    UNUSED VALUE_PAIR **reply_pairs)
 {
@@ -79,12 +491,41 @@ static int groupcmp(UNUSED void *instance, REQUEST *request, UNUSED VALUE_PAIR *
 	struct group	*grp;
 	char		**member;
 	int		retval = -1;
+#ifdef WITH_UNIX_CACHE
+	rlm_unix_t	*inst = instance;
+	unix_cache_user_t	*user;
+	unix_cache_group_t	*group;
+	bool		found = false;
+#endif
 
 	/*
 	 *	No user name, can't compare.
 	 */
 	if (!request->username) return -1;
 
+#ifdef WITH_UNIX_CACHE
+	/*
+	 *	If both the user and the group are in the snapshot,
+	 *	the answer is there too.  Otherwise fall back to
+	 *	asking the system.
+	 */
+	if (inst->cache) {
+		unix_cache_check(inst, request->timestamp);
+
+		PTHREAD_MUTEX_LOCK(&inst->mutex);
+		user = fr_hash_table_finddata(inst->cache->users, &request->username->vp_strvalue);
+		group = fr_hash_table_finddata(inst->cache->groups, &check->vp_strvalue);
+		if (user && group) {
+			found = true;
+			if (bsearch(&group->gid, user->gids, user->num_gids,
+				    sizeof(*user->gids), gid_cmp)) retval = 0;
+		}
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+		if (found) return retval;
+	}
+#endif
+
 	if (rad_getpwnam(request, &pwd, request->username->vp_strvalue) < 0) {
 		RDEBUG("%s", fr_strerror());
 		return -1;
@@ -173,12 +614,81 @@ static int mod_bootstrap(CONF_SECTION *conf, void *instance)
 }
 
 
+#ifdef WITH_UNIX_CACHE
+/*
+ *	The same checks as mod_authorize(), against the snapshot.
+ *
+ *	Returns false if the user isn't in the snapshot, in which
+ *	case the caller should ask the system.
+ */
+static bool unix_cache_authorize(rlm_unix_t *inst, REQUEST *request, char const *name, rlm_rcode_t *rcode)
+{
+	unix_cache_user_t	*user;
+
+	unix_cache_check(inst, request->timestamp);
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	user = fr_hash_table_finddata(inst->cache->users, &name);
+	if (!user) {
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+		return false;
+	}
+
+	if (!user->shell_ok) {
+		RAUTH("[%s]: invalid shell [%s]", name, user->shell);
+		*rcode = RLM_MODULE_REJECT;
+		goto finish;
+	}
+
+#if defined(HAVE_GETSPNAM) && !defined(M_UNIX)
+	if (user->shadow && user->sp_lstchg > 0 && user->sp_max >= 0 &&
+	    (request->timestamp / 86400) > (user->sp_lstchg + user->sp_max)) {
+		RAUTH("[%s]: password has expired", name);
+		*rcode = RLM_MODULE_REJECT;
+		goto finish;
+	}
+
+	if (user->shadow && user->sp_expire > 0 &&
+	    (request->timestamp / 86400) > user->sp_expire) {
+		RAUTH("[%s]: account has expired", name);
+		*rcode = RLM_MODULE_REJECT;
+		goto finish;
+	}
+#endif
+
+#if defined(__FreeBSD__) || defined(bsdi) || defined(_PWF_EXPIRE)
+	if ((user->pw_expire > 0) &&
+	    (request->timestamp > user->pw_expire)) {
+		RAUTH("[%s]: password has expired", name);
+		*rcode = RLM_MODULE_REJECT;
+		goto finish;
+	}
+#endif
+
+	if (user->password[0] == 0) {
+		*rcode = RLM_MODULE_NOOP;
+		goto finish;
+	}
+
+	*rcode = pair_make_config("Crypt-Password", user->password, T_OP_SET) ?
+		 RLM_MODULE_UPDATED : RLM_MODULE_FAIL;
+
+finish:
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+	return true;
+}
+#endif
+
 /*
  *	Pull the users password from where-ever, and add it to
  *	the given vp list.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *request)
 {
+#ifdef WITH_UNIX_CACHE
+	rlm_unix_t	*inst = instance;
+	rlm_rcode_t	rcode;
+#endif
 	char const	*name;
 	char const	*encrypted_pass;
 #ifdef HAVE_GETSPNAM
@@ -205,6 +715,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, REQUEST
 	name = request->username->vp_strvalue;
 	encrypted_pass = NULL;
 
+#ifdef WITH_UNIX_CACHE
+	if (inst->cache && unix_cache_authorize(inst, request, name, &rcode)) return rcode;
+#endif
+
 #ifdef OSFC2
 	if ((pr_pw = getprpwnam(name)) == NULL)
 		return RLM_MODULE_NOTFOUND;
@@ -321,6 +835,56 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, REQUEST
 }
 
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_unix_t *inst = instance;
+
+	if (!inst->cache_refresh) return 0;
+
+#ifdef WITH_UNIX_CACHE
+	FR_INTEGER_BOUND_CHECK("cache_refresh", inst->cache_refresh, >=, 10);
+	FR_INTEGER_BOUND_CHECK("cache_refresh", inst->cache_refresh, <=, 86400);
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->mutex, NULL) < 0) {
+		cf_log_err_cs(conf, "Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	inst->cache = unix_cache_build(inst);
+	if (!inst->cache) {
+		cf_log_err_cs(conf, "Failed building passwd/group cache");
+		return -1;
+	}
+#else
+	WARN("rlm_unix (%s): Ignoring \"cache_refresh\", caching is not supported on this system", inst->name);
+	inst->cache_refresh = 0;
+#endif
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_unix_t *inst = instance;
+
+	if (!inst->cache_refresh) return 0;
+
+#ifdef WITH_UNIX_CACHE
+#ifdef HAVE_PTHREAD_H
+	if (inst->have_refresher) pthread_join(inst->refresher, NULL);
+#endif
+	TALLOC_FREE(inst->cache);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+#endif
+
+	return 0;
+}
+
+
 /*
  *	UUencode 4 bits base64. We use this to turn a 4 byte field
  *	(an IP address) into 6 bytes of ASCII. This is used for the
@@ -539,6 +1103,8 @@ module_t rlm_unix = {
 	.inst_size	= sizeof(rlm_unix_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_ACCOUNTING]	= mod_accounting
@@ -52,6 +52,11 @@ pid_t rad_waitpid(pid_t pid, int *status)
 {
 	return waitpid(pid, status, 0);
 }
+
+pid_t rad_waitpid_timeout(pid_t pid, int *status, UNUSED int timeout)
+{
+	return waitpid(pid, status, WNOHANG);
+}
 #endif
 
 rlm_rcode_t indexed_modcall(UNUSED rlm_components_t comp, UNUSED int idx, UNUSED REQUEST *request)